@@ -0,0 +1,172 @@
+#include "bench/benchmark.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "profile/clock.hpp"
+
+namespace {
+
+volatile uint64_t result_sink = 0;
+
+double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  size_t mid = values.size() / 2;
+  if (values.size() % 2 == 1) {
+    return values[mid];
+  }
+  return (values[mid - 1] + values[mid]) / 2;
+}
+
+BenchmarkRunner::Result Summarize(const std::string& name,
+                                  const std::vector<double>& times,
+                                  uint64_t items) {
+  BenchmarkRunner::Result result;
+  result.name = name;
+  result.items = items;
+  result.median = Median(times);
+  result.min = *std::min_element(times.begin(), times.end());
+  for (double time : times) {
+    result.mean += time;
+  }
+  result.mean /= times.size();
+  if (times.size() > 1) {
+    double variance = 0.0;
+    for (double time : times) {
+      variance += (time - result.mean) * (time - result.mean);
+    }
+    result.stddev = std::sqrt(variance / (times.size() - 1));
+  }
+  return result;
+}
+
+void PrintResult(const BenchmarkRunner::Result& result) {
+  std::cout << std::left << std::setw(36) << result.name << std::right
+            << std::fixed << std::setprecision(3) << std::setw(12)
+            << result.median * 1e3 << std::setw(12) << result.min * 1e3
+            << std::setw(9) << std::setprecision(1)
+            << (result.mean > 0 ? 100 * result.stddev / result.mean : 0.0)
+            << "%";
+  if (result.items > 0 && result.median > 0) {
+    std::cout << std::setw(14) << std::setprecision(2)
+              << result.items / result.median / 1e6;
+  }
+  std::cout << std::defaultfloat << std::endl;
+}
+
+}  // namespace
+
+BenchmarkRunner::BenchmarkRunner(Options options) : options_(options) {
+  options_.repetitions = std::max(options_.repetitions, 1);
+}
+
+bool BenchmarkRunner::Enabled(const std::string& name) const {
+  return name.find(options_.filter) != std::string::npos;
+}
+
+void BenchmarkRunner::Run(const std::string& name,
+                          const std::function<void()>& body, uint64_t items,
+                          const std::function<void()>& setup) {
+  if (!Enabled(name)) {
+    return;
+  }
+  std::cerr << "Running " << name << std::endl;
+  if (setup) {
+    setup();
+  }
+  body();
+  std::vector<double> times;
+  for (int i = 0; i < options_.repetitions; i++) {
+    if (setup) {
+      setup();
+    }
+    double start = Seconds();
+    body();
+    times.push_back(Seconds() - start);
+  }
+  results_.push_back(Summarize(name, times, items));
+}
+
+int BenchmarkRunner::Finish() {
+  std::cout << std::left << std::setw(36) << "case" << std::right
+            << std::setw(12) << "median_ms" << std::setw(12) << "min_ms"
+            << std::setw(10) << "cv" << std::setw(14) << "Mitems/s"
+            << std::endl;
+  for (const Result& result : results_) {
+    PrintResult(result);
+  }
+  if (!options_.save_baseline_path.empty()) {
+    WriteBaseline(options_.save_baseline_path, results_);
+  }
+  if (options_.baseline_path.empty()) {
+    return 0;
+  }
+
+  std::map<std::string, double> baseline = ReadBaseline(options_.baseline_path);
+  int regressions = 0;
+  std::cout << std::endl << "Against " << options_.baseline_path << ":"
+            << std::endl;
+  for (const Result& result : results_) {
+    auto it = baseline.find(result.name);
+    if (it == baseline.end() || it->second <= 0) {
+      std::cout << std::left << std::setw(36) << result.name
+                << "not in baseline" << std::right << std::endl;
+      continue;
+    }
+    double change = result.median / it->second - 1;
+    bool regressed = change > options_.tolerance;
+    regressions += regressed;
+    std::cout << std::left << std::setw(36) << result.name << std::right
+              << std::fixed << std::setprecision(1) << std::showpos
+              << std::setw(8) << 100 * change << "%" << std::noshowpos
+              << std::defaultfloat << (regressed ? "  REGRESSION" : "")
+              << std::endl;
+  }
+  return regressions;
+}
+
+std::map<std::string, double> ReadBaseline(const std::string& path) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Failed to read benchmark baseline " << path << std::endl;
+    exit(-1);
+  }
+  std::map<std::string, double> medians;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::stringstream fields(line);
+    std::string name;
+    double median;
+    if (!(fields >> name >> median)) {
+      std::cerr << "Malformed line in benchmark baseline " << path << ": "
+                << line << std::endl;
+      exit(-1);
+    }
+    medians[name] = median;
+  }
+  return medians;
+}
+
+void WriteBaseline(const std::string& path,
+                   const std::vector<BenchmarkRunner::Result>& results) {
+  std::ofstream out(path, std::ios::trunc);
+  out << "# glitter_bench baseline: case, median seconds" << std::endl;
+  out << std::setprecision(9);
+  for (const BenchmarkRunner::Result& result : results) {
+    out << result.name << " " << result.median << std::endl;
+  }
+  if (!out) {
+    std::cerr << "Failed to write benchmark baseline " << path << std::endl;
+    exit(-1);
+  }
+}
+
+void KeepResult(uint64_t value) { result_sink = result_sink + value; }
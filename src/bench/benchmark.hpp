@@ -0,0 +1,71 @@
+#ifndef BENCH_BENCHMARK_HPP
+#define BENCH_BENCHMARK_HPP
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// Times named cases over several repetitions, reports the median and spread
+// of each, and compares the medians against a baseline file from an earlier
+// run.
+class BenchmarkRunner {
+ public:
+  struct Options {
+    // Timed runs of each case. The first run is not counted, so that caches
+    // and allocators are warm.
+    int repetitions = 5;
+    // Only cases whose names contain this run.
+    std::string filter;
+    // If set, medians are compared against the baseline in this file.
+    std::string baseline_path;
+    // If set, the medians of this run are written here as a new baseline.
+    std::string save_baseline_path;
+    // A case regresses if its median exceeds the baseline's by more than
+    // this fraction.
+    double tolerance = 0.1;
+  };
+
+  struct Result {
+    std::string name;
+    double median = 0.0;
+    double mean = 0.0;
+    double stddev = 0.0;
+    double min = 0.0;
+    // Work done per run, e.g. rays traced, for a throughput column. Zero if
+    // none.
+    uint64_t items = 0;
+  };
+
+  explicit BenchmarkRunner(Options options);
+
+  // Whether `name` passes the filter. Cases with expensive setup check this
+  // first.
+  bool Enabled(const std::string& name) const;
+  // Times `body`, which should do the same work each call, unless `name` is
+  // filtered out. Names may not contain whitespace. If set, `setup` runs
+  // untimed before each call, e.g. to restore state that `body` changes.
+  void Run(const std::string& name, const std::function<void()>& body,
+           uint64_t items = 0, const std::function<void()>& setup = nullptr);
+  // Prints the results, writes the new baseline if asked and compares them
+  // against the old one. Returns the number of regressions.
+  int Finish();
+
+  const std::vector<Result>& results() const { return results_; }
+
+ private:
+  Options options_;
+  std::vector<Result> results_;
+};
+
+// Reads the medians of a baseline file, by case name. Exits on failure.
+std::map<std::string, double> ReadBaseline(const std::string& path);
+// Exits on failure.
+void WriteBaseline(const std::string& path,
+                   const std::vector<BenchmarkRunner::Result>& results);
+
+// Keeps the compiler from discarding the work that produced `value`.
+void KeepResult(uint64_t value);
+
+#endif
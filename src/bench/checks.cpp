@@ -0,0 +1,200 @@
+#include "bench/checks.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "scene/primitives.hpp"
+#include "tracer/float_triangle_soa.hpp"
+#include "tracer/triangle_soa.hpp"
+
+namespace {
+
+constexpr int kCheckTriangles = 4000;
+constexpr int kCheckRays = 3000;
+
+#if defined(__AVX2__)
+constexpr const char* kSimdKernel = "AVX2";
+#elif defined(__SSE2__)
+constexpr const char* kSimdKernel = "SSE2";
+#else
+constexpr const char* kSimdKernel = "scalar";
+#endif
+
+// Small triangles scattered through [-1, 1]^3.
+std::vector<std::array<DVec3, 3>> GetRandomTriangles(
+    std::default_random_engine* random_gen) {
+  std::uniform_real_distribution<double> unit(-1.0, 1.0);
+  std::vector<std::array<DVec3, 3>> triangles(kCheckTriangles);
+  for (std::array<DVec3, 3>& verts : triangles) {
+    verts[0] = DVec3(unit(*random_gen), unit(*random_gen), unit(*random_gen));
+    for (int i = 1; i < 3; i++) {
+      verts[i] = verts[0] + 0.2 * DVec3(unit(*random_gen), unit(*random_gen),
+                                        unit(*random_gen));
+    }
+  }
+  return triangles;
+}
+
+// Rays from around the triangles through them. Every fourth ray is aimed
+// exactly at a vertex, where edge tests are on their boundaries, and every
+// fourth passes through one along an axis, which makes the edge functions of
+// the float test exactly zero.
+std::vector<Ray> GetCheckRays(
+    const std::vector<std::array<DVec3, 3>>& triangles,
+    std::default_random_engine* random_gen) {
+  std::uniform_real_distribution<double> unit(-2.0, 2.0);
+  std::uniform_int_distribution<size_t> pick(0, triangles.size() - 1);
+  std::vector<Ray> rays(kCheckRays);
+  for (size_t i = 0; i < rays.size(); i++) {
+    Ray& ray = rays[i];
+    ray.origin =
+        DVec3(unit(*random_gen), unit(*random_gen), unit(*random_gen));
+    DVec3 target = 0.5 * DVec3(unit(*random_gen), unit(*random_gen),
+                               unit(*random_gen));
+    if (i % 4 == 0) {
+      target = triangles[pick(*random_gen)][i / 4 % 3];
+    }
+    ray.dir = glm::normalize(target - ray.origin);
+    if (i % 4 == 2) {
+      DVec3 axis(0.0);
+      axis[i / 4 % 3] = 1.0;
+      ray.origin = triangles[pick(*random_gen)][i / 4 % 3] - 3.0 * axis;
+      ray.dir = axis;
+    }
+  }
+  return rays;
+}
+
+bool SameBits(double a, double b) {
+  return a == b || (std::isnan(a) && std::isnan(b));
+}
+
+struct LaneCounts {
+  uint64_t hits = 0;
+  uint64_t mismatches = 0;
+};
+
+// Compares a block's results from a kernel with its reference's, and prints
+// the first few that differ.
+void CompareLanes(const char* store, size_t first, const double* t,
+                  const double* u, const double* v, const double* ref_t,
+                  const double* ref_u, const double* ref_v,
+                  LaneCounts* counts) {
+  for (int lane = 0; lane < TriangleSoa::kWidth; lane++) {
+    bool hit = !std::isinf(ref_t[lane]);
+    counts->hits += hit;
+    if (SameBits(t[lane], ref_t[lane]) &&
+        (!hit || (SameBits(u[lane], ref_u[lane]) &&
+                  SameBits(v[lane], ref_v[lane])))) {
+      continue;
+    }
+    if (counts->mismatches++ < 10) {
+      std::cerr << store << " mismatch on triangle " << first + lane << ": t "
+                << t[lane] << " vs " << ref_t[lane] << ", u " << u[lane]
+                << " vs " << ref_u[lane] << ", v " << v[lane] << " vs "
+                << ref_v[lane] << std::endl;
+    }
+  }
+}
+
+bool Report(const char* store, const char* kernel, const LaneCounts& counts) {
+  std::cerr << store << " " << kernel << " kernel against scalar: "
+            << counts.mismatches << " mismatches, " << counts.hits << " hits"
+            << std::endl;
+  return counts.mismatches == 0;
+}
+
+}  // namespace
+
+bool CheckTriangleSoa(unsigned int seed) {
+  std::default_random_engine random_gen(seed);
+  std::vector<std::array<DVec3, 3>> triangles =
+      GetRandomTriangles(&random_gen);
+  std::vector<Ray> rays = GetCheckRays(triangles, &random_gen);
+  TriangleSoa soa;
+  for (const std::array<DVec3, 3>& verts : triangles) {
+    soa.Add(verts);
+  }
+  soa.Pad();
+
+  constexpr int kWidth = TriangleSoa::kWidth;
+  LaneCounts counts;
+  for (const Ray& ray : rays) {
+    TriangleSoa::BlockRay block_ray = {ray.origin, ray.dir};
+    for (size_t first = 0; first < soa.size(); first += kWidth) {
+      double t[kWidth], u[kWidth], v[kWidth];
+      double ref_t[kWidth], ref_u[kWidth], ref_v[kWidth];
+      soa.IntersectBlock(block_ray, first, t, u, v);
+      soa.IntersectBlockScalar(block_ray, first, ref_t, ref_u, ref_v);
+      CompareLanes("TriangleSoa", first, t, u, v, ref_t, ref_u, ref_v,
+                   &counts);
+    }
+  }
+  return Report("TriangleSoa", kSimdKernel, counts);
+}
+
+bool CheckFloatTriangleSoa(unsigned int seed) {
+  std::default_random_engine random_gen(seed);
+  std::vector<std::array<DVec3, 3>> triangles =
+      GetRandomTriangles(&random_gen);
+  std::vector<Ray> rays = GetCheckRays(triangles, &random_gen);
+  FloatTriangleSoa soa;
+  for (const std::array<DVec3, 3>& verts : triangles) {
+    soa.Add(verts);
+  }
+  while (soa.size() % FloatTriangleSoa::kWidth != 0) {
+    soa.AddPadding();
+  }
+
+  constexpr int kWidth = FloatTriangleSoa::kWidth;
+  // Half the rays also stop short, to cover the distance limit.
+  std::uniform_real_distribution<double> limit(0.5, 4.0);
+  LaneCounts counts;
+  for (size_t i = 0; i < rays.size(); i++) {
+    FloatTriangleSoa::BlockRay block_ray =
+        FloatTriangleSoa::GetBlockRay(rays[i].origin, rays[i].dir);
+    double max_t = i % 2 == 0 ? std::numeric_limits<double>::infinity()
+                              : limit(random_gen);
+    for (size_t first = 0; first < soa.size(); first += kWidth) {
+      double t[kWidth], u[kWidth], v[kWidth];
+      double ref_t[kWidth], ref_u[kWidth], ref_v[kWidth];
+      soa.IntersectBlock(block_ray, first, max_t, t, u, v);
+      soa.IntersectBlockScalar(block_ray, first, max_t, ref_t, ref_u, ref_v);
+      CompareLanes("FloatTriangleSoa", first, t, u, v, ref_t, ref_u, ref_v,
+                   &counts);
+    }
+  }
+#if defined(__SSE2__)
+  return Report("FloatTriangleSoa", "SSE2", counts);
+#else
+  return Report("FloatTriangleSoa", "scalar", counts);
+#endif
+}
+
+double ImagePsnr(const Texture& image, const Texture& reference) {
+  if (image.width != reference.width || image.height != reference.height ||
+      image.num_components != reference.num_components) {
+    return 0.0;
+  }
+  double squared_error = 0.0;
+  int row_size = image.width * image.num_components;
+  for (int y = 0; y < image.height; y++) {
+    const unsigned char* row = image.data + image.row_alignment * y;
+    const unsigned char* ref_row =
+        reference.data + reference.row_alignment * y;
+    for (int i = 0; i < row_size; i++) {
+      double diff = (double)row[i] - ref_row[i];
+      squared_error += diff * diff;
+    }
+  }
+  if (squared_error == 0.0) {
+    return std::numeric_limits<double>::infinity();
+  }
+  double mse = squared_error / ((double)row_size * image.height);
+  return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
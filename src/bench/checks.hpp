@@ -0,0 +1,24 @@
+#ifndef BENCH_CHECKS_HPP
+#define BENCH_CHECKS_HPP
+
+#include "scene/primitives.hpp"
+
+// Checks that the tracer's fast paths agree with their reference versions,
+// on fixed seeds. Each prints what differs and returns whether everything
+// agreed.
+
+// Tests random triangles with `TriangleSoa::IntersectBlock`, which uses
+// whichever SIMD kernel was compiled in, and with `IntersectBlockScalar`,
+// and requires bit-identical distances and barycentrics.
+bool CheckTriangleSoa(unsigned int seed);
+// The same for `FloatTriangleSoa`, whose SSE2 kernel leaves blocks where an
+// edge function is zero to the scalar one, with and without a distance
+// limit.
+bool CheckFloatTriangleSoa(unsigned int seed);
+
+// The peak signal to noise ratio of `image` against `reference`, in dB, over
+// every channel. Infinite if they are identical, and zero if their sizes
+// differ.
+double ImagePsnr(const Texture& image, const Texture& reference);
+
+#endif
@@ -0,0 +1,380 @@
+// Headless benchmarks of the tracer and the scene generators, with fixed
+// seeds so that every run does the same work, and checks that the tracer's
+// fast paths agree with their references.
+//
+//   glitter_bench [--filter=S] [--repetitions=N] [--baseline=PATH]
+//                 [--save-baseline=PATH] [--tolerance=F]
+//
+// Exits with 1 if any check failed or any case regressed against
+// `--baseline`.
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bench/benchmark.hpp"
+#include "bench/checks.hpp"
+#include "boids/simulation.hpp"
+#include "realtime/rt_renderer.hpp"
+#include "scene/example_scenes.hpp"
+#include "shapes/iterable_mesh.hpp"
+#include "shapes/mesh_iterator.hpp"
+#include "shapes/mutation_generator.hpp"
+#include "tracer/acceleration.hpp"
+#include "tracer/linear_bvh.hpp"
+#include "tracer/ray_tracer.hpp"
+#include "tracer/scene_geometry.hpp"
+
+namespace {
+
+constexpr unsigned int kSeed = 4;
+constexpr int kRandomRays = 1 << 18;
+// Coherent rays are generated in square tiles of this many pixels a side,
+// one packet per tile, as `RayTracer` bundles them at its largest.
+constexpr int kPacketSide = RayTracer::kMaxPacketSide;
+static_assert(kPacketSide * kPacketSide <= LinearBvh::kMaxPacketSize,
+              "A tile must fit one LinearBvh packet");
+constexpr int kTraceWidth = 400;
+constexpr int kTraceHeight = 300;
+// Frames of the moving scene per run of the dynamic case.
+constexpr int kDynamicFrames = 4;
+// The lowest PSNR, in dB, at which single precision traversal still renders
+// the same image as double precision.
+constexpr double kMinSinglePrecisionPsnr = 60.0;
+
+BenchmarkRunner::Options GetOptions(int argc, char** argv) {
+  BenchmarkRunner::Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    size_t equals = arg.find('=');
+    std::string flag = arg.substr(0, equals);
+    std::string value =
+        equals == std::string::npos ? "" : arg.substr(equals + 1);
+    if (flag == "--filter") {
+      options.filter = value;
+    } else if (flag == "--repetitions") {
+      options.repetitions = atoi(value.c_str());
+    } else if (flag == "--baseline") {
+      options.baseline_path = value;
+    } else if (flag == "--save-baseline") {
+      options.save_baseline_path = value;
+    } else if (flag == "--tolerance") {
+      options.tolerance = atof(value.c_str());
+    } else {
+      std::cerr << "Argument `" << arg << "` is invalid" << std::endl;
+      exit(1);
+    }
+  }
+  return options;
+}
+
+CameraTracerOpts GetTracerOpts() {
+  CameraTracerOpts opts;
+  opts.h_px = kTraceHeight;
+  opts.w_px = kTraceWidth;
+  opts.focal_length = 0.01;
+  opts.focus_distance = 5;
+  opts.vert_fov = 0.785398;
+  return opts;
+}
+
+// A scene as `main` sets it up for tracing.
+std::unique_ptr<RtRenderer> BuildScene(const RtSceneFn& scene_fn) {
+  std::default_random_engine random_gen(kSeed);
+  random_gen.discard(64);
+  std::unique_ptr<RtRenderer> renderer = scene_fn(false, &random_gen);
+  renderer->MoveCamera({
+      .position = glm::vec3(0.0f, 0.0f, 2.0f),
+      .view_dir = glm::vec3(0.0f, 0.0f, -1.0f),
+  });
+  renderer->SetCameraOpts(GetTracerOpts());
+  return renderer;
+}
+
+std::vector<Ray> GetRandomRays(const AaBox& box, int count) {
+  std::default_random_engine random_gen(kSeed);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  std::normal_distribution<double> normal;
+  std::vector<Ray> rays(count);
+  for (Ray& ray : rays) {
+    DVec3 t(unit(random_gen), unit(random_gen), unit(random_gen));
+    ray.origin = box.bot() + t * (box.top() - box.bot());
+    ray.dir = glm::normalize(
+        DVec3(normal(random_gen), normal(random_gen), normal(random_gen)));
+  }
+  return rays;
+}
+
+// The camera's primary rays, a tile of `kPacketSide` pixels a side at a time.
+std::vector<Ray> GetCoherentRays(const Camera& camera) {
+  CameraRayGenerator generator(camera);
+  std::vector<Ray> rays(kTraceWidth * kTraceHeight *
+                        generator.rays_per_pixel());
+  Ray* next = rays.data();
+  for (int y = 0; y < kTraceHeight; y += kPacketSide) {
+    int y_end = std::min(y + kPacketSide, kTraceHeight);
+    for (int x = 0; x < kTraceWidth; x += kPacketSide) {
+      int x_end = std::min(x + kPacketSide, kTraceWidth);
+      generator.GetTileRays(x, y, x_end, y_end, next);
+      next += (x_end - x) * (y_end - y) * generator.rays_per_pixel();
+    }
+  }
+  return rays;
+}
+
+uint64_t IntersectEach(const LinearBvh& bvh, const std::vector<Ray>& rays) {
+  uint64_t hits = 0;
+  for (const Ray& ray : rays) {
+    hits += bvh.Intersect(ray).has_value();
+  }
+  return hits;
+}
+
+uint64_t IntersectPackets(const LinearBvh& bvh, const std::vector<Ray>& rays) {
+  std::optional<ShadeablePoint> packet_hits[LinearBvh::kMaxPacketSize];
+  int packet = kPacketSide * kPacketSide;
+  uint64_t hits = 0;
+  for (size_t first = 0; first < rays.size(); first += packet) {
+    int count = std::min<size_t>(packet, rays.size() - first);
+    bvh.IntersectPacket(&rays[first], count, packet_hits);
+    for (int i = 0; i < count; i++) {
+      hits += packet_hits[i].has_value();
+    }
+  }
+  return hits;
+}
+
+// Building and traversing the tree of the scene `main` traces.
+void RunTraversalCases(BenchmarkRunner* runner) {
+  const char* names[] = {
+      "bvh_build/sah",
+      "bvh_build/linear",
+      "intersect/random",
+      "intersect/coherent",
+      "intersect/coherent_packet",
+      "occluded/random",
+  };
+  if (std::none_of(std::begin(names), std::end(names),
+                   [&](const char* name) { return runner->Enabled(name); })) {
+    return;
+  }
+  std::unique_ptr<RtRenderer> renderer = BuildScene(HelixGarlicNanoScene);
+  SceneGeometry geometry;
+  renderer->GetGeometry(&geometry);
+  std::vector<Intersectable*> inters = geometry.GetIntersectables();
+  std::cerr << "Traversal cases over " << inters.size() << " triangles"
+            << std::endl;
+
+  SahOptions sah_opts;
+  runner->Run(
+      "bvh_build/sah",
+      [&]() { KeepResult(ConstructBoundsSah(sah_opts, inters) != nullptr); },
+      inters.size());
+  BoundPtr root = ConstructBoundsSah(sah_opts, inters);
+  runner->Run(
+      "bvh_build/linear",
+      [&]() { KeepResult(LinearBvh(root.get()).num_nodes()); },
+      inters.size());
+
+  LinearBvh bvh(root.get());
+  std::vector<Ray> random_rays = GetRandomRays(root->GetAaBox(), kRandomRays);
+  std::vector<Ray> coherent_rays = GetCoherentRays(renderer->camera());
+  runner->Run(
+      "intersect/random",
+      [&]() { KeepResult(IntersectEach(bvh, random_rays)); },
+      random_rays.size());
+  runner->Run(
+      "intersect/coherent",
+      [&]() { KeepResult(IntersectEach(bvh, coherent_rays)); },
+      coherent_rays.size());
+  runner->Run(
+      "intersect/coherent_packet",
+      [&]() { KeepResult(IntersectPackets(bvh, coherent_rays)); },
+      coherent_rays.size());
+  runner->Run(
+      "occluded/random",
+      [&]() {
+        uint64_t occluded = 0;
+        for (const Ray& ray : random_rays) {
+          occluded += bvh.Occluded(ray, 1.0);
+        }
+        KeepResult(occluded);
+      },
+      random_rays.size());
+}
+
+void RunRenderCase(BenchmarkRunner* runner, const std::string& name,
+                   const RtSceneFn& scene_fn) {
+  if (!runner->Enabled(name)) {
+    return;
+  }
+  std::unique_ptr<RtRenderer> renderer = BuildScene(scene_fn);
+  std::unique_ptr<SceneGeometry> geometry(new SceneGeometry());
+  renderer->GetGeometry(geometry.get());
+  RayTracer::Options t_opts = {
+      .background_color = {100, 100, 100},
+      .packet_size = 8,
+  };
+  std::unique_ptr<RayTracer> tracer =
+      RayTracer::CreateSah(t_opts, std::move(geometry));
+  SceneLights lights = renderer->GetLights();
+  runner->Run(
+      name,
+      [&]() {
+        Texture tex = tracer->Render(renderer->camera(), lights);
+        KeepResult(tex.data[0]);
+      },
+      kTraceWidth * kTraceHeight);
+}
+
+// Frames of the boids scene traced as an animation: each ticks the flock,
+// moves the dynamic geometry, refits or rebuilds its tree and renders.
+void RunDynamicCase(BenchmarkRunner* runner) {
+  const std::string name = "dynamic_refit/boids";
+  if (!runner->Enabled(name)) {
+    return;
+  }
+  std::unique_ptr<RtRenderer> renderer;
+  std::unique_ptr<RayTracer> tracer;
+  runner->Run(
+      name,
+      [&]() {
+        SceneLights lights = renderer->GetLights();
+        for (int frame = 0; frame < kDynamicFrames; frame++) {
+          renderer->TickDynamicModels(1.0 / 60);
+          renderer->UpdateDynamicGeometry(tracer->dynamic_geometry());
+          tracer->UpdateDynamicGeometry();
+          Texture tex = tracer->Render(renderer->camera(), lights);
+          KeepResult(tex.data[0]);
+        }
+      },
+      0,
+      [&]() {
+        // Every run starts from the same flock, as `main` would build it.
+        renderer = BuildScene(GetBoidsScene);
+        std::unique_ptr<SceneGeometry> geometry(new SceneGeometry());
+        std::unique_ptr<SceneGeometry> dynamic_geometry(new SceneGeometry());
+        renderer->GetStaticGeometry(geometry.get());
+        renderer->GetDynamicGeometry(dynamic_geometry.get());
+        RayTracer::Options t_opts = {
+            .background_color = {100, 100, 100},
+            .packet_size = 8,
+        };
+        tracer = RayTracer::CreateSah(t_opts, std::move(geometry));
+        tracer->SetDynamicGeometry(std::move(dynamic_geometry));
+      });
+}
+
+void RunGeneratorCases(BenchmarkRunner* runner) {
+  for (unsigned int texels : {16, 64, 256}) {
+    BasicMeshIterator mesh_iterator(texels, texels);
+    mesh_iterator.SetIterableMesh(
+        std::unique_ptr<IterableMesh>(new IterableSphere(1.0)));
+    runner->Run(
+        "mesh_iterator/sphere/" + std::to_string(texels),
+        [&]() { KeepResult(mesh_iterator.GetMesh().indices.size()); },
+        texels * texels);
+  }
+  for (int iterations : {5, 7, 9}) {
+    runner->Run("fractal_noise/" + std::to_string(iterations), [&]() {
+      std::default_random_engine random_gen(kSeed);
+      FractalNoiseGenerator noise(&random_gen, iterations, -0.5, 0.7);
+      KeepResult(noise.GetMutation(0.5, 0.5) > 0);
+    });
+  }
+}
+
+void RunBoidsCases(BenchmarkRunner* runner) {
+  // Ticks are quadratic in the number of boids: 10000 already take seconds.
+  for (unsigned int num_boids : {100, 300, 1000, 3000}) {
+    std::string name = "boids_tick/" + std::to_string(num_boids);
+    if (!runner->Enabled(name)) {
+      continue;
+    }
+    // A tick moves the flock, so each one starts from the same flock.
+    std::unique_ptr<BoidsSimulation> simulation;
+    runner->Run(
+        name, [&]() { simulation->Tick(1.0 / 60); }, 0,
+        [&]() {
+          simulation.reset(new BoidsSimulation(
+              std::default_random_engine(kSeed), num_boids));
+        });
+  }
+}
+
+// Renders the scene `main` traces with double and single precision
+// traversal, through a linear tree and instanced, and requires the images to
+// agree to within `kMinSinglePrecisionPsnr`.
+bool CheckSinglePrecisionRender() {
+  std::unique_ptr<RtRenderer> renderer = BuildScene(HelixGarlicNanoScene);
+  SceneLights lights = renderer->GetLights();
+  bool passed = true;
+  for (bool instanced : {false, true}) {
+    Texture images[2];
+    for (bool single_precision : {false, true}) {
+      // Instanced trees are built over each unique mesh once.
+      SceneGeometry::Options geometry_opts;
+      geometry_opts.per_instance_tris = !instanced;
+      std::unique_ptr<SceneGeometry> geometry(new SceneGeometry(geometry_opts));
+      renderer->GetGeometry(geometry.get());
+      RayTracer::Options t_opts = {
+          .background_color = {100, 100, 100},
+          .single_precision = single_precision,
+          .packet_size = 8,
+      };
+      std::unique_ptr<RayTracer> tracer =
+          instanced ? RayTracer::CreateInstanced(t_opts, std::move(geometry))
+                    : RayTracer::CreateSah(t_opts, std::move(geometry));
+      images[single_precision] = tracer->Render(renderer->camera(), lights);
+    }
+    double psnr = ImagePsnr(images[1], images[0]);
+    std::cerr << "Single precision " << (instanced ? "instanced" : "linear")
+              << " render against double: " << psnr << " dB" << std::endl;
+    passed = passed && psnr >= kMinSinglePrecisionPsnr;
+  }
+  return passed;
+}
+
+// Runs the checks whose names pass the filter. Returns the number that
+// failed.
+int RunChecks(const BenchmarkRunner& runner) {
+  const std::pair<const char*, std::function<bool()>> checks[] = {
+      {"check/triangle_soa", []() { return CheckTriangleSoa(kSeed); }},
+      {"check/float_triangle_soa",
+       []() { return CheckFloatTriangleSoa(kSeed); }},
+      {"check/single_precision_render", CheckSinglePrecisionRender},
+  };
+  int failures = 0;
+  for (const auto& [name, check] : checks) {
+    if (runner.Enabled(name)) {
+      std::cerr << "Running " << name << std::endl;
+      failures += !check();
+    }
+  }
+  return failures;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  BenchmarkRunner runner(GetOptions(argc, argv));
+  int failures = RunChecks(runner);
+  RunTraversalCases(&runner);
+  RunRenderCase(&runner, "render/helix_garlic_nano", HelixGarlicNanoScene);
+  RunRenderCase(&runner, "render/current_scene", CurrentScene);
+  RunDynamicCase(&runner);
+  RunGeneratorCases(&runner);
+  RunBoidsCases(&runner);
+  int regressions = runner.Finish();
+  if (failures > 0) {
+    std::cerr << failures << " checks failed" << std::endl;
+  }
+  return regressions > 0 || failures > 0 ? 1 : 0;
+}
@@ -276,6 +276,20 @@ void BoidActor::GetTris(glm::mat4 model_mat, std::vector<InterPtr>* tris) {
   boid_model_->GetTris(model_mat * pos_mat * rot_mat, tris);
 }
 
+void BoidActor::GetGeometry(glm::mat4 model_mat, SceneGeometry* geometry) {
+  glm::mat4 pos_mat = PosMat();
+  glm::mat4 rot_mat = RotMat();
+  boid_model_->GetGeometry(model_mat * pos_mat * rot_mat, geometry);
+}
+
+void BoidActor::UpdateGeometry(glm::mat4 model_mat, SceneGeometry* geometry,
+                               uint32_t* instance) {
+  glm::mat4 pos_mat = PosMat();
+  glm::mat4 rot_mat = RotMat();
+  boid_model_->UpdateGeometry(model_mat * pos_mat * rot_mat, geometry,
+                              instance);
+}
+
 BoidsSimulation::BoidsSimulation(std::default_random_engine random_gen,
                                  unsigned int num_boids)
     : random_gen_(random_gen) {
@@ -317,6 +331,24 @@ void BoidsSimulation::GetTris(glm::mat4 model_mat,
   }
 }
 
+void BoidsSimulation::GetGeometry(glm::mat4 model_mat,
+                                  SceneGeometry* geometry) {
+  bounding_sphere_->GetGeometry(model_mat, geometry);
+  for (int i = 0; i < boids_.size(); i++) {
+    geometry->BeginObject();
+    boids_[i].GetGeometry(model_mat, geometry);
+  }
+}
+
+void BoidsSimulation::UpdateGeometry(glm::mat4 model_mat,
+                                     SceneGeometry* geometry,
+                                     uint32_t* instance) {
+  bounding_sphere_->UpdateGeometry(model_mat, geometry, instance);
+  for (int i = 0; i < boids_.size(); i++) {
+    boids_[i].UpdateGeometry(model_mat, geometry, instance);
+  }
+}
+
 void BoidsSimulation::KeyboardEvents(GLFWwindow* window) {
   if (KeyNewlyPressed(window, &key_states_, GLFW_KEY_L)) {
     follow_boid_ = !follow_boid_;
@@ -44,6 +44,9 @@ class BoidActor : public Renderable {
   void Tick(double delta_sec, const std::vector<BoidActor>& boids);
   void Draw(ShaderSet shaders, glm::mat4 model_mat) override;
   void GetTris(glm::mat4 model_mat, std::vector<InterPtr>* tris) override;
+  void GetGeometry(glm::mat4 model_mat, SceneGeometry* geometry) override;
+  void UpdateGeometry(glm::mat4 model_mat, SceneGeometry* geometry,
+                      uint32_t* instance) override;
 
  private:
   std::vector<DVec3> GetAvoidanceRequests(const std::vector<BoidActor>& boids);
@@ -68,6 +71,10 @@ class BoidsSimulation : public DynamicRenderable, public CameraEventHandler {
   void Tick(double delta_sec) override;
   void Draw(ShaderSet shaders, glm::mat4 model_mat) override;
   void GetTris(glm::mat4 model_mat, std::vector<InterPtr>* tris) override;
+  // Each boid is its own `SceneGeometry` object.
+  void GetGeometry(glm::mat4 model_mat, SceneGeometry* geometry) override;
+  void UpdateGeometry(glm::mat4 model_mat, SceneGeometry* geometry,
+                      uint32_t* instance) override;
   void KeyboardEvents(GLFWwindow* window) override;
   void TickUpdateCamera(Camera* camera, double delta_time) override;
 
@@ -1,5 +1,20 @@
 #include "learnopengl/camera.h"
 
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// The SplitMix64 finalizer.
+uint64_t Mix(uint64_t hash) {
+  hash += 0x9e3779b97f4a7c15ull;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+  return hash ^ (hash >> 31);
+}
+
+}  // namespace
+
 Camera::Camera(DVec3 position, DVec3 up, double yaw, double pitch)
     : Front(DVec3(0.0f, 0.0f, -1.0f)),
       MovementSpeed(SPEED),
@@ -45,43 +60,16 @@ glm::mat4 Camera::GetViewMatrix() {
 }
 
 std::vector<Ray> Camera::GetScreenRays(int x_px, int y_px) {
-  DVec3 screen_pos = Position + opts_.focal_length * Front;
-  DVec3 lens = screen_pos + opts_.focal_length * Front;
-  DVec3 screen_vert = opts_.focal_length * std::tan(opts_.vert_fov / 2.0) * Up;
-  DVec3 screen_horiz = opts_.focal_length * std::tan(horiz_fov_ / 2.0) * Right;
-
-  std::vector<DVec2> screen_space_px;
-  double inv_subpix = 1.0 / opts_.subpix;
-  if (opts_.subpix == 1) {
-    DVec2 screen_space;
-    screen_space.x = (x_px + 0.5) / opts_.w_px;
-    screen_space.y = (y_px + 0.5) / opts_.h_px;
-    screen_space_px.push_back(screen_space);
-  } else {
-    for (int subY = 0; subY < opts_.subpix; subY++) {
-      for (int subX = 0; subX < opts_.subpix; subX++) {
-        DVec2 screen_space;
-        screen_space.x =
-            (x_px + ((double)subX / opts_.subpix) + 0.5 * inv_subpix) /
-            opts_.w_px;
-        screen_space.y =
-            (y_px + ((double)subY / opts_.subpix) + 0.5 * inv_subpix) /
-            opts_.h_px;
-        screen_space_px.push_back(screen_space);
-      }
-    }
-  }
-
-  std::vector<Ray> rays;
-  for (DVec2 screen_space : screen_space_px) {
-    DVec3 screen_point = screen_pos + (2 * screen_space.x - 1) * screen_horiz -
-                         (2 * screen_space.y - 1) * screen_vert;
-    DVec3 pix_vec = glm::normalize(screen_point - Position);
-    rays.push_back({Position, pix_vec});
-  }
+  CameraRayGenerator generator(*this);
+  std::vector<Ray> rays(generator.rays_per_pixel());
+  generator.GetRowRays(y_px, x_px, x_px + 1, rays.data());
   return rays;
 }
 
+Ray Camera::GetScreenRay(DVec2 screen_space) const {
+  return CameraRayGenerator(*this).GetRay(screen_space);
+}
+
 void Camera::ProcessKeyboard(Camera_Movement direction, double deltaTime) {
   double velocity = MovementSpeed * deltaTime;
   if (direction == FORWARD) Position += Front * velocity;
@@ -131,3 +119,84 @@ void Camera::updateCameraVectors() {
                          // results in slower movement.
   Up = glm::normalize(glm::cross(Right, Front));
 }
+
+CameraRayGenerator::CameraRayGenerator(const Camera& camera, Pattern pattern,
+                                       uint32_t seed)
+    : position_(camera.Position),
+      w_px_(camera.opts().w_px),
+      h_px_(camera.opts().h_px),
+      subpix_(std::max(1, camera.opts().subpix)),
+      pattern_(pattern),
+      seed_(seed) {
+  const CameraTracerOpts& opts = camera.opts();
+  screen_pos_ = camera.Position + opts.focal_length * camera.Front;
+  screen_vert_ =
+      opts.focal_length * std::tan(opts.vert_fov / 2.0) * camera.Up;
+  screen_horiz_ =
+      opts.focal_length * std::tan(camera.horiz_fov() / 2.0) * camera.Right;
+}
+
+void CameraRayGenerator::GetRowRays(int y, int x_begin, int x_end,
+                                    Ray* rays) const {
+  double inv_subpix = 1.0 / subpix_;
+  if (pattern_ == Pattern::kJittered) {
+    for (int x = x_begin; x < x_end; x++) {
+      for (int sub_y = 0; sub_y < subpix_; sub_y++) {
+        for (int sub_x = 0; sub_x < subpix_; sub_x++) {
+          int sub = sub_y * subpix_ + sub_x;
+          DVec2 screen_space(
+              (x + (sub_x + CellOffset(x, y, sub, 0)) * inv_subpix) / w_px_,
+              (y + (sub_y + CellOffset(x, y, sub, 1)) * inv_subpix) / h_px_);
+          *rays++ = GetRay(screen_space);
+        }
+      }
+    }
+    return;
+  }
+  // Stratified cell centers. The terms are grouped as in the original
+  // per-pixel version, so the rays are bit for bit the same; only the
+  // vertical offset, which is shared by the whole row, is hoisted.
+  for (int sub_y = 0; sub_y < subpix_; sub_y++) {
+    double screen_y =
+        (y + ((double)sub_y / subpix_) + 0.5 * inv_subpix) / h_px_;
+    DVec3 vert = (2 * screen_y - 1) * screen_vert_;
+    Ray* sub_rays = rays + sub_y * subpix_;
+    for (int x = x_begin; x < x_end; x++) {
+      for (int sub_x = 0; sub_x < subpix_; sub_x++) {
+        double screen_x =
+            (x + ((double)sub_x / subpix_) + 0.5 * inv_subpix) / w_px_;
+        DVec3 screen_point =
+            screen_pos_ + (2 * screen_x - 1) * screen_horiz_ - vert;
+        sub_rays[sub_x] = {position_,
+                           glm::normalize(screen_point - position_)};
+      }
+      sub_rays += subpix_ * subpix_;
+    }
+  }
+}
+
+void CameraRayGenerator::GetTileRays(int x_begin, int y_begin, int x_end,
+                                     int y_end, Ray* rays) const {
+  for (int y = y_begin; y < y_end; y++) {
+    GetRowRays(y, x_begin, x_end, rays);
+    rays += (x_end - x_begin) * rays_per_pixel();
+  }
+}
+
+Ray CameraRayGenerator::GetRay(DVec2 screen_space) const {
+  DVec3 screen_point = screen_pos_ + (2 * screen_space.x - 1) * screen_horiz_ -
+                       (2 * screen_space.y - 1) * screen_vert_;
+  return {position_, glm::normalize(screen_point - position_)};
+}
+
+double CameraRayGenerator::CellOffset(int x, int y, int sub,
+                                      int axis) const {
+  // A hash of everything that identifies the sample, so any thread can
+  // generate any pixel's rays without shared state.
+  uint64_t hash = Mix(seed_);
+  hash = Mix(hash ^ (uint32_t)x);
+  hash = Mix(hash ^ (uint32_t)y);
+  hash = Mix(hash ^ (uint32_t)(sub * 2 + axis));
+  // The top 53 bits, as a double in [0, 1).
+  return (hash >> 11) * 0x1.0p-53;
+}
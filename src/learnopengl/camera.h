@@ -5,6 +5,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <cstdint>
 #include <vector>
 
 #include "tracer/intersectable.hpp"
@@ -70,7 +71,8 @@ class Camera {
 
   DVec3 front() const { return Front; }
   DVec3 position() const { return Position; }
-  const CameraTracerOpts& opts() { return opts_; }
+  const CameraTracerOpts& opts() const { return opts_; }
+  double horiz_fov() const { return horiz_fov_; }
 
   void SetPosition(DVec3 pos);
 
@@ -81,7 +83,11 @@ class Camera {
   // Returns the view matrix calculated using Euler Angles and the LookAt Matrix
   glm::mat4 GetViewMatrix();
 
+  // Use a `CameraRayGenerator` to trace many pixels.
   std::vector<Ray> GetScreenRays(int x_px, int y_px);
+  // The ray through `screen_space`, in [0, 1] from the top left corner of
+  // the screen.
+  Ray GetScreenRay(DVec2 screen_space) const;
 
   // Processes input received from any keyboard-like input system. Accepts input
   // parameter in the form of camera defined ENUM (to abstract it from windowing
@@ -106,4 +112,48 @@ class Camera {
   double horiz_fov_;
 };
 
+// Generates camera rays for many pixels at once into caller-provided
+// buffers. The screen's basis is computed once, on construction, and copied,
+// so later changes to the camera do not apply.
+class CameraRayGenerator {
+ public:
+  enum class Pattern {
+    // The center of each cell of a `subpix` by `subpix` grid over the pixel,
+    // the same rays as `Camera::GetScreenRays`.
+    kStratified,
+    // A random point in each of those cells, the same for the same seed.
+    kJittered,
+  };
+
+  explicit CameraRayGenerator(const Camera& camera,
+                              Pattern pattern = Pattern::kStratified,
+                              uint32_t seed = 0);
+
+  int rays_per_pixel() const { return subpix_ * subpix_; }
+  // Writes the rays of the pixels [x_begin, x_end) of row `y` to `rays`,
+  // `rays_per_pixel()` for each pixel in turn, ordered by row and then
+  // column of their cells.
+  void GetRowRays(int y, int x_begin, int x_end, Ray* rays) const;
+  // Likewise for the rows [y_begin, y_end), one after another.
+  void GetTileRays(int x_begin, int y_begin, int x_end, int y_end,
+                   Ray* rays) const;
+  // The ray through `screen_space`, as `Camera::GetScreenRay`.
+  Ray GetRay(DVec2 screen_space) const;
+
+ private:
+  // Offset of a sub-pixel cell's sample within the pixel, on a scale of 0
+  // to 1.
+  double CellOffset(int x, int y, int sub, int axis) const;
+
+  DVec3 position_;
+  DVec3 screen_pos_;
+  DVec3 screen_vert_;
+  DVec3 screen_horiz_;
+  int w_px_;
+  int h_px_;
+  int subpix_;
+  Pattern pattern_;
+  uint32_t seed_;
+};
+
 #endif
@@ -12,3 +12,14 @@ void Mesh::GetTris(glm::mat4 model_mat, std::vector<InterPtr>* tris) {
     tris->push_back(InterPtr(new InterTri(&material_, parent_, v0, v1, v2)));
   }
 }
+
+void Mesh::GetGeometry(glm::mat4 model_mat, SceneGeometry* geometry) {
+  DMat4 final_mat = model_mat * local_model_mat_;
+  geometry->AddMesh(vertices, indices, final_mat, &material_, parent_);
+}
+
+void Mesh::UpdateGeometry(glm::mat4 model_mat, SceneGeometry* geometry,
+                          uint32_t* instance) {
+  DMat4 final_mat = model_mat * local_model_mat_;
+  geometry->SetTransform((*instance)++, final_mat);
+}
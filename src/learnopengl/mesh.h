@@ -10,6 +10,7 @@
 #include "learnopengl/shader.h"
 #include "scene/primitives.hpp"
 #include "shapes/renderable.hpp"
+#include "texture/image.hpp"
 #include "tracer/intersectable.hpp"
 
 #include <fstream>
@@ -28,7 +29,8 @@ class Mesh : public Renderable {
   vector<Vertex> vertices;
   vector<unsigned int> indices;
   Material material_;
-  unsigned int VAO;
+  // Zero until the mesh is first drawn.
+  unsigned int VAO = 0;
 
   /*  Functions  */
   // constructor
@@ -38,14 +40,15 @@ class Mesh : public Renderable {
     this->vertices = std::move(vertices);
     this->indices = std::move(indices);
     this->local_model_mat_ = local_model_mat;
-
-    // now that we have all the required data, set the vertex buffers and its
-    // attribute pointers.
-    setupMesh();
   }
 
   // render the mesh
   void Draw(ShaderSet shaders, glm::mat4 model_mat) override {
+    // The vertex buffers are only set up here, so meshes can be built and
+    // traced without a GL context.
+    if (VAO == 0) {
+      setupMesh();
+    }
     // bind textures
     glActiveTexture(GL_TEXTURE0);
     // retrieve texture number (the N in diffuse_textureN)
@@ -57,7 +60,7 @@ class Mesh : public Renderable {
                                      (name + number).c_str()),
                 0);
     // and finally bind the texture
-    glBindTexture(GL_TEXTURE_2D, material_.diff_texture().id);
+    glBindTexture(GL_TEXTURE_2D, GetGlTexture(material_.diff_texture()));
 
     shaders.texture_shader->setMat4("model", model_mat * local_model_mat_);
     // draw mesh
@@ -70,6 +73,9 @@ class Mesh : public Renderable {
   }
 
   void GetTris(glm::mat4 model_mat, std::vector<InterPtr>* tris) override;
+  void GetGeometry(glm::mat4 model_mat, SceneGeometry* geometry) override;
+  void UpdateGeometry(glm::mat4 model_mat, SceneGeometry* geometry,
+                      uint32_t* instance) override;
 
   glm::mat4 local_model_mat() const { return local_model_mat_; }
 
@@ -18,6 +18,7 @@
 #include "texture/image.hpp"
 #include "learnopengl/mesh.h"
 #include "learnopengl/shader.h"
+#include "profile/trace.hpp"
 #include "shapes/renderable.hpp"
 #include "texture/texture_gen.hpp"
 
@@ -55,11 +56,25 @@ class Model : public Renderable {
     }
   }
 
+  void GetGeometry(glm::mat4 model_mat, SceneGeometry* geometry) override {
+    for (unsigned int i = 0; i < meshes.size(); i++) {
+      meshes[i].GetGeometry(model_mat, geometry);
+    }
+  }
+
+  void UpdateGeometry(glm::mat4 model_mat, SceneGeometry* geometry,
+                      uint32_t* instance) override {
+    for (unsigned int i = 0; i < meshes.size(); i++) {
+      meshes[i].UpdateGeometry(model_mat, geometry, instance);
+    }
+  }
+
  private:
   /*  Functions   */
   // loads a model with supported ASSIMP extensions from file and stores the
   // resulting meshes in the meshes vector.
   void loadModel(string const& path) {
+    TRACE_ZONE("assimp import");
     // read file via ASSIMP
     Assimp::Importer importer;
     const aiScene* scene =
@@ -19,8 +19,11 @@
 #include <string>
 
 #include "learnopengl/filesystem.h"
+#include "profile/trace.hpp"
 #include "realtime/rt_renderer.hpp"
 #include "scene/example_scenes.hpp"
+#include "texture/hdr_image.hpp"
+#include "texture/image_sink.hpp"
 #include "tracer/acceleration.hpp"
 #include "tracer/bound.hpp"
 #include "tracer/intersectable.hpp"
@@ -29,6 +32,13 @@
 struct CommandOps {
   bool trace = false;
   bool raster = false;
+  // Trace progressively, refreshing output.png as the image converges.
+  bool progressive = false;
+  // From --scene-cache=PATH: keep the compiled per-mesh trees in a scene
+  // cache file at PATH, so later runs load them instead of building them.
+  std::string scene_cache_path;
+  // From --stats=PATH: write the counters of each render to PATH as JSON.
+  std::string stats_path;
 };
 
 CommandOps GetOps(int argc, char** argv) {
@@ -37,6 +47,9 @@ CommandOps GetOps(int argc, char** argv) {
     std::string str(argv[1]);
     if (str == "trace") {
       ops.trace = true;
+    } else if (str == "progressive") {
+      ops.trace = true;
+      ops.progressive = true;
     } else if (str == "raster") {
       ops.raster = true;
     } else if (str == "all") {
@@ -47,6 +60,25 @@ CommandOps GetOps(int argc, char** argv) {
       exit(1);
     }
   }
+  // Flags follow the command and the camera.
+  for (int i = 2; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg.rfind("--", 0) != 0) {
+      continue;
+    }
+    size_t equals = arg.find('=');
+    std::string flag = arg.substr(0, equals);
+    std::string value =
+        equals == std::string::npos ? "" : arg.substr(equals + 1);
+    if (flag == "--scene-cache") {
+      ops.scene_cache_path = value;
+    } else if (flag == "--stats") {
+      ops.stats_path = value;
+    } else {
+      std::cerr << "Flag `" << arg << "` is invalid" << std::endl;
+      exit(1);
+    }
+  }
   return ops;
 }
 
@@ -55,7 +87,7 @@ CameraArrangement GetStartingCamera(int argc, char** argv) {
       .position = glm::vec3(0.0f, 0.0f, 2.0f),
       .view_dir = glm::vec3(0.0f, 0.0f, -1.0f),
   };
-  if (argc >= 3) {
+  if (argc >= 3 && std::string(argv[2]).rfind("--", 0) != 0) {
     std::stringstream in;
     in << argv[2] << " ";
     float coords[6];
@@ -76,19 +108,26 @@ int main(int argc, char** argv) {
   std::default_random_engine random_gen(4);
   random_gen.discard(64);
 
-  glfwInit();
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  CommandOps ops = GetOps(argc, argv);
+  TRACE_THREAD_NAME("main");
+
+  // Tracing alone runs headless, without a display or GPU.
+  if (ops.raster) {
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 #ifdef __APPLE__
-  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
+  }
 
-  CommandOps ops = GetOps(argc, argv);
-
-  std::unique_ptr<RtRenderer> renderer =
-      HelixGarlicNanoScene(ops.raster, &random_gen);
+  std::unique_ptr<RtRenderer> renderer;
+  {
+    TRACE_ZONE("scene build");
+    renderer = HelixGarlicNanoScene(ops.raster, &random_gen);
+  }
 
   renderer->MoveCamera(GetStartingCamera(argc, argv));
 
@@ -101,28 +140,72 @@ int main(int argc, char** argv) {
     opts.focus_distance = 5;
     opts.vert_fov = 0.785398;
     renderer->SetCameraOpts(opts);
-    std::vector<InterPtr> inters;
-    renderer->GetTris(&inters);
+    SceneGeometry::Options geometry_opts;
+    geometry_opts.per_instance_tris = false;
+    std::unique_ptr<SceneGeometry> geometry(new SceneGeometry(geometry_opts));
+    std::unique_ptr<SceneGeometry> dynamic_geometry(new SceneGeometry());
+    {
+      TRACE_ZONE("geometry gather");
+      renderer->GetStaticGeometry(geometry.get());
+      renderer->GetDynamicGeometry(dynamic_geometry.get());
+    }
     RayTracer::Options t_opts = {
         .background_color = {100, 100, 100},
+        .packet_size = 8,
+        .scene_cache_path = ops.scene_cache_path,
+        .stats_path = ops.stats_path,
     };
-    std::unique_ptr<RayTracer> tracer =
-        // RayTracer::CreateNoAcceleration(t_opts, std::move(inters));
-        RayTracer::CreateTopDownTriple(t_opts, std::move(inters));
-    Texture tex = tracer->Render(renderer->camera(), renderer->GetLights());
-    TextureToFile("output.png", tex);
+    std::unique_ptr<RayTracer> tracer;
+    {
+      TRACE_ZONE("tracer build");
+      tracer =
+          // RayTracer::CreateNoAcceleration(t_opts, std::move(geometry));
+          // RayTracer::CreateTopDownTriple(t_opts, std::move(geometry));
+          // RayTracer::CreateSah(t_opts, std::move(geometry));
+          RayTracer::CreateInstanced(t_opts, std::move(geometry));
+      tracer->SetDynamicGeometry(std::move(dynamic_geometry));
+    }
+    if (ops.progressive) {
+      RayTracer::ProgressiveOptions progressive;
+      progressive.on_preview = [](const Texture& preview, int samples) {
+        std::cerr << "Preview with " << samples << " samples" << std::endl;
+        TextureToFile("output.png", preview);
+        return true;
+      };
+      // The averaged samples keep their full range in output.exr.
+      HdrImage hdr;
+      progressive.hdr_image = &hdr;
+      Texture tex = tracer->RenderProgressive(
+          renderer->camera(), renderer->GetLights(), progressive);
+      TextureToFile("output.png", tex);
+      hdr.WriteExr("output.exr");
+    } else {
+      // Encoded as tiles finish, without holding the whole image.
+      PngStreamSink sink("output.png");
+      tracer->RenderToSink(renderer->camera(), renderer->GetLights(), &sink);
+    }
   }
 
-  std::cerr << "Starting rendering" << std::endl;
-  while (!renderer->WindowShouldClose()) {
-    renderer->Render();
+  if (ops.raster) {
+    std::cerr << "Starting rendering" << std::endl;
+    while (!renderer->WindowShouldClose()) {
+      renderer->Render();
+    }
   }
 
-  glfwTerminate();
+  // Only written when built with GLITTER_ENABLE_TRACING.
+  TRACE_WRITE("trace.json");
+
   const Camera& camera = renderer->camera();
   std::cout << "Final camera:" << std::endl;
   std::cout << camera.position().x << " " << camera.position().y << " "
             << camera.position().z << " " << camera.front().x << " "
             << camera.front().y << " " << camera.front().z << std::endl;
+  // The renderer deletes GL objects as it goes, so it goes before the
+  // context does.
+  renderer.reset();
+  if (ops.raster) {
+    glfwTerminate();
+  }
   return 0;
 }
@@ -0,0 +1,14 @@
+#ifndef PROFILE_CLOCK_HPP
+#define PROFILE_CLOCK_HPP
+
+#include <chrono>
+
+// Seconds since an arbitrary start, for timing. Unlike `glfwGetTime`, needs no
+// GLFW.
+inline double Seconds() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include "profile/trace.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include "profile/clock.hpp"
+
+constinit thread_local TraceRecorder::Track* TraceRecorder::thread_track_ =
+    nullptr;
+
+namespace {
+
+void WriteString(std::ostream& out, const std::string& str) {
+  out << "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out << '\\';
+    }
+    out << c;
+  }
+  out << "\"";
+}
+
+}  // namespace
+
+TraceRecorder& TraceRecorder::Get() {
+  static TraceRecorder recorder;
+  return recorder;
+}
+
+TraceRecorder::TraceRecorder() : start_seconds_(Seconds()) {
+  gpu_track_ = AddTrack("GPU");
+}
+
+double TraceRecorder::NowUs() const {
+  return (Seconds() - start_seconds_) * 1e6;
+}
+
+void TraceRecorder::AddSpan(const char* name, double start_us, double end_us) {
+  ThreadTrack()->spans.push_back({name, start_us, end_us - start_us});
+}
+
+void TraceRecorder::AddGpuSpan(const char* name, double start_us,
+                               double end_us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  gpu_track_->spans.push_back({name, start_us, end_us - start_us});
+}
+
+void TraceRecorder::SetThreadName(const std::string& name) {
+  Track* track = ThreadTrack();
+  std::lock_guard<std::mutex> lock(mutex_);
+  track->name = name;
+}
+
+TraceRecorder::Track* TraceRecorder::ThreadTrack() {
+  if (thread_track_ == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    thread_track_ = AddTrack("thread " + std::to_string(tracks_.size()));
+  }
+  return thread_track_;
+}
+
+TraceRecorder::Track* TraceRecorder::AddTrack(const std::string& name) {
+  tracks_.push_back(std::unique_ptr<Track>(new Track));
+  Track* track = tracks_.back().get();
+  track->id = tracks_.size();
+  track->name = name;
+  return track;
+}
+
+void TraceRecorder::WriteJson(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ofstream out(path, std::ios::trunc);
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  bool first = true;
+  for (const std::unique_ptr<Track>& track : tracks_) {
+    if (track.get() == gpu_track_ && track->spans.empty()) {
+      continue;
+    }
+    out << (first ? "" : ",\n")
+        << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, "
+        << "\"tid\": " << track->id << ", \"args\": {\"name\": ";
+    WriteString(out, track->name);
+    out << "}}";
+    first = false;
+    for (const Span& span : track->spans) {
+      out << ",\n{\"ph\": \"X\", \"name\": ";
+      WriteString(out, span.name);
+      out << ", \"pid\": 1, \"tid\": " << track->id
+          << ", \"ts\": " << span.start_us
+          << ", \"dur\": " << span.duration_us << "}";
+    }
+  }
+  out << "\n]}\n";
+  if (!out) {
+    std::cerr << "Failed to write trace to " << path << std::endl;
+    exit(-1);
+  }
+}
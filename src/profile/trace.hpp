@@ -0,0 +1,92 @@
+#ifndef PROFILE_TRACE_HPP
+#define PROFILE_TRACE_HPP
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A timeline of named spans, one track per thread plus one for the GPU,
+// written as a Chrome trace JSON file that Perfetto and chrome://tracing
+// open. Spans are added by the `TRACE_ZONE` macros, which compile to nothing
+// unless GLITTER_TRACING is defined; see the GLITTER_ENABLE_TRACING CMake
+// option.
+class TraceRecorder {
+ public:
+  struct Span {
+    // Not copied, so it must outlive the recorder, e.g. a string literal.
+    const char* name;
+    // Microseconds since the recorder was created.
+    double start_us;
+    double duration_us;
+  };
+
+  static TraceRecorder& Get();
+
+  // Microseconds since the recorder was created, on a steady clock.
+  double NowUs() const;
+  // Adds a span to the calling thread's track. Threads only take the lock
+  // the first time they record.
+  void AddSpan(const char* name, double start_us, double end_us);
+  // Adds a span to the GPU track.
+  void AddGpuSpan(const char* name, double start_us, double end_us);
+  // Names the calling thread's track. Unnamed tracks are numbered.
+  void SetThreadName(const std::string& name);
+
+  // Writes every span so far. Call while no other thread is recording.
+  // Exits on failure.
+  void WriteJson(const std::string& path);
+
+ private:
+  struct Track {
+    int id;
+    std::string name;
+    std::vector<Span> spans;
+  };
+
+  TraceRecorder();
+  // The calling thread's track, added on first use.
+  Track* ThreadTrack();
+  Track* AddTrack(const std::string& name);
+
+  double start_seconds_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Track>> tracks_;
+  Track* gpu_track_;
+
+  static constinit thread_local Track* thread_track_;
+};
+
+// Adds a span from its construction to its destruction to the calling
+// thread's track.
+class TraceZone {
+ public:
+  explicit TraceZone(const char* name)
+      : name_(name), start_us_(TraceRecorder::Get().NowUs()) {}
+  ~TraceZone() {
+    TraceRecorder& recorder = TraceRecorder::Get();
+    recorder.AddSpan(name_, start_us_, recorder.NowUs());
+  }
+  TraceZone(const TraceZone&) = delete;
+  TraceZone& operator=(const TraceZone&) = delete;
+
+ private:
+  const char* name_;
+  double start_us_;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef GLITTER_TRACING
+// Traces the rest of the enclosing scope as `name`, a string literal.
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) TraceRecorder::Get().SetThreadName(name)
+#define TRACE_WRITE(path) TraceRecorder::Get().WriteJson(path)
+#else
+#define TRACE_ZONE(name)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_WRITE(path)
+#endif
+
+#endif
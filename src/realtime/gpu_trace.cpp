@@ -0,0 +1,72 @@
+#include "realtime/gpu_trace.hpp"
+
+#include <glad/glad.h>
+
+GpuTraceTimer::~GpuTraceTimer() {
+  // Spans still in flight are dropped. Queries only exist if a context did.
+  for (const PendingSpan& span : pending_) {
+    free_queries_.push_back(span.begin_query);
+    free_queries_.push_back(span.end_query);
+  }
+  if (!free_queries_.empty()) {
+    glDeleteQueries(free_queries_.size(), free_queries_.data());
+  }
+}
+
+void GpuTraceTimer::Init() {
+  initialized_ = true;
+  available_ = GLAD_GL_VERSION_3_3;
+  if (!available_) {
+    return;
+  }
+  GLint64 gpu_ns = 0;
+  glGetInteger64v(GL_TIMESTAMP, &gpu_ns);
+  offset_us_ = TraceRecorder::Get().NowUs() - gpu_ns / 1e3;
+}
+
+unsigned int GpuTraceTimer::QueryTimestamp() {
+  if (!initialized_) {
+    Init();
+  }
+  if (!available_) {
+    return 0;
+  }
+  unsigned int query;
+  if (free_queries_.empty()) {
+    glGenQueries(1, &query);
+  } else {
+    query = free_queries_.back();
+    free_queries_.pop_back();
+  }
+  glQueryCounter(query, GL_TIMESTAMP);
+  return query;
+}
+
+void GpuTraceTimer::AddSpan(const char* name, unsigned int begin_query,
+                            unsigned int end_query) {
+  if (begin_query != 0 && end_query != 0) {
+    pending_.push_back({name, begin_query, end_query});
+  }
+}
+
+void GpuTraceTimer::Collect() {
+  // Queries finish in order, so stop at the first span still in flight.
+  size_t done = 0;
+  for (; done < pending_.size(); done++) {
+    const PendingSpan& span = pending_[done];
+    GLint available = 0;
+    glGetQueryObjectiv(span.end_query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      break;
+    }
+    GLuint64 begin_ns = 0;
+    GLuint64 end_ns = 0;
+    glGetQueryObjectui64v(span.begin_query, GL_QUERY_RESULT, &begin_ns);
+    glGetQueryObjectui64v(span.end_query, GL_QUERY_RESULT, &end_ns);
+    TraceRecorder::Get().AddGpuSpan(span.name, begin_ns / 1e3 + offset_us_,
+                                    end_ns / 1e3 + offset_us_);
+    free_queries_.push_back(span.begin_query);
+    free_queries_.push_back(span.end_query);
+  }
+  pending_.erase(pending_.begin(), pending_.begin() + done);
+}
@@ -0,0 +1,74 @@
+#ifndef REALTIME_GPU_TRACE_HPP
+#define REALTIME_GPU_TRACE_HPP
+
+#include <vector>
+
+#include "profile/trace.hpp"
+
+// Times GL commands with timestamp queries and adds them to the GPU track of
+// the `TraceRecorder` once the GPU has run them, so reading the results never
+// stalls a frame. Needs timer queries, which are core since GL 3.3, in the
+// current context, and does nothing without them. Must be destroyed while
+// that context is still current, since it deletes its queries.
+class GpuTraceTimer {
+ public:
+  GpuTraceTimer() = default;
+  ~GpuTraceTimer();
+  GpuTraceTimer(const GpuTraceTimer&) = delete;
+  GpuTraceTimer& operator=(const GpuTraceTimer&) = delete;
+
+  // Issues a timestamp query for when the commands so far have run, and
+  // returns it, or 0 without timer query support.
+  unsigned int QueryTimestamp();
+  // Adds the span between two `QueryTimestamp` queries to the trace once
+  // their results arrive.
+  void AddSpan(const char* name, unsigned int begin_query,
+               unsigned int end_query);
+  // Adds the spans whose results have arrived. Call once a frame.
+  void Collect();
+
+ private:
+  struct PendingSpan {
+    const char* name;
+    unsigned int begin_query;
+    unsigned int end_query;
+  };
+
+  // Checks for timer queries and lines up GPU time with trace time.
+  void Init();
+
+  bool initialized_ = false;
+  bool available_ = false;
+  // Trace time in microseconds minus GPU time in microseconds.
+  double offset_us_ = 0.0;
+  std::vector<PendingSpan> pending_;
+  std::vector<unsigned int> free_queries_;
+};
+
+// Adds the GL commands issued from its construction to its destruction to
+// the GPU track.
+class GpuTraceZone {
+ public:
+  GpuTraceZone(GpuTraceTimer* timer, const char* name)
+      : timer_(timer), name_(name), begin_query_(timer->QueryTimestamp()) {}
+  ~GpuTraceZone() {
+    timer_->AddSpan(name_, begin_query_, timer_->QueryTimestamp());
+  }
+  GpuTraceZone(const GpuTraceZone&) = delete;
+  GpuTraceZone& operator=(const GpuTraceZone&) = delete;
+
+ private:
+  GpuTraceTimer* timer_;
+  const char* name_;
+  unsigned int begin_query_;
+};
+
+#ifdef GLITTER_TRACING
+// Traces the GL commands of the rest of the enclosing scope as `name`.
+#define GPU_TRACE_ZONE(timer, name) \
+  GpuTraceZone TRACE_CONCAT(gpu_trace_zone_, __LINE__)(timer, name)
+#else
+#define GPU_TRACE_ZONE(timer, name)
+#endif
+
+#endif
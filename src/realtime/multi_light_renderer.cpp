@@ -46,8 +46,7 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
 
 GLFWwindow* MultiLightRenderer::Init(const std::string& window_name) {
   if (!windowed_mode_) {
-    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
-    glfwWindowHint(GLFW_COCOA_MENUBAR, GLFW_FALSE);
+    return nullptr;
   }
   window_ =
       glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, window_name.c_str(), NULL, NULL);
@@ -120,6 +119,7 @@ void MultiLightRenderer::AddEventHandler(CameraEventHandler* event_handler) {
 
 void MultiLightRenderer::Render() {
   if (window_ == nullptr) return;
+  TRACE_ZONE("frame");
   glfwMakeContextCurrent(window_);
 
   float currentFrame = glfwGetTime();
@@ -128,9 +128,7 @@ void MultiLightRenderer::Render() {
 
   processInput(deltaTime);
   if (!pause_) {
-    for (std::unique_ptr<DynamicRenderable>& model : dynamic_models_) {
-      model->Tick(deltaTime);
-    }
+    TickDynamicModels(deltaTime);
   }
   for (CameraEventHandler* handler : event_handlers_) {
     handler->TickUpdateCamera(&camera_, deltaTime);
@@ -155,6 +153,8 @@ void MultiLightRenderer::Render() {
   glBindFramebuffer(GL_FRAMEBUFFER, depth_map_fbo_);
   glClear(GL_DEPTH_BUFFER_BIT);
   {
+    TRACE_ZONE("shadow pass");
+    GPU_TRACE_ZONE(&gpu_timer_, "shadow pass");
     glm::mat4 model_mat;
     for (int i = 0; i < static_models_.size(); i++) {
       static_models_[i]->Draw({depth_shader_.get()}, static_model_matrices_[i]);
@@ -196,6 +196,8 @@ void MultiLightRenderer::Render() {
   glActiveTexture(GL_TEXTURE1);
   glBindTexture(GL_TEXTURE_2D, depth_map_texture_);
   {
+    TRACE_ZONE("main pass");
+    GPU_TRACE_ZONE(&gpu_timer_, "main pass");
     glm::mat4 model_mat;
     for (int i = 0; i < static_models_.size(); i++) {
       static_models_[i]->Draw({shader_.get()}, static_model_matrices_[i]);
@@ -205,21 +207,29 @@ void MultiLightRenderer::Render() {
     }
   }
 
-  light_box_shader_->use();
-  light_box_shader_->setMat4("projection", projection);
-  light_box_shader_->setMat4("view", view);
-  for (int i = 0; i < lights_.size() && i < kNumLights; i++) {
-    const Light& light = lights_[i];
-    glm::mat4 model = glm::mat4(1.0f);
-    model = glm::translate(model, light.Position);
-    model = glm::scale(model, glm::vec3(0.05f));
-    light_box_shader_->setMat4("model", model);
-    light_box_shader_->setVec3("lightColor", light.Color);
-    RenderCube();
+  {
+    TRACE_ZONE("light boxes");
+    GPU_TRACE_ZONE(&gpu_timer_, "light boxes");
+    light_box_shader_->use();
+    light_box_shader_->setMat4("projection", projection);
+    light_box_shader_->setMat4("view", view);
+    for (int i = 0; i < lights_.size() && i < kNumLights; i++) {
+      const Light& light = lights_[i];
+      glm::mat4 model = glm::mat4(1.0f);
+      model = glm::translate(model, light.Position);
+      model = glm::scale(model, glm::vec3(0.05f));
+      light_box_shader_->setMat4("model", model);
+      light_box_shader_->setVec3("lightColor", light.Color);
+      RenderCube();
+    }
   }
 
-  glfwSwapBuffers(window_);
+  {
+    TRACE_ZONE("swap buffers");
+    glfwSwapBuffers(window_);
+  }
   glfwPollEvents();
+  gpu_timer_.Collect();
 }
 
 SceneLights MultiLightRenderer::GetLights() const {
@@ -14,6 +14,7 @@
 #include "learnopengl/filesystem.h"
 #include "learnopengl/model.h"
 #include "learnopengl/shader.h"
+#include "realtime/gpu_trace.hpp"
 #include "realtime/rt_renderer.hpp"
 
 class MultiLightRenderer : public RtRenderer {
@@ -50,6 +51,7 @@ class MultiLightRenderer : public RtRenderer {
   std::unique_ptr<Shader> light_box_shader_;
   std::vector<CameraEventHandler*> event_handlers_;
   std::unordered_map<int, bool> key_states_;
+  GpuTraceTimer gpu_timer_;
 
   bool directional_light_enabled_ = false;
   bool pause_ = true;
@@ -45,8 +45,7 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
 
 GLFWwindow* PointShadowsDynamicRenderer::Init(const std::string& window_name) {
   if (!windowed_mode_) {
-    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
-    glfwWindowHint(GLFW_COCOA_MENUBAR, GLFW_FALSE);
+    return nullptr;
   }
   window_ =
       glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, window_name.c_str(), NULL, NULL);
@@ -127,9 +126,7 @@ void PointShadowsDynamicRenderer::Render() {
 
   processInput(deltaTime);
   if (!pause_) {
-    for (std::unique_ptr<DynamicRenderable>& model : dynamic_models_) {
-      model->Tick(deltaTime);
-    }
+    TickDynamicModels(deltaTime);
   }
   for (CameraEventHandler* handler : event_handlers_) {
     handler->TickUpdateCamera(&camera_, deltaTime);
@@ -27,3 +27,34 @@ void RtRenderer::GetTris(std::vector<InterPtr>* tris) {
     model->GetTris(glm::mat4(1.0f), tris);
   }
 }
+
+void RtRenderer::GetGeometry(SceneGeometry* geometry) {
+  GetStaticGeometry(geometry);
+  GetDynamicGeometry(geometry);
+}
+
+void RtRenderer::GetStaticGeometry(SceneGeometry* geometry) {
+  for (int i = 0; i < static_models_.size(); i++) {
+    static_models_[i]->GetGeometry(static_model_matrices_[i], geometry);
+  }
+}
+
+void RtRenderer::GetDynamicGeometry(SceneGeometry* geometry) {
+  for (const std::unique_ptr<DynamicRenderable>& model : dynamic_models_) {
+    geometry->BeginObject();
+    model->GetGeometry(glm::mat4(1.0f), geometry);
+  }
+}
+
+void RtRenderer::TickDynamicModels(double delta_sec) {
+  for (std::unique_ptr<DynamicRenderable>& model : dynamic_models_) {
+    model->Tick(delta_sec);
+  }
+}
+
+void RtRenderer::UpdateDynamicGeometry(SceneGeometry* geometry) {
+  uint32_t instance = 0;
+  for (const std::unique_ptr<DynamicRenderable>& model : dynamic_models_) {
+    model->UpdateGeometry(glm::mat4(1.0f), geometry, &instance);
+  }
+}
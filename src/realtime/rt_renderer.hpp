@@ -17,6 +17,9 @@
 
 class RtRenderer {
  public:
+  // Without `windowed_mode`, the renderer only holds the scene for tracing:
+  // `Init` opens no window and returns null, `Render` does nothing, and
+  // neither GLFW nor GL is needed.
   RtRenderer(bool windowed_mode = true) : windowed_mode_(windowed_mode) {}
   virtual ~RtRenderer() = default;
   virtual GLFWwindow* Init(const std::string& window_name) = 0;
@@ -25,6 +28,17 @@ class RtRenderer {
                         glm::mat4 model_matrix);
   virtual void AddDynamicModel(std::unique_ptr<DynamicRenderable> model);
   virtual void GetTris(std::vector<InterPtr>* tris);
+  virtual void GetGeometry(SceneGeometry* geometry);
+  // `GetGeometry` split into the models added with `AddModel` and those added
+  // with `AddDynamicModel`. Each dynamic model starts a new object.
+  virtual void GetStaticGeometry(SceneGeometry* geometry);
+  virtual void GetDynamicGeometry(SceneGeometry* geometry);
+  // Moves the instances of a `GetDynamicGeometry` geometry to where the
+  // dynamic models are now.
+  virtual void UpdateDynamicGeometry(SceneGeometry* geometry);
+  // Advances the dynamic models by `delta_sec`, as each frame of `Render`
+  // does unless paused.
+  void TickDynamicModels(double delta_sec);
   virtual void AddEventHandler(CameraEventHandler* event_handler) = 0;
   virtual void Render() = 0;
   virtual bool WindowShouldClose() = 0;
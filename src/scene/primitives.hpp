@@ -1,6 +1,7 @@
 #ifndef SCENE_PRIMITIVES_HPP
 #define SCENE_PRIMITIVES_HPP
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -67,8 +68,8 @@ struct SceneLights {
   DVec3 directional_light_color;
 };
 
+// Pixel data in memory. See `GetGlTexture` for drawing it with GL.
 struct Texture {
-  unsigned int id = 0;
   std::string type;
   std::string path;
   int width = 0;
@@ -76,6 +77,10 @@ struct Texture {
   int num_components = 0;
   int row_alignment = 0;
   unsigned char* data = nullptr;
+  // The GL texture that `GetGlTexture` uploaded `data` to, or zero. Copies
+  // share it along with `data`.
+  std::shared_ptr<unsigned int> gl_texture =
+      std::make_shared<unsigned int>(0);
 
   RgbPix Sample(double u, double v) const;
   RgbPix Sample(DVec2 uv) const;
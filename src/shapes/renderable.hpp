@@ -1,10 +1,12 @@
 #ifndef SHAPES_RENDERABLE_HPP
 #define SHAPES_RENDERABLE_HPP
 
+#include <cstdint>
 #include <vector>
 
 #include "learnopengl/shader.h"
 #include "tracer/intersectable.hpp"
+#include "tracer/scene_geometry.hpp"
 
 struct ShaderSet {
   Shader* texture_shader;
@@ -15,6 +17,13 @@ class Renderable {
   virtual ~Renderable() = default;
   virtual void Draw(ShaderSet shaders, glm::mat4 model_mat) = 0;
   virtual void GetTris(glm::mat4 model_mat, std::vector<InterPtr>* tris) = 0;
+  // Like `GetTris`, but adds the triangles to a compact `SceneGeometry`.
+  virtual void GetGeometry(glm::mat4 model_mat, SceneGeometry* geometry) = 0;
+  // Moves the instances `GetGeometry` added, starting at instance
+  // `*instance`, to where this renderable is now, and advances `*instance`
+  // past them.
+  virtual void UpdateGeometry(glm::mat4 model_mat, SceneGeometry* geometry,
+                              uint32_t* instance) = 0;
 };
 
 #endif
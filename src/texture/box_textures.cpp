@@ -1,8 +1,10 @@
 #include "texture/box_textures.hpp"
 
+#include "profile/trace.hpp"
 #include "texture/tex_canvas.hpp"
 
 Texture GetTestBoxTexture(std::default_random_engine* random_gen) {
+  TRACE_ZONE("box texture generation");
   const int width = 1000;
   const int height = 1000;
   TexCanvas canvas(width, height);
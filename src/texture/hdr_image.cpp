@@ -0,0 +1,239 @@
+#include "texture/hdr_image.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+#include "texture/image_sink.hpp"
+#include "texture/tex_canvas.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Narkowicz's coefficients, for (x (a x + b)) / (x (c x + d) + e).
+constexpr float kAcesA = 2.51f;
+constexpr float kAcesB = 0.03f;
+constexpr float kAcesC = 2.43f;
+constexpr float kAcesD = 0.59f;
+constexpr float kAcesE = 0.14f;
+
+template <ToneMapping::Operator op>
+float MapChannel(float x) {
+  // Written so NaN compares false and becomes zero, and an infinite ratio's
+  // NaN becomes one, as `_mm_max_ps` and `_mm_min_ps` do.
+  x = x > 0.0f ? x : 0.0f;
+  if constexpr (op == ToneMapping::Operator::kReinhard) {
+    x = x / (1.0f + x);
+  } else if constexpr (op == ToneMapping::Operator::kAces) {
+    x = (x * (kAcesA * x + kAcesB)) / (x * (kAcesC * x + kAcesD) + kAcesE);
+  }
+  return x < 1.0f ? x : 1.0f;
+}
+
+#if defined(__SSE2__)
+
+template <ToneMapping::Operator op>
+__m128 MapChannels(__m128 x) {
+  // The operand order keeps NaN handling the same as `MapChannel`.
+  x = _mm_max_ps(x, _mm_setzero_ps());
+  if constexpr (op == ToneMapping::Operator::kReinhard) {
+    x = _mm_div_ps(x, _mm_add_ps(_mm_set1_ps(1.0f), x));
+  } else if constexpr (op == ToneMapping::Operator::kAces) {
+    __m128 numerator = _mm_mul_ps(
+        x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(kAcesA), x),
+                      _mm_set1_ps(kAcesB)));
+    __m128 denominator = _mm_add_ps(
+        _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(kAcesC), x),
+                                 _mm_set1_ps(kAcesD))),
+        _mm_set1_ps(kAcesE));
+    x = _mm_div_ps(numerator, denominator);
+  }
+  return _mm_min_ps(x, _mm_set1_ps(1.0f));
+}
+
+#endif
+
+template <ToneMapping::Operator op>
+void ToneMapChannels(const float* in, size_t size, float exposure,
+                     unsigned char* out) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  __m128 scale = _mm_set1_ps(exposure);
+  __m128 max_value = _mm_set1_ps(255.0f);
+  __m128 half = _mm_set1_ps(0.5f);
+  for (; i + 16 <= size; i += 16) {
+    __m128i ints[4];
+    for (int k = 0; k < 4; k++) {
+      __m128 x = _mm_mul_ps(_mm_loadu_ps(in + i + 4 * k), scale);
+      x = MapChannels<op>(x);
+      ints[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, max_value), half));
+    }
+    __m128i low = _mm_packs_epi32(ints[0], ints[1]);
+    __m128i high = _mm_packs_epi32(ints[2], ints[3]);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packus_epi16(low, high));
+  }
+#endif
+  for (; i < size; i++) {
+    out[i] = (int)(MapChannel<op>(in[i] * exposure) * 255.0f + 0.5f);
+  }
+}
+
+void PutLittleEndian(uint64_t value, int bytes, std::string* out) {
+  for (int i = 0; i < bytes; i++) {
+    out->push_back((char)((value >> (8 * i)) & 255));
+  }
+}
+
+void PutFloat(float value, std::string* out) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  PutLittleEndian(bits, 4, out);
+}
+
+// An OpenEXR header attribute: its name, type, size and value.
+void PutAttribute(const std::string& name, const std::string& type,
+                  const std::string& value, std::string* out) {
+  out->append(name);
+  out->push_back('\0');
+  out->append(type);
+  out->push_back('\0');
+  PutLittleEndian(value.size(), 4, out);
+  out->append(value);
+}
+
+}  // namespace
+
+float ToneMapping::Map(float linear) const {
+  linear *= exposure;
+  switch (op) {
+    case Operator::kClamp:
+      return MapChannel<Operator::kClamp>(linear);
+    case Operator::kReinhard:
+      return MapChannel<Operator::kReinhard>(linear);
+    case Operator::kAces:
+      return MapChannel<Operator::kAces>(linear);
+  }
+  return 0.0f;
+}
+
+void ToneMap(const float* rgb, size_t count, const ToneMapping& tone_mapping,
+             RgbPix* out) {
+  static_assert(sizeof(RgbPix) == 3, "Pixels are written as packed bytes");
+  unsigned char* bytes = reinterpret_cast<unsigned char*>(out);
+  switch (tone_mapping.op) {
+    case ToneMapping::Operator::kClamp:
+      ToneMapChannels<ToneMapping::Operator::kClamp>(
+          rgb, 3 * count, tone_mapping.exposure, bytes);
+      break;
+    case ToneMapping::Operator::kReinhard:
+      ToneMapChannels<ToneMapping::Operator::kReinhard>(
+          rgb, 3 * count, tone_mapping.exposure, bytes);
+      break;
+    case ToneMapping::Operator::kAces:
+      ToneMapChannels<ToneMapping::Operator::kAces>(
+          rgb, 3 * count, tone_mapping.exposure, bytes);
+      break;
+  }
+}
+
+HdrImage::HdrImage(int width, int height)
+    : width_(width), height_(height), data_(3 * (size_t)width * height) {}
+
+void HdrImage::WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                         const float* rgb) {
+  size_t row_floats = 3 * (size_t)(x_end - x_begin);
+  for (int y = y_begin; y < y_end; y++) {
+    memcpy(Pixel(x_begin, y), rgb + (y - y_begin) * row_floats,
+           row_floats * sizeof(float));
+  }
+}
+
+Texture HdrImage::ToTexture(const ToneMapping& tone_mapping) const {
+  std::vector<RgbPix> pixels((size_t)width_ * height_);
+  ToneMap(data(), pixels.size(), tone_mapping, pixels.data());
+  TexCanvas canvas(width_, height_);
+  CanvasSink(&canvas).WriteTile(0, 0, width_, height_, pixels.data());
+  return canvas.ToTexture();
+}
+
+void HdrImage::WritePfm(const std::string& path) const {
+  // A negative scale marks little endian data. Rows go from the bottom up.
+  std::string out = "PF\n" + std::to_string(width_) + " " +
+                    std::to_string(height_) + "\n-1.0\n";
+  out.reserve(out.size() + data_.size() * sizeof(float));
+  for (int y = height_ - 1; y >= 0; y--) {
+    const float* row = Pixel(0, y);
+    for (int i = 0; i < 3 * width_; i++) {
+      PutFloat(row[i], &out);
+    }
+  }
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(out.data(), out.size());
+  if (!file) {
+    FailImageFile("write image", path);
+  }
+}
+
+void HdrImage::WriteExr(const std::string& path) const {
+  std::string out;
+  PutLittleEndian(20000630, 4, &out);  // Magic number.
+  PutLittleEndian(2, 4, &out);         // Version 2, single part scanlines.
+
+  // Channels are listed and stored in alphabetical order.
+  const char* channel_names[3] = {"B", "G", "R"};
+  const int channel_offsets[3] = {2, 1, 0};
+  std::string channels;
+  for (const char* name : channel_names) {
+    channels.append(name);
+    channels.push_back('\0');
+    PutLittleEndian(2, 4, &channels);  // 32-bit float.
+    PutLittleEndian(0, 4, &channels);  // Not perceptually linear, reserved.
+    PutLittleEndian(1, 4, &channels);  // No subsampling.
+    PutLittleEndian(1, 4, &channels);
+  }
+  channels.push_back('\0');
+  std::string window;
+  PutLittleEndian(0, 4, &window);
+  PutLittleEndian(0, 4, &window);
+  PutLittleEndian(width_ - 1, 4, &window);
+  PutLittleEndian(height_ - 1, 4, &window);
+  std::string one;
+  PutFloat(1.0f, &one);
+  PutAttribute("channels", "chlist", channels, &out);
+  PutAttribute("compression", "compression", std::string(1, '\0'), &out);
+  PutAttribute("dataWindow", "box2i", window, &out);
+  PutAttribute("displayWindow", "box2i", window, &out);
+  PutAttribute("lineOrder", "lineOrder", std::string(1, '\0'), &out);
+  PutAttribute("pixelAspectRatio", "float", one, &out);
+  PutAttribute("screenWindowCenter", "v2f", std::string(8, '\0'), &out);
+  PutAttribute("screenWindowWidth", "float", one, &out);
+  out.push_back('\0');
+
+  // Then the offset of each scanline, and the scanlines: each its y, its
+  // size and every channel of the row in turn.
+  size_t row_size = 3 * (size_t)width_ * sizeof(float);
+  size_t first_row = out.size() + (size_t)height_ * 8;
+  for (int y = 0; y < height_; y++) {
+    PutLittleEndian(first_row + (size_t)y * (8 + row_size), 8, &out);
+  }
+  out.reserve(out.size() + (size_t)height_ * (8 + row_size));
+  for (int y = 0; y < height_; y++) {
+    PutLittleEndian(y, 4, &out);
+    PutLittleEndian(row_size, 4, &out);
+    const float* row = Pixel(0, y);
+    for (int offset : channel_offsets) {
+      for (int x = 0; x < width_; x++) {
+        PutFloat(row[3 * x + offset], &out);
+      }
+    }
+  }
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(out.data(), out.size());
+  if (!file) {
+    FailImageFile("write image", path);
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef TEXTURE_HDR_IMAGE_HPP
+#define TEXTURE_HDR_IMAGE_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "scene/primitives.hpp"
+
+// How linear colors, which may exceed one, are mapped to 8 bits. Each
+// channel is mapped on its own, so a whole image maps in one pass over its
+// floats.
+struct ToneMapping {
+  enum class Operator {
+    // Cuts channels off at one, as `RgbPix::Convert` does. Mapping runs in
+    // float, so a channel within float rounding of halfway between two
+    // levels may land one level away from `RgbPix::Convert`'s; a few
+    // channels in a million do.
+    kClamp,
+    // x / (1 + x), which keeps detail in highlights but darkens everything.
+    kReinhard,
+    // Narkowicz's fit of the ACES filmic curve.
+    kAces,
+  };
+  Operator op = Operator::kClamp;
+  // Colors are scaled by this first.
+  float exposure = 1.0f;
+
+  // Maps one channel to [0, 1]. NaN maps to zero.
+  float Map(float linear) const;
+};
+
+// Maps the `count` pixels of `rgb`, three floats each, to `out`. Runs four
+// channels at a time with SSE2 where available; both paths give the same
+// bytes.
+void ToneMap(const float* rgb, size_t count, const ToneMapping& tone_mapping,
+             RgbPix* out);
+
+// A linear float RGB image, for colors that must keep their range until
+// they are saved or mapped to 8 bits. Channels are interleaved with no
+// padding, in the same order as the `RgbPix` they map to, so mapping is a
+// straight pass from floats to bytes.
+class HdrImage {
+ public:
+  HdrImage() = default;
+  HdrImage(int width, int height);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  // Pixel (x, y) starts at float `3 * (y * width() + x)`.
+  float* data() { return data_.data(); }
+  const float* data() const { return data_.data(); }
+  float* Pixel(int x, int y) { return &data_[3 * ((size_t)y * width_ + x)]; }
+  const float* Pixel(int x, int y) const {
+    return &data_[3 * ((size_t)y * width_ + x)];
+  }
+
+  // Copies in the pixels of [x_begin, x_end) x [y_begin, y_end), row by
+  // row, three floats each.
+  void WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                 const float* rgb);
+
+  Texture ToTexture(const ToneMapping& tone_mapping) const;
+  // Lossless float files. Both exit on failure.
+  void WritePfm(const std::string& path) const;
+  // An uncompressed single part scanline OpenEXR file of 32-bit channels.
+  void WriteExr(const std::string& path) const;
+
+ private:
+  int width_ = 0;
+  int height_ = 0;
+  std::vector<float> data_;
+};
+
+#endif
@@ -6,12 +6,19 @@
 #include <stb_image.h>
 #include <stb_image_write.h>
 
-void BuildGlTexture(Texture* texture) {
+#include "profile/trace.hpp"
+
+unsigned int GetGlTexture(const Texture& texture) {
+  // Kept on the texture rather than looked up by `data`, whose address may be
+  // reused by another texture once freed.
+  if (*texture.gl_texture != 0) {
+    return *texture.gl_texture;
+  }
   unsigned int textureID;
   glGenTextures(1, &textureID);
-  texture->id = textureID;
+  *texture.gl_texture = textureID;
   GLenum format;
-  switch (texture->num_components) {
+  switch (texture.num_components) {
     case 1:
       format = GL_RED;
       break;
@@ -22,15 +29,15 @@ void BuildGlTexture(Texture* texture) {
       format = GL_RGBA;
       break;
     default:
-      std::cerr << "Unexpected number of components " << texture->num_components
-                << " in texture from " << texture->path << std::endl;
+      std::cerr << "Unexpected number of components " << texture.num_components
+                << " in texture from " << texture.path << std::endl;
       exit(-1);
       break;
   }
 
   glBindTexture(GL_TEXTURE_2D, textureID);
-  glTexImage2D(GL_TEXTURE_2D, 0, format, texture->width, texture->height, 0,
-               format, GL_UNSIGNED_BYTE, texture->data);
+  glTexImage2D(GL_TEXTURE_2D, 0, format, texture.width, texture.height, 0,
+               format, GL_UNSIGNED_BYTE, texture.data);
   glGenerateMipmap(GL_TEXTURE_2D);
 
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -38,10 +45,12 @@ void BuildGlTexture(Texture* texture) {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
                   GL_LINEAR_MIPMAP_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  return textureID;
 }
 
 Texture TextureFromFile(const std::string& filename,
                         const std::string& typeName, bool gamma) {
+  TRACE_ZONE("texture load");
   std::string clean_filename = filename;
 #ifdef _WIN32
   std::replace(clean_filename.begin(), clean_filename.end(), '/', '\\');
@@ -58,7 +67,6 @@ Texture TextureFromFile(const std::string& filename,
   texture.row_alignment = texture.width * texture.num_components;
   if (data) {
     texture.data = data;
-    BuildGlTexture(&texture);
   } else {
     std::cerr << "Texture failed to load at path: " << clean_filename
               << std::endl;
@@ -83,6 +91,7 @@ Texture TextureFromFile(const std::string& path, const std::string& directory,
 }
 
 void TextureToFile(const std::string& filename, const Texture& tex) {
+  TRACE_ZONE("png encode");
   std::string clean_filename = filename;
 #ifdef _WIN32
   std::replace(clean_filename.begin(), clean_filename.end(), '/', '\\');
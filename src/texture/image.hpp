@@ -5,7 +5,10 @@
 
 #include "scene/primitives.hpp"
 
-void BuildGlTexture(Texture* texture);
+// Returns the GL name of `texture`, uploading it to the current context the
+// first time it or a copy of it is drawn. Textures are only uploaded when
+// drawn, so loading and generating them works without a GL context.
+unsigned int GetGlTexture(const Texture& texture);
 Texture TextureFromFile(const std::string& filename,
                         const std::string& typeName, bool gamma = false);
 Texture TextureFromFile(const std::string& path, const std::string& directory,
@@ -0,0 +1,341 @@
+#include "texture/image_sink.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(RgbPix) == 3, "Tiles are copied as packed RGB");
+
+namespace {
+
+constexpr int kChannels = 3;
+// IDAT chunks are written once this much compressed data is waiting.
+constexpr size_t kIdatSize = 1 << 16;
+constexpr unsigned char kPngSignature[8] = {0x89, 'P',  'N',  'G',
+                                            '\r', '\n', 0x1a, '\n'};
+
+uint32_t Crc32(uint32_t crc, const unsigned char* data, size_t size) {
+  static const std::vector<uint32_t> table = []() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      table[n] = c;
+    }
+    return table;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ data[i]) & 255] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+void PutBigEndian(uint32_t value, unsigned char* out) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+int Paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = std::abs(p - a);
+  int pb = std::abs(p - b);
+  int pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+}  // namespace
+
+void FailImageFile(const std::string& what, const std::string& path) {
+  std::cerr << "Failed to " << what << " " << path << std::endl;
+  exit(-1);
+}
+
+void CanvasSink::WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                           const RgbPix* pixels) {
+  for (int y = y_begin; y < y_end; y++) {
+    for (int x = x_begin; x < x_end; x++) {
+      canvas_->SetPix(x, y, *pixels++);
+    }
+  }
+}
+
+MappedPpmSink::~MappedPpmSink() { Unmap(); }
+
+void MappedPpmSink::Begin(int width, int height) {
+  width_ = width;
+  height_ = height;
+  row_pixels_.assign(height, 0);
+  std::string header = "P6\n" + std::to_string(width) + " " +
+                       std::to_string(height) + "\n255\n";
+  header_size_ = header.size();
+  file_size_ = header_size_ + (size_t)width * height * kChannels;
+#ifdef _WIN32
+  // No memory map here: tiles are written in place through the stream.
+  file_.open(path_, std::ios::binary | std::ios::out | std::ios::trunc);
+  file_.write(header.data(), header.size());
+  file_.seekp(file_size_ - 1);
+  file_.put(0);
+  if (!file_) {
+    FailImageFile("create image", path_);
+  }
+#else
+  fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0 || ftruncate(fd_, file_size_) != 0) {
+    FailImageFile("create image", path_);
+  }
+  void* map =
+      mmap(nullptr, file_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    FailImageFile("map image", path_);
+  }
+  map_ = static_cast<unsigned char*>(map);
+  memcpy(map_, header.data(), header.size());
+#endif
+}
+
+void MappedPpmSink::WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                              const RgbPix* pixels) {
+  size_t row_bytes = (size_t)(x_end - x_begin) * kChannels;
+  for (int y = y_begin; y < y_end; y++) {
+    size_t offset = header_size_ + ((size_t)y * width_ + x_begin) * kChannels;
+    const RgbPix* row = pixels + (size_t)(y - y_begin) * (x_end - x_begin);
+#ifdef _WIN32
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_.seekp(offset);
+    file_.write(reinterpret_cast<const char*>(row), row_bytes);
+#else
+    // Tiles never overlap, so they are copied without a lock.
+    memcpy(map_ + offset, row, row_bytes);
+#endif
+  }
+  FinishPixels(x_begin, y_begin, x_end, y_end);
+}
+
+void MappedPpmSink::FinishPixels(int x_begin, int y_begin, int x_end,
+                                 int y_end) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (int y = y_begin; y < y_end; y++) {
+    row_pixels_[y] += x_end - x_begin;
+  }
+  while (done_rows_ < height_ && row_pixels_[done_rows_] == width_) {
+    done_rows_++;
+  }
+#ifndef _WIN32
+  // Dirty pages of a shared map stay in the page cache until written back,
+  // so dropping them from the map loses nothing.
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t done = header_size_ + (size_t)done_rows_ * width_ * kChannels;
+  size_t release = done / page_size * page_size;
+  if (release > released_) {
+    msync(map_ + released_, release - released_, MS_ASYNC);
+    madvise(map_ + released_, release - released_, MADV_DONTNEED);
+    released_ = release;
+  }
+#endif
+}
+
+void MappedPpmSink::Finish() {
+  if (done_rows_ != height_) {
+    std::cerr << "Image " << path_ << " finished with " << height_ - done_rows_
+              << " rows missing" << std::endl;
+    exit(-1);
+  }
+#ifdef _WIN32
+  file_.close();
+  if (!file_) {
+    FailImageFile("write image", path_);
+  }
+#else
+  if (munmap(map_, file_size_) != 0 || close(fd_) != 0) {
+    FailImageFile("write image", path_);
+  }
+  map_ = nullptr;
+  fd_ = -1;
+#endif
+}
+
+void MappedPpmSink::Unmap() {
+#ifndef _WIN32
+  if (map_ != nullptr) {
+    munmap(map_, file_size_);
+    map_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+#endif
+}
+
+void PngStreamSink::Begin(int width, int height) {
+  width_ = width;
+  height_ = height;
+  rows_.resize(height);
+  row_pixels_.assign(height, 0);
+  previous_row_.assign((size_t)width * kChannels, 0);
+  for (std::vector<unsigned char>& filtered : filtered_) {
+    filtered.resize(1 + (size_t)width * kChannels);
+  }
+
+  out_.open(path_, std::ios::binary | std::ios::trunc);
+  out_.write(reinterpret_cast<const char*>(kPngSignature),
+             sizeof(kPngSignature));
+  unsigned char header[13];
+  PutBigEndian(width, header);
+  PutBigEndian(height, header + 4);
+  header[8] = 8;   // Bits per channel.
+  header[9] = 2;   // RGB.
+  header[10] = 0;  // Deflate.
+  header[11] = 0;  // Adaptive filtering.
+  header[12] = 0;  // Not interlaced.
+  WriteChunk("IHDR", header, sizeof(header));
+  if (!out_) {
+    FailImageFile("create image", path_);
+  }
+}
+
+void PngStreamSink::WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                              const RgbPix* pixels) {
+  size_t row_bytes = (size_t)(x_end - x_begin) * kChannels;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int y = y_begin; y < y_end; y++) {
+      if (!rows_[y]) {
+        rows_[y].reset(new unsigned char[(size_t)width_ * kChannels]);
+      }
+      memcpy(rows_[y].get() + (size_t)x_begin * kChannels,
+             pixels + (size_t)(y - y_begin) * (x_end - x_begin), row_bytes);
+      row_pixels_[y] += x_end - x_begin;
+    }
+  }
+  EncodeReadyRows();
+}
+
+void PngStreamSink::Finish() {
+  EncodeReadyRows();
+  if (next_row_ != height_) {
+    std::cerr << "Image " << path_ << " finished with " << height_ - next_row_
+              << " rows missing" << std::endl;
+    exit(-1);
+  }
+  std::lock_guard<std::mutex> encode_lock(encode_mutex_);
+  zlib_.Finish(&idat_);
+  FlushIdat(true);
+  WriteChunk("IEND", nullptr, 0);
+  out_.close();
+  if (!out_) {
+    FailImageFile("write image", path_);
+  }
+}
+
+void PngStreamSink::EncodeReadyRows() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> encode_lock(encode_mutex_,
+                                               std::try_to_lock);
+      if (!encode_lock.owns_lock()) {
+        // The thread encoding takes this row too.
+        return;
+      }
+      while (std::unique_ptr<unsigned char[]> row = TakeNextRow()) {
+        EncodeRow(row.get());
+      }
+    }
+    // Rows finished by threads that found the lock taken, after the last
+    // `TakeNextRow`, are left to this thread.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (next_row_ == height_ || row_pixels_[next_row_] < width_) {
+      return;
+    }
+  }
+}
+
+std::unique_ptr<unsigned char[]> PngStreamSink::TakeNextRow() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (next_row_ == height_ || row_pixels_[next_row_] < width_) {
+    return nullptr;
+  }
+  return std::move(rows_[next_row_++]);
+}
+
+void PngStreamSink::EncodeRow(const unsigned char* row) {
+  // Tries each filter and keeps the one with the smallest sum of absolute
+  // differences, as libpng and stb do.
+  size_t size = (size_t)width_ * kChannels;
+  const unsigned char* above = previous_row_.data();
+  long best_score = -1;
+  int best_filter = 0;
+  for (int filter = 0; filter < 5; filter++) {
+    unsigned char* filtered = filtered_[filter].data();
+    filtered[0] = filter;
+    long score = 0;
+    for (size_t i = 0; i < size; i++) {
+      int a = i >= kChannels ? row[i - kChannels] : 0;
+      int b = above[i];
+      int c = i >= kChannels ? above[i - kChannels] : 0;
+      int predicted = 0;
+      switch (filter) {
+        case 1:
+          predicted = a;
+          break;
+        case 2:
+          predicted = b;
+          break;
+        case 3:
+          predicted = (a + b) / 2;
+          break;
+        case 4:
+          predicted = Paeth(a, b, c);
+          break;
+      }
+      unsigned char value = row[i] - predicted;
+      filtered[1 + i] = value;
+      score += std::abs((signed char)value);
+    }
+    if (best_score < 0 || score < best_score) {
+      best_score = score;
+      best_filter = filter;
+    }
+  }
+  zlib_.Write(filtered_[best_filter].data(), filtered_[best_filter].size(),
+              &idat_);
+  memcpy(previous_row_.data(), row, size);
+  FlushIdat(false);
+}
+
+void PngStreamSink::FlushIdat(bool force) {
+  if (idat_.size() >= kIdatSize || (force && !idat_.empty())) {
+    WriteChunk("IDAT", idat_.data(), idat_.size());
+    idat_.clear();
+  }
+}
+
+void PngStreamSink::WriteChunk(const char* type, const unsigned char* data,
+                               size_t size) {
+  unsigned char length[4];
+  PutBigEndian(size, length);
+  out_.write(reinterpret_cast<const char*>(length), 4);
+  out_.write(type, 4);
+  if (size > 0) {
+    out_.write(reinterpret_cast<const char*>(data), size);
+  }
+  uint32_t crc = Crc32(0, reinterpret_cast<const unsigned char*>(type), 4);
+  crc = Crc32(crc, data, size);
+  unsigned char crc_bytes[4];
+  PutBigEndian(crc, crc_bytes);
+  out_.write(reinterpret_cast<const char*>(crc_bytes), 4);
+}
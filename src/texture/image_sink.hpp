@@ -0,0 +1,129 @@
+#ifndef TEXTURE_IMAGE_SINK_HPP
+#define TEXTURE_IMAGE_SINK_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "scene/primitives.hpp"
+#include "texture/tex_canvas.hpp"
+#include "texture/zlib_stream.hpp"
+
+// Takes an RGB image a tile at a time as a renderer finishes them, so the
+// whole image need not be held in memory.
+class ImageSink {
+ public:
+  virtual ~ImageSink() = default;
+
+  // Called once, before any tile.
+  virtual void Begin(int width, int height) = 0;
+  // Takes the pixels of [x_begin, x_end) x [y_begin, y_end), row by row.
+  // Tiles come in any order and possibly from several threads at once, but
+  // each pixel comes once.
+  virtual void WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                         const RgbPix* pixels) = 0;
+  // Called once, after every tile.
+  virtual void Finish() = 0;
+};
+
+// Draws the tiles onto a canvas of the image's size.
+class CanvasSink : public ImageSink {
+ public:
+  explicit CanvasSink(TexCanvas* canvas) : canvas_(canvas) {}
+
+  void Begin(int, int) override {}
+  void WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                 const RgbPix* pixels) override;
+  void Finish() override {}
+
+ private:
+  TexCanvas* canvas_;
+};
+
+// Writes a binary PPM file through a memory map of it, where tiles are
+// copied in place. Pages are dropped from the map once the rows up to them
+// are finished, so memory holds little more than the rows in flight. On
+// Windows tiles are written through a stream instead. Exits on failure.
+class MappedPpmSink : public ImageSink {
+ public:
+  explicit MappedPpmSink(std::string path) : path_(std::move(path)) {}
+  ~MappedPpmSink() override;
+
+  void Begin(int width, int height) override;
+  void WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                 const RgbPix* pixels) override;
+  void Finish() override;
+
+ private:
+  // Counts `x_end - x_begin` more pixels done in each of the rows, and
+  // releases the pages of the rows finished in order so far.
+  void FinishPixels(int x_begin, int y_begin, int x_end, int y_end);
+  void Unmap();
+
+  std::string path_;
+  int width_ = 0;
+  int height_ = 0;
+  size_t header_size_ = 0;
+  size_t file_size_ = 0;
+  int fd_ = -1;
+  unsigned char* map_ = nullptr;
+#ifdef _WIN32
+  std::ofstream file_;
+#endif
+
+  std::mutex mutex_;
+  std::vector<int> row_pixels_;
+  // Rows before this are finished, and pages before `released_` dropped.
+  int done_rows_ = 0;
+  size_t released_ = 0;
+};
+
+// Encodes a PNG file row by row as rows are finished, so encoding overlaps
+// rendering. Only rows not yet encoded are held in memory, which is about
+// the rows of the tiles in flight. Exits on failure.
+class PngStreamSink : public ImageSink {
+ public:
+  explicit PngStreamSink(std::string path) : path_(std::move(path)) {}
+
+  void Begin(int width, int height) override;
+  void WriteTile(int x_begin, int y_begin, int x_end, int y_end,
+                 const RgbPix* pixels) override;
+  void Finish() override;
+
+ private:
+  // Encodes the finished rows in order, unless another thread is already
+  // doing so.
+  void EncodeReadyRows();
+  // Takes the next row if it is finished.
+  std::unique_ptr<unsigned char[]> TakeNextRow();
+  void EncodeRow(const unsigned char* row);
+  // Writes `idat_` as one IDAT chunk once it is large enough, or if `force`.
+  void FlushIdat(bool force);
+  void WriteChunk(const char* type, const unsigned char* data, size_t size);
+
+  std::string path_;
+  int width_ = 0;
+  int height_ = 0;
+
+  // Guards the rows waiting to be encoded.
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<unsigned char[]>> rows_;
+  std::vector<int> row_pixels_;
+  int next_row_ = 0;
+
+  // Guards everything below, held by the thread encoding.
+  std::mutex encode_mutex_;
+  std::ofstream out_;
+  ZlibStream zlib_;
+  std::vector<unsigned char> previous_row_;
+  std::vector<unsigned char> filtered_[5];
+  std::vector<unsigned char> idat_;
+};
+
+// Prints that `what` failed for the image file at `path`, and exits.
+void FailImageFile(const std::string& what, const std::string& path);
+
+#endif
@@ -1,17 +1,21 @@
 #include "texture/tex_canvas.hpp"
 
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
-#include <GLFW/glfw3.h>
-#include <glad/glad.h>
+namespace {
 
-#include "learnopengl/model.h"
+// Rows are padded to GL's default `GL_UNPACK_ALIGNMENT`, so a canvas can be
+// uploaded as is without asking a GL context.
+constexpr int kRowAlignmentDiv = 4;
+
+}  // namespace
 
 TexCanvas::TexCanvas(int width, int height, int channels)
     : width_(width), height_(height), channels_(channels) {
-  GLint row_alignment_div;
-  glGetIntegerv(GL_UNPACK_ALIGNMENT, &row_alignment_div);
-  row_alignment_ = (width_ * channels_) + (width_ % row_alignment_div);
+  row_alignment_ = (width_ * channels_ + kRowAlignmentDiv - 1) /
+                   kRowAlignmentDiv * kRowAlignmentDiv;
   int mem_size = sizeof(unsigned char) * row_alignment_ * height_;
   data = (unsigned char*)malloc(mem_size);
   // Set everything to white
@@ -74,6 +78,5 @@ Texture TexCanvas::ToTexture(std::string texture_type) {
   tex.num_components = channels_;
   tex.row_alignment = row_alignment_;
   tex.data = data;
-  BuildGlTexture(&tex);
   return tex;
 }
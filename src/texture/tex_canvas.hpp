@@ -5,6 +5,7 @@
 
 #include "learnopengl/mesh.h"
 
+// An image being drawn in memory. Needs no GL context.
 class TexCanvas {
  public:
   TexCanvas(int width, int height, int channels = 3);
@@ -0,0 +1,192 @@
+#include "texture/zlib_stream.hpp"
+
+#include <algorithm>
+
+namespace {
+
+constexpr size_t kWindowSize = 32768;
+constexpr int kMinMatch = 3;
+constexpr int kMaxMatch = 258;
+constexpr int kHashBits = 15;
+// Candidates tried per position. More finds longer matches, slower.
+constexpr int kMaxChain = 32;
+constexpr uint32_t kAdlerModulus = 65521;
+// The most bytes that can be summed before the Adler sums might overflow.
+constexpr size_t kAdlerBlock = 5552;
+
+// Length codes 257 to 285 and distance codes from RFC 1951, section 3.2.5.
+constexpr int kLengthBase[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr int kLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                  1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                  4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr int kDistanceBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+constexpr int kDistanceExtra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                    4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                    9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+}  // namespace
+
+ZlibStream::ZlibStream()
+    : head_(size_t{1} << kHashBits, 0), prev_(kWindowSize, 0) {}
+
+void ZlibStream::Write(const unsigned char* data, size_t size,
+                       std::vector<unsigned char>* out) {
+  if (!started_) {
+    Start(out);
+  }
+  for (size_t i = 0; i < size;) {
+    size_t n = std::min(size - i, kAdlerBlock);
+    for (size_t j = i; j < i + n; j++) {
+      adler_a_ += data[j];
+      adler_b_ += adler_a_;
+    }
+    adler_a_ %= kAdlerModulus;
+    adler_b_ %= kAdlerModulus;
+    i += n;
+  }
+  window_.insert(window_.end(), data, data + size);
+  if (window_.size() >= kMinMatch) {
+    Compress(window_.size() - (kMinMatch - 1), out);
+  }
+  // Keep 32 KiB behind the next byte for matches to refer back to.
+  if (pos_ > 2 * kWindowSize) {
+    size_t drop = pos_ - kWindowSize;
+    window_.erase(window_.begin(), window_.begin() + drop);
+    base_ += drop;
+    pos_ -= drop;
+  }
+}
+
+void ZlibStream::Finish(std::vector<unsigned char>* out) {
+  if (!started_) {
+    Start(out);
+  }
+  Compress(window_.size(), out);
+  PutLiteral(256, out);
+  if (bit_count_ > 0) {
+    PutBits(0, 8 - bit_count_, out);
+  }
+  uint32_t adler = (adler_b_ << 16) | adler_a_;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out->push_back((adler >> shift) & 255);
+  }
+}
+
+void ZlibStream::Start(std::vector<unsigned char>* out) {
+  started_ = true;
+  // Deflate with a 32 KiB window, and the check bits for that.
+  out->push_back(0x78);
+  out->push_back(0x01);
+  // The only block is the final one, with fixed codes.
+  PutBits(1, 1, out);
+  PutBits(1, 2, out);
+}
+
+void ZlibStream::Compress(size_t end, std::vector<unsigned char>* out) {
+  while (pos_ < end) {
+    int best_length = 0;
+    int best_distance = 0;
+    size_t available = window_.size() - pos_;
+    if (available >= kMinMatch) {
+      uint64_t stream_pos = base_ + pos_;
+      int max_length = std::min<size_t>(available, kMaxMatch);
+      const unsigned char* current = &window_[pos_];
+      uint64_t candidate = head_[Hash(pos_)];
+      for (int chain = 0; candidate != 0 && chain < kMaxChain; chain++) {
+        uint64_t candidate_pos = candidate - 1;
+        if (stream_pos - candidate_pos > kWindowSize) {
+          break;
+        }
+        const unsigned char* earlier = &window_[candidate_pos - base_];
+        int length = 0;
+        while (length < max_length && earlier[length] == current[length]) {
+          length++;
+        }
+        if (length > best_length) {
+          best_length = length;
+          best_distance = stream_pos - candidate_pos;
+          if (length == max_length) {
+            break;
+          }
+        }
+        candidate = prev_[candidate_pos % kWindowSize];
+      }
+    }
+    int advance = 1;
+    if (best_length >= kMinMatch) {
+      PutMatch(best_length, best_distance, out);
+      advance = best_length;
+    } else {
+      PutLiteral(window_[pos_], out);
+    }
+    for (int i = 0; i < advance; i++, pos_++) {
+      if (pos_ + kMinMatch <= window_.size()) {
+        uint32_t hash = Hash(pos_);
+        uint64_t stream_pos = base_ + pos_;
+        prev_[stream_pos % kWindowSize] = head_[hash];
+        head_[hash] = stream_pos + 1;
+      }
+    }
+  }
+}
+
+void ZlibStream::PutBits(uint32_t bits, int count,
+                         std::vector<unsigned char>* out) {
+  bit_buffer_ |= bits << bit_count_;
+  bit_count_ += count;
+  while (bit_count_ >= 8) {
+    out->push_back(bit_buffer_ & 255);
+    bit_buffer_ >>= 8;
+    bit_count_ -= 8;
+  }
+}
+
+void ZlibStream::PutCode(uint32_t code, int length,
+                         std::vector<unsigned char>* out) {
+  uint32_t reversed = 0;
+  for (int i = 0; i < length; i++) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  PutBits(reversed, length, out);
+}
+
+void ZlibStream::PutLiteral(int symbol, std::vector<unsigned char>* out) {
+  // The fixed literal/length code from RFC 1951, section 3.2.6.
+  if (symbol < 144) {
+    PutCode(0x30 + symbol, 8, out);
+  } else if (symbol < 256) {
+    PutCode(0x190 + symbol - 144, 9, out);
+  } else if (symbol < 280) {
+    PutCode(symbol - 256, 7, out);
+  } else {
+    PutCode(0xc0 + symbol - 280, 8, out);
+  }
+}
+
+void ZlibStream::PutMatch(int length, int distance,
+                          std::vector<unsigned char>* out) {
+  int length_code = 28;
+  while (kLengthBase[length_code] > length) {
+    length_code--;
+  }
+  PutLiteral(257 + length_code, out);
+  PutBits(length - kLengthBase[length_code], kLengthExtra[length_code], out);
+  int distance_code = 29;
+  while (kDistanceBase[distance_code] > distance) {
+    distance_code--;
+  }
+  PutCode(distance_code, 5, out);
+  PutBits(distance - kDistanceBase[distance_code],
+          kDistanceExtra[distance_code], out);
+}
+
+uint32_t ZlibStream::Hash(size_t pos) const {
+  uint32_t bytes = (window_[pos] << 16) | (window_[pos + 1] << 8) |
+                   window_[pos + 2];
+  return (bytes * 2654435761u) >> (32 - kHashBits);
+}
@@ -0,0 +1,55 @@
+#ifndef TEXTURE_ZLIB_STREAM_HPP
+#define TEXTURE_ZLIB_STREAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A zlib stream compressed as its data arrives, for encoders that cannot hold
+// all of it. The stream is one deflate block with the fixed Huffman codes,
+// and repeats are found through hash chains over the last 32 KiB, much like
+// `stbi_zlib_compress`.
+class ZlibStream {
+ public:
+  ZlibStream();
+
+  // Compresses `data`, appending the finished bytes of the stream to `out`.
+  // The last two bytes of the data so far may wait for the next call.
+  void Write(const unsigned char* data, size_t size,
+             std::vector<unsigned char>* out);
+  // Ends the stream, appending the rest of it to `out`.
+  void Finish(std::vector<unsigned char>* out);
+
+ private:
+  // Writes the zlib header and the block header.
+  void Start(std::vector<unsigned char>* out);
+  // Compresses the window from `pos_` up to `end`. Matches may run past
+  // `end`, to the end of the window.
+  void Compress(size_t end, std::vector<unsigned char>* out);
+  // Appends the low `count` bits of `bits`, first bit first.
+  void PutBits(uint32_t bits, int count, std::vector<unsigned char>* out);
+  // Appends a Huffman code, which is packed most significant bit first.
+  void PutCode(uint32_t code, int length, std::vector<unsigned char>* out);
+  void PutLiteral(int symbol, std::vector<unsigned char>* out);
+  void PutMatch(int length, int distance, std::vector<unsigned char>* out);
+  uint32_t Hash(size_t pos) const;
+
+  // The last 32 KiB before `pos_` and everything after it. `window_[0]` is
+  // byte `base_` of the stream.
+  std::vector<unsigned char> window_;
+  uint64_t base_ = 0;
+  // Position in `window_` of the next byte to compress.
+  size_t pos_ = 0;
+  // Most recent stream position of each hash, plus one; zero for none.
+  std::vector<uint64_t> head_;
+  // The stream position before each of the last 32 KiB with the same hash,
+  // plus one.
+  std::vector<uint64_t> prev_;
+  bool started_ = false;
+  uint32_t adler_a_ = 1;
+  uint32_t adler_b_ = 0;
+  uint32_t bit_buffer_ = 0;
+  int bit_count_ = 0;
+};
+
+#endif
@@ -1,107 +1,475 @@
 #include "tracer/acceleration.hpp"
 
 #include <algorithm>
+#include <array>
+#include <functional>
 #include <iostream>
 #include <utility>
 
+#include "profile/trace.hpp"
+
 namespace {
 
-BoundPtr BoundInters(std::vector<Intersectable*> inters) {
-  BoundPtr outer_bound(new BoundBox());
-  for (Intersectable* inter : inters) {
-    outer_bound->AddChild(inter);
+// Primitives per task in the passes over a node's primitives. Nodes with
+// fewer than two chunks' worth are done on the calling thread.
+constexpr size_t kParallelChunk = 16384;
+// Nodes with at least this many primitives build their children as separate
+// tasks.
+constexpr size_t kParallelSubtree = 4096;
+
+int NumChunks(ThreadPool* pool, size_t count) {
+  if (!pool || pool->num_threads() <= 1) {
+    return 1;
   }
-  return outer_bound;
+  size_t max_chunks = 4 * pool->num_threads();
+  return std::max<size_t>(1, std::min(count / kParallelChunk, max_chunks));
 }
 
-AaBox BoxInters(std::vector<Intersectable*> inters) {
-  AaBox box;
-  for (Intersectable* inter : inters) {
-    box.Update(inter->GetAaBox());
+// Calls `fn(chunk, chunk_begin, chunk_end)` for `num_chunks` even chunks of
+// [begin, end), on `pool` if there is more than one.
+void ForChunks(ThreadPool* pool, int num_chunks, size_t begin, size_t end,
+               const std::function<void(int, size_t, size_t)>& fn) {
+  size_t count = end - begin;
+  auto run = [&](int chunk) {
+    fn(chunk, begin + count * chunk / num_chunks,
+       begin + count * (chunk + 1) / num_chunks);
+  };
+  if (num_chunks == 1) {
+    run(0);
+  } else {
+    pool->ParallelFor(num_chunks, run);
   }
-  return box;
 }
 
-int TopDownTriplePickSplitIndex(const std::vector<Intersectable*>& inters,
-                                int iteration) {
-  return iteration % 3;
+// Bounds of a set of boxes, or of points, that can be merged in any order.
+struct SahBin {
+  DVec3 bot = DVec3(1e100);
+  DVec3 top = DVec3(-1e100);
+  int count = 0;
+
+  void Grow(const DVec3& grow_bot, const DVec3& grow_top) {
+    bot = glm::min(bot, grow_bot);
+    top = glm::max(top, grow_top);
+  }
+  void Grow(const SahBin& bin) {
+    Grow(bin.bot, bin.top);
+    count += bin.count;
+  }
+  double SurfaceArea() const {
+    if (count == 0) {
+      return 0.0;
+    }
+    DVec3 diff = top - bot;
+    return 2 * diff.x * diff.y + 2 * diff.y * diff.z + 2 * diff.x * diff.z;
+  }
+};
+
+// A leaf over `prims[begin, end)`, whose boxes are bounded by `box`. The
+// children's boxes are already known, so they are not fetched again.
+template <typename Prim>
+BoundPtr BoundsLeaf(const std::vector<Prim>& prims, size_t begin, size_t end,
+                    const SahBin& box) {
+  if (begin == end) {
+    return BoundPtr(new BoundBox());
+  }
+  BoundPtr leaf(new BoundBox(box.bot, box.top));
+  for (size_t i = begin; i < end; i++) {
+    leaf->BoundShape::AddChild(prims[i].inter);
+  }
+  return leaf;
 }
 
-double PickTripleSplitPoint(const std::vector<Intersectable*>& inters,
-                            AaBox box, int split_index) {
-  double mean = (box.top()[split_index] + box.bot()[split_index]) / 2.0;
+struct TriplePrim {
+  Intersectable* inter;
+  DVec3 bot;
+  DVec3 top;
+};
+
+int TopDownTriplePickSplitIndex(int iteration) { return iteration % 3; }
+
+double PickTripleSplitPoint(const SahBin& box, int split_index) {
+  double mean = (box.top[split_index] + box.bot[split_index]) / 2.0;
   return mean;
 }
 
-std::vector<std::vector<Intersectable*>> TripleSplit(
-    const std::vector<Intersectable*>& inters, int split_index) {
-  AaBox box = BoxInters(inters);
-  double split_point = PickTripleSplitPoint(inters, box, split_index);
-  std::vector<std::vector<Intersectable*>> vecs = {
-      std::vector<Intersectable*>(), std::vector<Intersectable*>(),
-      std::vector<Intersectable*>()};
-  DVec3 bot = box.bot();
-  DVec3 top = box.top();
-  DVec3 mid_bot = box.bot();
+// Which part of a triple split `prim` goes to.
+int TripleSide(const AaBox& less_box, const AaBox& more_box,
+               const TriplePrim& prim) {
+  AaBox prim_box(prim.bot, prim.top);
+  if (less_box.Contains(prim_box)) {
+    return 0;
+  } else if (more_box.Contains(prim_box)) {
+    return 1;
+  }
+  return 2;
+}
+
+// Builds the tree over `prims[begin, end)`, whose boxes are bounded by `box`.
+// Splitting moves the node's primitives, in order within each part, to the
+// same range of `scratch`, where the children read them with the roles of
+// the two vectors swapped.
+BoundPtr TopDownTripleHelper(const BoundTopDownTripleOptions& opts,
+                             std::vector<TriplePrim>* prims,
+                             std::vector<TriplePrim>* scratch, size_t begin,
+                             size_t end, const SahBin& box, int iteration) {
+  size_t count = end - begin;
+  if (count < (size_t)opts.target_per_box || iteration > opts.max_iterations) {
+    return BoundsLeaf(*prims, begin, end, box);
+  }
+  int split_index = TopDownTriplePickSplitIndex(iteration);
+  double split_point = PickTripleSplitPoint(box, split_index);
+  DVec3 mid_bot = box.bot;
   mid_bot[split_index] = split_point;
-  DVec3 mid_top = box.top();
+  DVec3 mid_top = box.top;
   mid_top[split_index] = split_point;
-  AaBox less_box(bot, mid_top);
+  AaBox less_box(box.bot, mid_top);
   AaBox more_box(mid_bot, mid_top);
-  for (Intersectable* inter : inters) {
-    if (less_box.Contains(*inter)) {
-      vecs[0].push_back(inter);
-    } else if (more_box.Contains(*inter)) {
-      vecs[1].push_back(inter);
-    } else {
-      vecs[2].push_back(inter);
+
+  // Count and bound each chunk's parts, then copy every chunk's primitives
+  // after those of the earlier chunks in the same part.
+  int num_chunks = NumChunks(opts.thread_pool, count);
+  std::vector<std::array<SahBin, 3>> chunk_sides(num_chunks);
+  ForChunks(opts.thread_pool, num_chunks, begin, end,
+            [&](int chunk, size_t chunk_begin, size_t chunk_end) {
+              for (size_t i = chunk_begin; i < chunk_end; i++) {
+                const TriplePrim& prim = (*prims)[i];
+                SahBin& side =
+                    chunk_sides[chunk][TripleSide(less_box, more_box, prim)];
+                side.Grow(prim.bot, prim.top);
+                side.count++;
+              }
+            });
+  std::array<SahBin, 3> sides;
+  std::vector<std::array<size_t, 3>> chunk_offsets(num_chunks);
+  size_t offset = begin;
+  for (int side = 0; side < 3; side++) {
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+      chunk_offsets[chunk][side] = offset;
+      offset += chunk_sides[chunk][side].count;
+      sides[side].Grow(chunk_sides[chunk][side]);
     }
   }
-  return vecs;
-}
+  ForChunks(opts.thread_pool, num_chunks, begin, end,
+            [&](int chunk, size_t chunk_begin, size_t chunk_end) {
+              std::array<size_t, 3>& next = chunk_offsets[chunk];
+              for (size_t i = chunk_begin; i < chunk_end; i++) {
+                const TriplePrim& prim = (*prims)[i];
+                (*scratch)[next[TripleSide(less_box, more_box, prim)]++] =
+                    prim;
+              }
+            });
 
-BoundPtr TopDownTripleHelper(const BoundTopDownTripleOptions& opts,
-                             const std::vector<Intersectable*>& inters,
-                             int iteration) {
-  if (inters.size() < opts.target_per_box) {
-    // std::cerr << "Reached size " << inters.size() << std::endl;
-    return BoundInters(inters);
-  }
-  if (iteration > opts.max_iterations) {
-    // std::cerr << "Too many iterations with size " << inters.size() <<
-    // std::endl;
-    return BoundInters(inters);
-  }
-  int split_index = TopDownTriplePickSplitIndex(inters, iteration);
-  std::vector<std::vector<Intersectable*>> vecs =
-      TripleSplit(inters, split_index);
-  BoundPtr wrapper(new BoundBox());
-  for (const std::vector<Intersectable*>& vec : vecs) {
-    if (!vec.empty()) {
-      wrapper->AddChild(TopDownTripleHelper(opts, vec, iteration + 1));
+  std::vector<int> nonempty;
+  std::array<size_t, 3> side_begins;
+  size_t side_begin = begin;
+  for (int side = 0; side < 3; side++) {
+    side_begins[side] = side_begin;
+    side_begin += sides[side].count;
+    if (sides[side].count > 0) {
+      nonempty.push_back(side);
+    }
+  }
+  std::vector<BoundPtr> children(nonempty.size());
+  auto build = [&](int i) {
+    int side = nonempty[i];
+    children[i] = TopDownTripleHelper(
+        opts, scratch, prims, side_begins[side],
+        side_begins[side] + sides[side].count, sides[side], iteration + 1);
+  };
+  if (opts.thread_pool && count >= kParallelSubtree) {
+    opts.thread_pool->ParallelFor(children.size(), build);
+  } else {
+    for (size_t i = 0; i < children.size(); i++) {
+      build(i);
     }
   }
+
+  BoundPtr wrapper(new BoundBox());
+  for (BoundPtr& child : children) {
+    wrapper->AddChild(std::move(child));
+  }
   if (wrapper->size() == 1 && wrapper->bound_children().size() == 1) {
     return std::move(wrapper->bound_children()[0]);
   }
   return wrapper;
 }
 
+struct SahPrim {
+  Intersectable* inter;
+  DVec3 bot;
+  DVec3 top;
+  DVec3 center;
+};
+
+struct SahSplit {
+  bool valid = false;
+  int axis = 0;
+  int bin = 0;
+  double cost = 1e100;
+};
+
+int SahBinIndex(const SahOptions& opts, const SahBin& center_bounds, int axis,
+                DVec3 center) {
+  double extent = center_bounds.top[axis] - center_bounds.bot[axis];
+  int bin = (int)(opts.num_bins * (center[axis] - center_bounds.bot[axis]) /
+                  extent);
+  return std::max(0, std::min(bin, opts.num_bins - 1));
+}
+
+// Bounds the boxes and the centers of `prims[begin, end)`.
+void SahBounds(const SahOptions& opts, const std::vector<SahPrim>& prims,
+               size_t begin, size_t end, SahBin* node_bounds,
+               SahBin* center_bounds) {
+  int num_chunks = NumChunks(opts.thread_pool, end - begin);
+  std::vector<std::array<SahBin, 2>> chunk_bounds(num_chunks);
+  ForChunks(opts.thread_pool, num_chunks, begin, end,
+            [&](int chunk, size_t chunk_begin, size_t chunk_end) {
+              std::array<SahBin, 2>& bounds = chunk_bounds[chunk];
+              for (size_t i = chunk_begin; i < chunk_end; i++) {
+                bounds[0].Grow(prims[i].bot, prims[i].top);
+                bounds[1].Grow(prims[i].center, prims[i].center);
+              }
+            });
+  for (const std::array<SahBin, 2>& bounds : chunk_bounds) {
+    node_bounds->Grow(bounds[0]);
+    center_bounds->Grow(bounds[1]);
+  }
+  node_bounds->count = end - begin;
+  center_bounds->count = end - begin;
+}
+
+SahSplit PickSahSplit(const SahOptions& opts, const std::vector<SahPrim>& prims,
+                      size_t begin, size_t end, const SahBin& node_bounds,
+                      const SahBin& center_bounds) {
+  SahSplit best;
+  double parent_area = node_bounds.SurfaceArea();
+  if (parent_area <= 0) {
+    return best;
+  }
+  bool split_axis[3];
+  for (int axis = 0; axis < 3; axis++) {
+    split_axis[axis] = center_bounds.top[axis] - center_bounds.bot[axis] > 0;
+  }
+  // Every axis is binned in one pass over the primitives, in chunks whose
+  // bins are merged afterwards.
+  int num_bins = opts.num_bins;
+  int num_chunks = NumChunks(opts.thread_pool, end - begin);
+  std::vector<SahBin> chunk_bins(num_chunks * 3 * num_bins);
+  ForChunks(opts.thread_pool, num_chunks, begin, end,
+            [&](int chunk, size_t chunk_begin, size_t chunk_end) {
+              SahBin* bins = &chunk_bins[chunk * 3 * num_bins];
+              for (size_t i = chunk_begin; i < chunk_end; i++) {
+                for (int axis = 0; axis < 3; axis++) {
+                  if (!split_axis[axis]) {
+                    continue;
+                  }
+                  SahBin& bin = bins[axis * num_bins +
+                                     SahBinIndex(opts, center_bounds, axis,
+                                                 prims[i].center)];
+                  bin.Grow(prims[i].bot, prims[i].top);
+                  bin.count++;
+                }
+              }
+            });
+
+  std::vector<SahBin> bins(num_bins);
+  std::vector<double> right_costs(num_bins);
+  for (int axis = 0; axis < 3; axis++) {
+    if (!split_axis[axis]) {
+      continue;
+    }
+    for (int i = 0; i < num_bins; i++) {
+      bins[i] = SahBin();
+      for (int chunk = 0; chunk < num_chunks; chunk++) {
+        bins[i].Grow(chunk_bins[(chunk * 3 + axis) * num_bins + i]);
+      }
+    }
+    // right_costs[i] holds the area-weighted count of bins [i, num_bins).
+    SahBin right;
+    for (int i = num_bins - 1; i > 0; i--) {
+      right.Grow(bins[i]);
+      right_costs[i] = right.SurfaceArea() * right.count;
+    }
+    SahBin left;
+    for (int i = 1; i < num_bins; i++) {
+      left.Grow(bins[i - 1]);
+      if (left.count == 0 || left.count == (int)(end - begin)) {
+        continue;
+      }
+      double cost = opts.traversal_cost +
+                    opts.intersection_cost *
+                        (left.SurfaceArea() * left.count + right_costs[i]) /
+                        parent_area;
+      if (cost < best.cost) {
+        best.valid = true;
+        best.axis = axis;
+        best.bin = i;
+        best.cost = cost;
+      }
+    }
+  }
+  return best;
+}
+
+BoundPtr SahHelper(const SahOptions& opts, std::vector<SahPrim>* prims,
+                   size_t begin, size_t end, int depth) {
+  size_t count = end - begin;
+  SahBin node_bounds;
+  SahBin center_bounds;
+  SahBounds(opts, *prims, begin, end, &node_bounds, &center_bounds);
+  if (count <= (size_t)opts.min_leaf_size || depth >= opts.max_depth) {
+    return BoundsLeaf(*prims, begin, end, node_bounds);
+  }
+
+  SahSplit split =
+      PickSahSplit(opts, *prims, begin, end, node_bounds, center_bounds);
+  double leaf_cost = count * opts.intersection_cost;
+  if ((!split.valid || split.cost >= leaf_cost) &&
+      count <= (size_t)opts.max_leaf_size) {
+    return BoundsLeaf(*prims, begin, end, node_bounds);
+  }
+
+  size_t mid = begin;
+  if (split.valid) {
+    auto mid_iter = std::partition(
+        prims->begin() + begin, prims->begin() + end,
+        [&](const SahPrim& prim) {
+          return SahBinIndex(opts, center_bounds, split.axis, prim.center) <
+                 split.bin;
+        });
+    mid = mid_iter - prims->begin();
+  }
+  if (mid == begin || mid == end) {
+    // Either every centroid coincides or the heuristic could not separate
+    // them; fall back to a median split along the widest axis.
+    DVec3 extent = node_bounds.top - node_bounds.bot;
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+    mid = begin + count / 2;
+    std::nth_element(prims->begin() + begin, prims->begin() + mid,
+                     prims->begin() + end,
+                     [axis](const SahPrim& a, const SahPrim& b) {
+                       return a.center[axis] < b.center[axis];
+                     });
+  }
+
+  BoundPtr left;
+  BoundPtr right;
+  auto build_left = [&]() {
+    left = SahHelper(opts, prims, begin, mid, depth + 1);
+  };
+  auto build_right = [&]() {
+    right = SahHelper(opts, prims, mid, end, depth + 1);
+  };
+  if (opts.thread_pool && count >= kParallelSubtree) {
+    opts.thread_pool->Run(build_left, build_right);
+  } else {
+    build_left();
+    build_right();
+  }
+  BoundPtr wrapper(new BoundBox());
+  wrapper->AddChild(std::move(left));
+  wrapper->AddChild(std::move(right));
+  return wrapper;
+}
+
+// Sum of the area-weighted costs of `bound` and its descendants.
+double SahCostHelper(const SahOptions& opts, BoundShape* bound) {
+  if (bound->empty()) {
+    return 0.0;
+  }
+  double cost = bound->inter_children().size() * opts.intersection_cost;
+  if (!bound->bound_children().empty()) {
+    cost += opts.traversal_cost;
+  }
+  cost *= bound->SurfaceArea();
+  for (BoundPtr& child : bound->bound_children()) {
+    cost += SahCostHelper(opts, child.get());
+  }
+  return cost;
+}
+
+std::vector<Intersectable*> GetPointers(const std::vector<InterPtr>* inters) {
+  std::vector<Intersectable*> ptrs;
+  ptrs.reserve(inters->size());
+  for (const InterPtr& inter : *inters) {
+    ptrs.push_back(inter.get());
+  }
+  return ptrs;
+}
+
 }  // namespace
 
 BoundPtr ConstructBoundsNoAcceleration(const std::vector<InterPtr>* inters) {
+  return ConstructBoundsNoAcceleration(GetPointers(inters));
+}
+
+BoundPtr ConstructBoundsNoAcceleration(
+    const std::vector<Intersectable*>& inters) {
   BoundPtr outer_bound(new BoundBox());
-  for (const InterPtr& inter : *inters) {
-    outer_bound->AddChild(inter.get());
+  for (Intersectable* inter : inters) {
+    outer_bound->AddChild(inter);
   }
   return outer_bound;
 }
 
 BoundPtr ConstructBoundsTopDownTriple(const BoundTopDownTripleOptions& opts,
                                       const std::vector<InterPtr>* inters) {
-  std::vector<Intersectable*> ptrs;
-  for (const InterPtr& inter : *inters) {
-    ptrs.push_back(inter.get());
+  return ConstructBoundsTopDownTriple(opts, GetPointers(inters));
+}
+
+BoundPtr ConstructBoundsTopDownTriple(
+    const BoundTopDownTripleOptions& opts,
+    const std::vector<Intersectable*>& inters) {
+  TRACE_ZONE("top down triple build");
+  std::vector<TriplePrim> prims(inters.size());
+  std::vector<TriplePrim> scratch(inters.size());
+  int num_chunks = NumChunks(opts.thread_pool, inters.size());
+  std::vector<SahBin> chunk_boxes(num_chunks);
+  ForChunks(opts.thread_pool, num_chunks, 0, inters.size(),
+            [&](int chunk, size_t chunk_begin, size_t chunk_end) {
+              for (size_t i = chunk_begin; i < chunk_end; i++) {
+                AaBox box = inters[i]->GetAaBox();
+                prims[i] = {inters[i], box.bot(), box.top()};
+                chunk_boxes[chunk].Grow(box.bot(), box.top());
+              }
+            });
+  SahBin box;
+  for (const SahBin& chunk_box : chunk_boxes) {
+    box.Grow(chunk_box);
+  }
+  return TopDownTripleHelper(opts, &prims, &scratch, 0, prims.size(), box, 0);
+}
+
+BoundPtr ConstructBoundsSah(const SahOptions& opts,
+                            const std::vector<InterPtr>* inters) {
+  return ConstructBoundsSah(opts, GetPointers(inters));
+}
+
+BoundPtr ConstructBoundsSah(const SahOptions& opts,
+                            const std::vector<Intersectable*>& inters) {
+  TRACE_ZONE("sah build");
+  std::vector<SahPrim> prims(inters.size());
+  ForChunks(opts.thread_pool, NumChunks(opts.thread_pool, inters.size()), 0,
+            inters.size(),
+            [&](int /*chunk*/, size_t chunk_begin, size_t chunk_end) {
+              for (size_t i = chunk_begin; i < chunk_end; i++) {
+                AaBox box = inters[i]->GetAaBox();
+                prims[i] = {inters[i], box.bot(), box.top(),
+                            inters[i]->EstimateCenter()};
+              }
+            });
+  return SahHelper(opts, &prims, 0, prims.size(), 0);
+}
+
+double SahCost(const SahOptions& opts, BoundShape* root) {
+  if (root->empty()) {
+    return 0.0;
+  }
+  double root_area = root->SurfaceArea();
+  if (root_area <= 0) {
+    return 0.0;
   }
-  return TopDownTripleHelper(opts, ptrs, 0);
+  return SahCostHelper(opts, root) / root_area;
 }
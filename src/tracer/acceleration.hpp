@@ -2,15 +2,53 @@
 #define ACCELERATION_HPP
 
 #include "tracer/bound.hpp"
+#include "tracer/thread_pool.hpp"
 
 struct BoundTopDownTripleOptions {
   int target_per_box = 5;
   int max_iterations = 20;
+  // If set, large nodes are split and their subtrees built on this pool. The
+  // tree is the same either way.
+  ThreadPool* thread_pool = nullptr;
 };
 
+// Options for the binned surface area heuristic builder. Costs are relative,
+// so only the ratio of `traversal_cost` to `intersection_cost` matters.
+struct SahOptions {
+  int num_bins = 16;
+  // Nodes with this many primitives or fewer always become leaves.
+  int min_leaf_size = 2;
+  // Nodes with more primitives than this are always split, even when the
+  // heuristic prefers a leaf.
+  int max_leaf_size = 8;
+  int max_depth = 64;
+  double traversal_cost = 1.0;
+  double intersection_cost = 1.0;
+  // If set, large nodes are binned and their subtrees built on this pool. The
+  // tree is the same either way.
+  ThreadPool* thread_pool = nullptr;
+};
+
+// Each builder also accepts non-owning pointers, e.g. the triangles of a
+// `SceneGeometry`.
 BoundPtr ConstructBoundsNoAcceleration(const std::vector<InterPtr>* inters);
+BoundPtr ConstructBoundsNoAcceleration(
+    const std::vector<Intersectable*>& inters);
 
 BoundPtr ConstructBoundsTopDownTriple(const BoundTopDownTripleOptions& opts,
                                       const std::vector<InterPtr>* inters);
+BoundPtr ConstructBoundsTopDownTriple(
+    const BoundTopDownTripleOptions& opts,
+    const std::vector<Intersectable*>& inters);
+
+BoundPtr ConstructBoundsSah(const SahOptions& opts,
+                            const std::vector<InterPtr>* inters);
+BoundPtr ConstructBoundsSah(const SahOptions& opts,
+                            const std::vector<Intersectable*>& inters);
+
+// Expected cost under the surface area heuristic of tracing a ray that hits
+// `root`'s box, using the costs in `opts`. Comparing it before and after a
+// `BoundShape::Refit` shows how much the refit degraded the tree.
+double SahCost(const SahOptions& opts, BoundShape* root);
 
 #endif
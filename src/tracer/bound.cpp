@@ -1,44 +1,107 @@
 #include "tracer/bound.hpp"
 
 #include <iostream>
-#include <set>
+
+namespace {
+
+// Pending subtrees; the traversal recurses for anything that does not fit.
+constexpr int kStackSize = 64;
+// Bound children ordered per node; extra children are handled by recursion.
+constexpr int kMaxOrderedChildren = 16;
+// Nodes entered this far past the closest hit are still visited, which keeps
+// hits on primitives that touch their box's faces.
+constexpr double kPruneSlack = 1e-5;
+
+struct PendingBound {
+  double dist;
+  BoundShape* bound;
+};
+
+}  // namespace
 
 std::optional<ShadeablePoint> BoundShape::Intersect(const Ray& ray) {
-  std::set<std::pair<double, Intersectable*> > ordered_children;
-  for (Intersectable* child : inter_children_) {
-    std::optional<DVec3> inter = child->EarliestIntersect(ray);
-    if (inter.has_value()) {
-      ordered_children.insert({glm::distance(*inter, ray.origin), child});
+  double closest = 1e100;
+  std::optional<ShadeablePoint> closest_inter;
+  auto consider = [&](std::optional<ShadeablePoint> inter) {
+    if (inter.has_value() && inter->t < closest) {
+      closest = inter->t;
+      closest_inter = inter;
     }
-  }
-  for (BoundPtr& child : bound_children_) {
-    if (child->GetAaBox().Contains(ray.origin)) {
-      ordered_children.insert({0.0, child.get()});
+  };
+
+  PendingBound stack[kStackSize];
+  int stack_size = 0;
+  stack[stack_size++] = {0.0, this};
+  while (stack_size > 0) {
+    PendingBound pending = stack[--stack_size];
+    if (pending.dist - kPruneSlack > closest) {
       continue;
     }
-    std::optional<DVec3> inter = child->EarliestIntersect(ray);
-    if (inter.has_value()) {
-      ordered_children.insert({glm::distance(*inter, ray.origin), child.get()});
+    BoundShape* bound = pending.bound;
+    for (Intersectable* child : bound->inter_children_) {
+      consider(child->Intersect(ray));
     }
-  }
-  double closest = 1e100;
-  std::optional<ShadeablePoint> closest_inter;
-  for (const auto& child : ordered_children) {
-    if (closest_inter.has_value() && child.first - 1e-5 > closest) {
-      return closest_inter;
+
+    // Sort the children that are hit by entry distance, nearest last, so that
+    // they can be pushed in order and the nearest one is popped first.
+    PendingBound ordered[kMaxOrderedChildren];
+    int num_ordered = 0;
+    for (BoundPtr& child : bound->bound_children_) {
+      double dist;
+      if (!child->GetAaBox().EntryDistance(ray, closest + kPruneSlack,
+                                           &dist)) {
+        continue;
+      }
+      if (num_ordered == kMaxOrderedChildren) {
+        consider(child->Intersect(ray));
+        continue;
+      }
+      int i = num_ordered++;
+      for (; i > 0 && ordered[i - 1].dist < dist; i--) {
+        ordered[i] = ordered[i - 1];
+      }
+      ordered[i] = {dist, child.get()};
     }
-    std::optional<ShadeablePoint> inter = child.second->Intersect(ray);
-    if (inter.has_value()) {
-      double curr = glm::distance(inter->point, ray.origin);
-      if (curr < closest) {
-        closest = curr;
-        closest_inter = inter;
+    for (int i = 0; i < num_ordered; i++) {
+      if (stack_size == kStackSize) {
+        consider(ordered[i].bound->Intersect(ray));
+      } else {
+        stack[stack_size++] = ordered[i];
       }
     }
   }
   return closest_inter;
 }
 
+bool BoundShape::Occluded(const Ray& ray, double t_max) {
+  // Any hit will do, so children are visited in whatever order they come.
+  BoundShape* stack[kStackSize];
+  int stack_size = 0;
+  stack[stack_size++] = this;
+  while (stack_size > 0) {
+    BoundShape* bound = stack[--stack_size];
+    for (Intersectable* child : bound->inter_children_) {
+      if (child->Occluded(ray, t_max)) {
+        return true;
+      }
+    }
+    for (BoundPtr& child : bound->bound_children_) {
+      double dist;
+      if (!child->GetAaBox().EntryDistance(ray, t_max, &dist)) {
+        continue;
+      }
+      if (stack_size == kStackSize) {
+        if (child->Occluded(ray, t_max)) {
+          return true;
+        }
+      } else {
+        stack[stack_size++] = child.get();
+      }
+    }
+  }
+  return false;
+}
+
 size_t BoundShape::RecursiveShadeableSize() const {
   size_t size = 0;
   for (const Intersectable* inter : inter_children_) {
@@ -52,6 +115,12 @@ size_t BoundShape::RecursiveShadeableSize() const {
   return size;
 }
 
+void BoundShape::Refit() {
+  for (BoundPtr& child : bound_children_) {
+    child->Refit();
+  }
+}
+
 void BoundShape::RecursiveAssertSanity() const {
   AaBox my_box = GetAaBox();
   for (const auto& child : inter_children_) {
@@ -103,3 +172,14 @@ AaBox BoundBox::GetAaBox() const { return box_; }
 DVec3 BoundBox::EstimateCenter() const { return box_.EstimateCenter(); }
 
 double BoundBox::SurfaceArea() const { return box_.SurfaceArea(); }
+
+void BoundBox::Refit() {
+  BoundShape::Refit();
+  box_ = AaBox();
+  for (Intersectable* child : inter_children_) {
+    box_.Update(child->GetAaBox());
+  }
+  for (BoundPtr& child : bound_children_) {
+    box_.Update(child->GetAaBox());
+  }
+}
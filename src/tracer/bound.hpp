@@ -12,6 +12,7 @@ using BoundPtr = std::unique_ptr<BoundShape>;
 class BoundShape : public Intersectable {
  public:
   std::optional<ShadeablePoint> Intersect(const Ray& ray) override;
+  bool Occluded(const Ray& ray, double t_max) override;
   virtual void AddChild(Intersectable* child) {
     inter_children_.push_back(child);
   }
@@ -29,6 +30,10 @@ class BoundShape : public Intersectable {
   }
   virtual std::vector<BoundPtr>& bound_children() { return bound_children_; }
   virtual size_t RecursiveShadeableSize() const;
+  // Recomputes the bounds of this node and every bound descendant, bottom
+  // up, from the current boxes of their children, e.g. after the primitives
+  // moved. Bounds in `inter_children()` are not refit.
+  virtual void Refit();
   virtual void RecursiveAssertSanity() const;
 
  protected:
@@ -47,6 +52,7 @@ class BoundBox : public BoundShape {
   DVec3 EstimateCenter() const override;
   bool IsShadeable() const override { return false; }
   double SurfaceArea() const override;
+  void Refit() override;
 
  protected:
   AaBox box_;
@@ -0,0 +1,100 @@
+#include "tracer/dynamic_bvh.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+// Each object gets a leaf of its own in the top tree, so its box is tested
+// before any of its triangles.
+SahOptions GetTopOptions(SahOptions opts) {
+  opts.min_leaf_size = 1;
+  opts.max_leaf_size = 1;
+  return opts;
+}
+
+}  // namespace
+
+DynamicBvh::DynamicBvh(Options options, SceneGeometry* geometry,
+                       ThreadPool* thread_pool)
+    : options_(std::move(options)),
+      geometry_(geometry),
+      thread_pool_(thread_pool),
+      objects_(geometry->num_objects()) {
+  auto build = [&](int i) { BuildObject(&objects_[i], i); };
+  if (thread_pool_) {
+    thread_pool_->ParallelFor(objects_.size(), build);
+  } else {
+    for (size_t i = 0; i < objects_.size(); i++) {
+      build(i);
+    }
+  }
+  BuildTop();
+}
+
+void DynamicBvh::Update() {
+  // Objects are refit and, if needed, rebuilt independently of each other.
+  std::vector<char> rebuilt(objects_.size(), 0);
+  auto update = [&](int i) {
+    Object& object = objects_[i];
+    if (!object.root) {
+      return;
+    }
+    object.root->Refit();
+    double cost = SahCost(options_.sah, object.root.get());
+    if (cost > options_.rebuild_ratio * object.build_cost) {
+      BuildObject(&object, i);
+      rebuilt[i] = 1;
+    }
+  };
+  if (thread_pool_) {
+    thread_pool_->ParallelFor(objects_.size(), update);
+  } else {
+    for (size_t i = 0; i < objects_.size(); i++) {
+      update(i);
+    }
+  }
+  int rebuilds = std::count(rebuilt.begin(), rebuilt.end(), 1);
+  num_rebuilds_ += rebuilds;
+
+  // A rebuilt object has a new root, which the top tree must point to.
+  if (rebuilds > 0) {
+    BuildTop();
+    return;
+  }
+  top_->Refit();
+  if (SahCost(GetTopOptions(options_.sah), top_.get()) >
+      options_.rebuild_ratio * top_build_cost_) {
+    BuildTop();
+  }
+}
+
+std::optional<ShadeablePoint> DynamicBvh::Intersect(const Ray& ray) {
+  return top_->Intersect(ray);
+}
+
+bool DynamicBvh::Occluded(const Ray& ray, double t_max) {
+  return top_->Occluded(ray, t_max);
+}
+
+void DynamicBvh::BuildObject(Object* object, size_t index) {
+  std::vector<Intersectable*> tris = geometry_->GetObjectIntersectables(index);
+  if (tris.empty()) {
+    object->root.reset();
+    return;
+  }
+  object->root = ConstructBoundsSah(options_.sah, tris);
+  object->build_cost = SahCost(options_.sah, object->root.get());
+}
+
+void DynamicBvh::BuildTop() {
+  std::vector<Intersectable*> roots;
+  for (Object& object : objects_) {
+    if (object.root) {
+      roots.push_back(object.root.get());
+    }
+  }
+  SahOptions top_options = GetTopOptions(options_.sah);
+  top_ = ConstructBoundsSah(top_options, roots);
+  top_build_cost_ = SahCost(top_options, top_.get());
+}
@@ -0,0 +1,64 @@
+#ifndef TRACER_DYNAMIC_BVH_HPP
+#define TRACER_DYNAMIC_BVH_HPP
+
+#include <optional>
+#include <vector>
+
+#include "tracer/acceleration.hpp"
+#include "tracer/bound.hpp"
+#include "tracer/intersectable.hpp"
+#include "tracer/scene_geometry.hpp"
+#include "tracer/thread_pool.hpp"
+
+// A two level BVH over a `SceneGeometry` whose instances move between frames,
+// such as a flock of boids. Every object of the geometry (see
+// `SceneGeometry::BeginObject`) gets its own SAH subtree, and a small top
+// tree holds the objects. After the geometry's transforms change, `Update`
+// refits every subtree bottom up and only rebuilds the ones whose SAH cost
+// grew past `Options::rebuild_ratio` times their cost when built.
+class DynamicBvh {
+ public:
+  struct Options {
+    SahOptions sah;
+    // A tree is rebuilt once a refit leaves its `SahCost` this many times
+    // its cost right after it was built.
+    double rebuild_ratio = 1.5;
+  };
+
+  // `geometry` must outlive this. `thread_pool` may be null, in which case
+  // everything runs on the calling thread.
+  DynamicBvh(Options options, SceneGeometry* geometry,
+             ThreadPool* thread_pool);
+
+  // Brings the tree up to date with the geometry's current transforms.
+  void Update();
+
+  std::optional<ShadeablePoint> Intersect(const Ray& ray);
+  // See `Intersectable::Occluded`.
+  bool Occluded(const Ray& ray, double t_max);
+
+  // The top tree, whose leaves hold the roots of the object subtrees.
+  BoundShape* top() const { return top_.get(); }
+  // Object subtrees rebuilt by past calls to `Update`.
+  int num_rebuilds() const { return num_rebuilds_; }
+
+ private:
+  struct Object {
+    BoundPtr root;
+    double build_cost = 0.0;
+  };
+
+  void BuildObject(Object* object, size_t index);
+  void BuildTop();
+
+  Options options_;
+  SceneGeometry* geometry_;
+  ThreadPool* thread_pool_;
+  // Indexed by object; empty objects have no root.
+  std::vector<Object> objects_;
+  BoundPtr top_;
+  double top_build_cost_ = 0.0;
+  int num_rebuilds_ = 0;
+};
+
+#endif
@@ -0,0 +1,259 @@
+#include "tracer/float_triangle_soa.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+constexpr double kInfinity = std::numeric_limits<double>::infinity();
+
+// Bound on the relative error of `n` rounded float operations.
+constexpr float Gamma(int n) {
+  constexpr float kUnitRoundoff = std::numeric_limits<float>::epsilon() / 2;
+  return (n * kUnitRoundoff) / (1 - n * kUnitRoundoff);
+}
+
+// Rounding the origin moves a surface through it along the ray by up to the
+// rounding error over the cosine of the angle to the surface normal. Hits are
+// refined in double within this many times the rounding error, which covers
+// surfaces up to about 84 degrees from the ray.
+constexpr double kSlackScale = 16.0;
+
+// Whether the edge functions put the ray inside the triangle, from either
+// side. NaNs from padding slots are outside.
+bool EdgesAgree(const float* e) {
+  return (e[0] >= 0 && e[1] >= 0 && e[2] >= 0) ||
+         (e[0] <= 0 && e[1] <= 0 && e[2] <= 0);
+}
+
+}  // namespace
+
+FloatTriangleSoa::BlockRay FloatTriangleSoa::GetBlockRay(DVec3 origin,
+                                                         DVec3 dir) {
+  BlockRay ray;
+  ray.origin = origin;
+  ray.dir = dir;
+  DVec3 abs_dir = glm::abs(dir);
+  if (abs_dir.x > abs_dir.y) {
+    ray.kz = abs_dir.x > abs_dir.z ? 0 : 2;
+  } else {
+    ray.kz = abs_dir.y > abs_dir.z ? 1 : 2;
+  }
+  ray.kx = (ray.kz + 1) % 3;
+  ray.ky = (ray.kx + 1) % 3;
+  if (dir[ray.kz] < 0) {
+    std::swap(ray.kx, ray.ky);
+  }
+  ray.shear_x = dir[ray.kx] / dir[ray.kz];
+  ray.shear_y = dir[ray.ky] / dir[ray.kz];
+  ray.shear_z = 1.0 / dir[ray.kz];
+  double rounding = 0.0;
+  for (int i = 0; i < 3; i++) {
+    ray.origin_f[i] = (float)origin[i];
+    rounding = std::max(rounding, std::abs(origin[i] - ray.origin_f[i]));
+  }
+  ray.t_slack = kSlackScale * rounding;
+  return ray;
+}
+
+size_t FloatTriangleSoa::Add(const std::array<DVec3, 3>& verts) {
+  size_t index = size_++;
+  if (index % kWidth == 0) {
+    blocks_.emplace_back();
+  }
+  Block& block = blocks_.back();
+  int lane = index % kWidth;
+  for (int vert = 0; vert < 3; vert++) {
+    for (int axis = 0; axis < 3; axis++) {
+      block.verts[vert][axis][lane] = (float)verts[vert][axis];
+    }
+  }
+  return index;
+}
+
+size_t FloatTriangleSoa::AddPadding() {
+  // NaN vertices fail every comparison, so the test never gets far with
+  // them.
+  DVec3 nan(std::numeric_limits<double>::quiet_NaN());
+  return Add({nan, nan, nan});
+}
+
+void FloatTriangleSoa::FinishLane(const BlockRay& ray, const Block& block,
+                                  int lane, const float* x, const float* y,
+                                  const float* z, const float* e,
+                                  double max_t, double* t, double* u,
+                                  double* v) const {
+  float det = e[0] + e[1] + e[2];
+  if (det == 0) {
+    return;
+  }
+  float inv_det = 1.0f / det;
+  float t_f = (e[0] * z[0] + e[1] * z[1] + e[2] * z[2]) * inv_det;
+
+  // The rounding error bound of `t_f` from Pharr, Jakob and Humphreys,
+  // "Physically Based Rendering", 3rd edition, section 3.9.6.
+  float max_x = std::max({std::abs(x[0]), std::abs(x[1]), std::abs(x[2])});
+  float max_y = std::max({std::abs(y[0]), std::abs(y[1]), std::abs(y[2])});
+  float max_z = std::max({std::abs(z[0]), std::abs(z[1]), std::abs(z[2])});
+  float max_e = std::max({std::abs(e[0]), std::abs(e[1]), std::abs(e[2])});
+  float delta_x = Gamma(5) * (max_x + max_z);
+  float delta_y = Gamma(5) * (max_y + max_z);
+  float delta_z = Gamma(3) * max_z;
+  float delta_e =
+      2 * (Gamma(2) * max_x * max_y + delta_y * max_x + delta_x * max_y);
+  float delta_t = 3 *
+                      (Gamma(3) * max_e * max_z + delta_e * max_z +
+                       delta_z * max_e) *
+                      std::abs(inv_det) +
+                  ray.t_slack;
+  if (!(t_f > -delta_t && t_f - delta_t < max_t)) {
+    return;
+  }
+
+  // The ray may hit the triangle in (0, max_t). Intersect its plane in double
+  // to decide.
+  DVec3 verts[3];
+  for (int vert = 0; vert < 3; vert++) {
+    verts[vert] = DVec3(block.verts[vert][0][lane], block.verts[vert][1][lane],
+                        block.verts[vert][2][lane]);
+  }
+  DVec3 normal = glm::cross(verts[1] - verts[0], verts[2] - verts[0]);
+  double dist = glm::dot(verts[0] - ray.origin, normal) /
+                glm::dot(ray.dir, normal);
+  if (dist > epsilon(ray.origin) && dist < max_t) {
+    t[lane] = dist;
+    u[lane] = e[1] * inv_det;
+    v[lane] = e[2] * inv_det;
+  }
+}
+
+void FloatTriangleSoa::IntersectBlockScalar(const BlockRay& ray, size_t first,
+                                            double max_t, double* t,
+                                            double* u, double* v) const {
+  const Block& block = blocks_[first / kWidth];
+  for (int lane = 0; lane < kWidth; lane++) {
+    t[lane] = kInfinity;
+    u[lane] = 0.0;
+    v[lane] = 0.0;
+    float x[3];
+    float y[3];
+    float z[3];
+    for (int vert = 0; vert < 3; vert++) {
+      float ax = block.verts[vert][ray.kx][lane] - ray.origin_f[ray.kx];
+      float ay = block.verts[vert][ray.ky][lane] - ray.origin_f[ray.ky];
+      float az = block.verts[vert][ray.kz][lane] - ray.origin_f[ray.kz];
+      x[vert] = ax - ray.shear_x * az;
+      y[vert] = ay - ray.shear_y * az;
+      z[vert] = ray.shear_z * az;
+    }
+    float e[3] = {
+        x[2] * y[1] - y[2] * x[1],
+        x[0] * y[2] - y[0] * x[2],
+        x[1] * y[0] - y[1] * x[0],
+    };
+    if (e[0] == 0 || e[1] == 0 || e[2] == 0) {
+      // Too close to call in float. Products of floats are exact in double.
+      e[0] = (float)((double)x[2] * y[1] - (double)y[2] * x[1]);
+      e[1] = (float)((double)x[0] * y[2] - (double)y[0] * x[2]);
+      e[2] = (float)((double)x[1] * y[0] - (double)y[1] * x[0]);
+    }
+    if (EdgesAgree(e)) {
+      FinishLane(ray, block, lane, x, y, z, e, max_t, t, u, v);
+    }
+  }
+}
+
+#if defined(__SSE2__)
+
+// Does the same float arithmetic as `IntersectBlockScalar` for all lanes at
+// once, up to the edge test, and leaves blocks with an edge function of zero
+// to it.
+void FloatTriangleSoa::IntersectBlock(const BlockRay& ray, size_t first,
+                                      double max_t, double* t, double* u,
+                                      double* v) const {
+  const Block& block = blocks_[first / kWidth];
+  __m128 ox = _mm_set1_ps(ray.origin_f[ray.kx]);
+  __m128 oy = _mm_set1_ps(ray.origin_f[ray.ky]);
+  __m128 oz = _mm_set1_ps(ray.origin_f[ray.kz]);
+  __m128 sx = _mm_set1_ps(ray.shear_x);
+  __m128 sy = _mm_set1_ps(ray.shear_y);
+  __m128 sz = _mm_set1_ps(ray.shear_z);
+  __m128 x[3];
+  __m128 y[3];
+  __m128 z[3];
+  for (int vert = 0; vert < 3; vert++) {
+    __m128 az = _mm_sub_ps(_mm_load_ps(block.verts[vert][ray.kz]), oz);
+    x[vert] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.verts[vert][ray.kx]), ox),
+                         _mm_mul_ps(sx, az));
+    y[vert] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.verts[vert][ray.ky]), oy),
+                         _mm_mul_ps(sy, az));
+    z[vert] = _mm_mul_ps(sz, az);
+  }
+  __m128 e[3] = {
+      _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1])),
+      _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2])),
+      _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0])),
+  };
+  __m128 zero = _mm_setzero_ps();
+  __m128 on_edge = _mm_or_ps(
+      _mm_or_ps(_mm_cmpeq_ps(e[0], zero), _mm_cmpeq_ps(e[1], zero)),
+      _mm_cmpeq_ps(e[2], zero));
+  if (_mm_movemask_ps(on_edge) != 0) {
+    IntersectBlockScalar(ray, first, max_t, t, u, v);
+    return;
+  }
+  __m128 positive = _mm_and_ps(
+      _mm_and_ps(_mm_cmpgt_ps(e[0], zero), _mm_cmpgt_ps(e[1], zero)),
+      _mm_cmpgt_ps(e[2], zero));
+  __m128 negative = _mm_and_ps(
+      _mm_and_ps(_mm_cmplt_ps(e[0], zero), _mm_cmplt_ps(e[1], zero)),
+      _mm_cmplt_ps(e[2], zero));
+  int inside = _mm_movemask_ps(_mm_or_ps(positive, negative));
+  for (int lane = 0; lane < kWidth; lane++) {
+    t[lane] = kInfinity;
+    u[lane] = 0.0;
+    v[lane] = 0.0;
+  }
+  if (inside == 0) {
+    return;
+  }
+
+  // Few lanes get this far, so the rest is done one lane at a time.
+  alignas(16) float xs[3][kWidth];
+  alignas(16) float ys[3][kWidth];
+  alignas(16) float zs[3][kWidth];
+  alignas(16) float es[3][kWidth];
+  for (int i = 0; i < 3; i++) {
+    _mm_store_ps(xs[i], x[i]);
+    _mm_store_ps(ys[i], y[i]);
+    _mm_store_ps(zs[i], z[i]);
+    _mm_store_ps(es[i], e[i]);
+  }
+  for (int lane = 0; lane < kWidth; lane++) {
+    if (!(inside & (1 << lane))) {
+      continue;
+    }
+    float lane_x[3] = {xs[0][lane], xs[1][lane], xs[2][lane]};
+    float lane_y[3] = {ys[0][lane], ys[1][lane], ys[2][lane]};
+    float lane_z[3] = {zs[0][lane], zs[1][lane], zs[2][lane]};
+    float lane_e[3] = {es[0][lane], es[1][lane], es[2][lane]};
+    FinishLane(ray, block, lane, lane_x, lane_y, lane_z, lane_e, max_t, t, u,
+               v);
+  }
+}
+
+#else
+
+void FloatTriangleSoa::IntersectBlock(const BlockRay& ray, size_t first,
+                                      double max_t, double* t, double* u,
+                                      double* v) const {
+  IntersectBlockScalar(ray, first, max_t, t, u, v);
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef TRACER_FLOAT_TRIANGLE_SOA_HPP
+#define TRACER_FLOAT_TRIANGLE_SOA_HPP
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "learnopengl/glitter.hpp"
+#include "tracer/triangle_soa.hpp"
+
+// Single precision copies of triangles for the watertight test of Woop, Benthin
+// and Wald (JCGT 2013), in blocks of `kWidth` laid out like `TriangleSoa`'s.
+// Each block holds half the bytes of a `TriangleSoa` block. Rays are
+// translated to the origin and sheared onto +z, and the edge functions are
+// evaluated in float, falling back to double where one is exactly zero, so a
+// ray through a shared edge or vertex always hits one of the triangles.
+//
+// The float test only picks candidates. Its distance carries a rounding error
+// bound, as in PBRT, and any triangle that may be hit closer than the limit is
+// intersected again in double precision, so reported distances are as
+// accurate as `TriangleSoa`'s and the usual `epsilon` origin offsets still
+// apply.
+class FloatTriangleSoa {
+ public:
+  static constexpr int kWidth = TriangleSoa::kWidth;
+
+  // A ray prepared once for any number of blocks.
+  struct BlockRay {
+    // The ray in double precision, for refining hits. `dir` is normalized.
+    DVec3 origin;
+    DVec3 dir;
+    // `kz` is the axis along which `dir` is longest. `kx` and `ky` are the
+    // other two, swapped if needed to keep the winding order.
+    int kx;
+    int ky;
+    int kz;
+    float origin_f[3];
+    // Maps `dir` onto +z.
+    float shear_x;
+    float shear_y;
+    float shear_z;
+    // Bounds how far rounding the origin to float moves a hit along the ray.
+    float t_slack;
+  };
+  // `dir` must be normalized.
+  static BlockRay GetBlockRay(DVec3 origin, DVec3 dir);
+
+  // Appends a triangle, rounding its vertices to float, and returns its slot
+  // index.
+  size_t Add(const std::array<DVec3, 3>& verts);
+  // Appends a slot that is never hit.
+  size_t AddPadding();
+
+  // Sets `t[i]` to the distance along the ray to triangle `first + i`, or
+  // infinity if it is missed or no closer than `max_t`, for every `i` in
+  // [0, kWidth). `u` and `v` are as for `TriangleSoa::IntersectBlock`.
+  // `first` must be a multiple of `kWidth`.
+  void IntersectBlock(const BlockRay& ray, size_t first, double max_t,
+                      double* t, double* u, double* v) const;
+  // Portable version of `IntersectBlock`, also used for blocks where an edge
+  // function is zero.
+  void IntersectBlockScalar(const BlockRay& ray, size_t first, double max_t,
+                            double* t, double* u, double* v) const;
+
+  size_t size() const { return size_; }
+  // Bytes held by this object's buffers.
+  size_t MemoryUsage() const { return blocks_.capacity() * sizeof(Block); }
+
+ private:
+  struct alignas(16) Block {
+    // Indexed by vertex, axis and lane.
+    float verts[3][3][kWidth];
+  };
+
+  // Finishes lane `lane` of a block, given the sheared coordinates `x`, `y`
+  // and `z` of its vertices and its edge functions `e`, which must not have
+  // opposite signs.
+  void FinishLane(const BlockRay& ray, const Block& block, int lane,
+                  const float* x, const float* y, const float* z,
+                  const float* e, double max_t, double* t, double* u,
+                  double* v) const;
+
+  std::vector<Block> blocks_;
+  size_t size_ = 0;
+};
+
+#endif
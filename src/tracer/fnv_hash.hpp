@@ -0,0 +1,18 @@
+#ifndef TRACER_FNV_HASH_HPP
+#define TRACER_FNV_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// FNV-1a. Hashes start at `kHashOffset` and fold in bytes with `HashBytes`.
+constexpr uint64_t kHashOffset = 14695981039346656037ull;
+constexpr uint64_t kHashPrime = 1099511628211ull;
+
+inline void HashBytes(const void* data, size_t size, uint64_t* hash) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; i++) {
+    *hash = (*hash ^ bytes[i]) * kHashPrime;
+  }
+}
+
+#endif
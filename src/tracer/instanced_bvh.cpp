@@ -0,0 +1,205 @@
+#include "tracer/instanced_bvh.hpp"
+
+#include <algorithm>
+
+#include "profile/trace.hpp"
+
+InstancedBvh::Instance::Instance(SceneGeometry* geometry, uint32_t index,
+                                 const LinearBvh* blas)
+    : geometry_(geometry),
+      index_(index),
+      blas_(blas),
+      to_world_(geometry->GetTransform(index)),
+      to_local_(glm::inverse(to_world_)) {
+  const LinearBvhNode& root = blas_->nodes()[0];
+  for (int corner = 0; corner < 8; corner++) {
+    DVec3 local(corner & 1 ? root.top[0] : root.bot[0],
+                corner & 2 ? root.top[1] : root.bot[1],
+                corner & 4 ? root.top[2] : root.bot[2]);
+    box_.Update(DVec3(to_world_ * DVec4(local, 1.0)));
+  }
+}
+
+double InstancedBvh::Instance::ToLocal(const Ray& ray, Ray* local) const {
+  DVec3 dir = DMat3(to_local_) * glm::normalize(ray.dir);
+  double scale = glm::length(dir);
+  local->origin = DVec3(to_local_ * DVec4(ray.origin, 1.0));
+  local->dir = dir / scale;
+  return scale;
+}
+
+std::optional<ShadeablePoint> InstancedBvh::Instance::Intersect(
+    const Ray& ray) {
+  Ray local;
+  double scale = ToLocal(ray, &local);
+  std::optional<ShadeablePoint> hit = blas_->Intersect(local);
+  if (!hit.has_value()) {
+    return std::nullopt;
+  }
+  double t = hit->t / scale;
+  return ShadeablePoint({ray.origin + t * glm::normalize(ray.dir), this, ray,
+                         t, hit->u, hit->v, hit->prim_index});
+}
+
+std::optional<DVec3> InstancedBvh::Instance::EarliestIntersect(
+    const Ray& ray) {
+  std::optional<ShadeablePoint> hit = Intersect(ray);
+  if (!hit.has_value()) {
+    return std::nullopt;
+  }
+  return hit->point;
+}
+
+bool InstancedBvh::Instance::Occluded(const Ray& ray, double t_max) {
+  Ray local;
+  double scale = ToLocal(ray, &local);
+  return blas_->Occluded(local, t_max * scale);
+}
+
+void InstancedBvh::Instance::IntersectPacket(
+    const Ray* rays, int count, std::optional<ShadeablePoint>* hits) {
+  constexpr int kChunk = LinearBvh::kMaxPacketSize;
+  Ray local[kChunk];
+  double scale[kChunk];
+  for (int first = 0; first < count; first += kChunk) {
+    int chunk = std::min(kChunk, count - first);
+    for (int i = 0; i < chunk; i++) {
+      scale[i] = ToLocal(rays[first + i], &local[i]);
+    }
+    blas_->IntersectPacket(local, chunk, hits + first);
+    for (int i = 0; i < chunk; i++) {
+      std::optional<ShadeablePoint>& hit = hits[first + i];
+      if (!hit.has_value()) {
+        continue;
+      }
+      const Ray& ray = rays[first + i];
+      double t = hit->t / scale[i];
+      hit = ShadeablePoint({ray.origin + t * glm::normalize(ray.dir), this,
+                            ray, t, hit->u, hit->v, hit->prim_index});
+    }
+  }
+}
+
+void InstancedBvh::Instance::OccludedPacket(const Ray* rays,
+                                            const double* t_max, int count,
+                                            bool* occluded) {
+  constexpr int kChunk = LinearBvh::kMaxPacketSize;
+  Ray local[kChunk];
+  double local_t_max[kChunk];
+  for (int first = 0; first < count; first += kChunk) {
+    int chunk = std::min(kChunk, count - first);
+    for (int i = 0; i < chunk; i++) {
+      local_t_max[i] = t_max[first + i] * ToLocal(rays[first + i], &local[i]);
+    }
+    blas_->OccludedPacket(local, local_t_max, chunk, occluded + first);
+  }
+}
+
+Material* InstancedBvh::Instance::material() const {
+  return geometry_->GetInstanceMaterial(index_);
+}
+
+DVec2 InstancedBvh::Instance::GetUv(const ShadeablePoint& point) {
+  return geometry_->GetMeshUv(point.prim_index, point.u, point.v);
+}
+
+DVec3 InstancedBvh::Instance::GetNormal(const ShadeablePoint& point) {
+  return geometry_->GetInstanceNormal(index_, point.prim_index, point.u,
+                                      point.v);
+}
+
+Model* InstancedBvh::Instance::GetParentModel() {
+  return geometry_->GetInstanceModel(index_);
+}
+
+InstancedBvh::InstancedBvh(const SahOptions& opts, SceneGeometry* geometry,
+                           ThreadPool* thread_pool,
+                           const std::string& cache_path,
+                           bool single_precision)
+    : geometry_(geometry), blases_(geometry->num_meshes()) {
+  TRACE_ZONE("instanced bvh build");
+  uint64_t cache_key = 0;
+  if (!cache_path.empty()) {
+    cache_key = SceneCache::GetKey(opts, *geometry_);
+    cache_ = SceneCache::Open(cache_path, cache_key, blases_.size());
+  }
+  auto build = [&](int mesh) {
+    if (cache_) {
+      blases_[mesh] = cache_->LoadTree(mesh, geometry_);
+      return;
+    }
+    std::vector<Intersectable*> tris = geometry_->GetMeshIntersectables(mesh);
+    if (tris.empty()) {
+      return;
+    }
+    BoundPtr root = ConstructBoundsSah(opts, tris);
+    blases_[mesh].reset(new LinearBvh(root.get()));
+  };
+  if (thread_pool) {
+    thread_pool->ParallelFor(blases_.size(), build);
+  } else {
+    for (size_t i = 0; i < blases_.size(); i++) {
+      build(i);
+    }
+  }
+  if (!cache_path.empty() && !cache_) {
+    SceneCache::Write(cache_path, cache_key, *geometry_, blases_);
+  }
+  if (single_precision) {
+    for (std::unique_ptr<LinearBvh>& blas : blases_) {
+      if (blas) {
+        blas->UseSinglePrecision();
+      }
+    }
+  }
+
+  // The top level points into `instances_`, which must not reallocate.
+  instances_.reserve(geometry_->num_instances());
+  std::vector<Intersectable*> inters;
+  for (uint32_t i = 0; i < geometry_->num_instances(); i++) {
+    const LinearBvh* blas = blases_[geometry_->GetInstanceMesh(i)].get();
+    if (blas) {
+      instances_.emplace_back(geometry_, i, blas);
+      inters.push_back(&instances_.back());
+    }
+  }
+  // `LinearBvh` does not test the boxes of primitives in a leaf, so every
+  // instance gets a leaf, and a box, of its own.
+  SahOptions top_opts = opts;
+  top_opts.min_leaf_size = 1;
+  top_opts.max_leaf_size = 1;
+  BoundPtr top = ConstructBoundsSah(top_opts, inters);
+  tlas_.reset(new LinearBvh(top.get()));
+  if (single_precision) {
+    tlas_->UseSinglePrecision();
+  }
+}
+
+std::optional<ShadeablePoint> InstancedBvh::Intersect(const Ray& ray) const {
+  return tlas_->Intersect(ray);
+}
+
+bool InstancedBvh::Occluded(const Ray& ray, double t_max) const {
+  return tlas_->Occluded(ray, t_max);
+}
+
+void InstancedBvh::IntersectPacket(const Ray* rays, int count,
+                                   std::optional<ShadeablePoint>* hits) const {
+  tlas_->IntersectPacket(rays, count, hits);
+}
+
+void InstancedBvh::OccludedPacket(const Ray* rays, const double* t_max,
+                                  int count, bool* occluded) const {
+  tlas_->OccludedPacket(rays, t_max, count, occluded);
+}
+
+size_t InstancedBvh::MemoryUsage() const {
+  size_t usage =
+      tlas_->MemoryUsage() + instances_.capacity() * sizeof(Instance);
+  for (const std::unique_ptr<LinearBvh>& blas : blases_) {
+    if (blas) {
+      usage += blas->MemoryUsage();
+    }
+  }
+  return usage;
+}
@@ -0,0 +1,100 @@
+#ifndef TRACER_INSTANCED_BVH_HPP
+#define TRACER_INSTANCED_BVH_HPP
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "tracer/acceleration.hpp"
+#include "tracer/intersectable.hpp"
+#include "tracer/linear_bvh.hpp"
+#include "tracer/scene_cache.hpp"
+#include "tracer/scene_geometry.hpp"
+#include "tracer/thread_pool.hpp"
+
+// A two level BVH over the instances of a `SceneGeometry`. Each unique mesh
+// gets one bottom level `LinearBvh` in its own space, built once no matter
+// how many instances place it. The top level holds the instances, each with
+// its transform and inverse, and moves rays into mesh space before tracing
+// the mesh's bottom level tree. Memory and build time therefore grow with the
+// unique geometry, plus a little per instance.
+//
+// Instances are placed with the geometry's transforms at construction.
+class InstancedBvh {
+ public:
+  // `geometry` must outlive this. `thread_pool` may be null, in which case
+  // everything is built on the calling thread. If `cache_path` is not empty,
+  // the bottom level trees are loaded from the `SceneCache` file there when
+  // it was written for the same meshes and options, and are otherwise built
+  // and written to it. If `single_precision` is set, both levels are
+  // traversed with `LinearBvh::UseSinglePrecision`; the cache file is the
+  // same either way.
+  InstancedBvh(const SahOptions& opts, SceneGeometry* geometry,
+               ThreadPool* thread_pool, const std::string& cache_path = "",
+               bool single_precision = false);
+
+  std::optional<ShadeablePoint> Intersect(const Ray& ray) const;
+  // See `Intersectable::Occluded`.
+  bool Occluded(const Ray& ray, double t_max) const;
+  // See `LinearBvh::IntersectPacket` and `LinearBvh::OccludedPacket`. Rays
+  // reaching the same instance go on down its mesh's tree as a packet.
+  void IntersectPacket(const Ray* rays, int count,
+                       std::optional<ShadeablePoint>* hits) const;
+  void OccludedPacket(const Ray* rays, const double* t_max, int count,
+                      bool* occluded) const;
+
+  // Approximate bytes held by both levels, not counting the geometry or a
+  // mapped cache file.
+  size_t MemoryUsage() const;
+  // Whether the bottom level trees came from a cache file.
+  bool loaded_from_cache() const { return cache_ != nullptr; }
+  // The tree over the instances.
+  const LinearBvh& tlas() const { return *tlas_; }
+
+ private:
+  // One placement of a mesh. Hits report this as their shape, with the mesh
+  // triangle as `prim_index`, so they are shaded with the instance's
+  // material and normal transform.
+  class Instance : public Shadeable {
+   public:
+    Instance(SceneGeometry* geometry, uint32_t index, const LinearBvh* blas);
+    std::optional<ShadeablePoint> Intersect(const Ray& ray) override;
+    std::optional<DVec3> EarliestIntersect(const Ray& ray) override;
+    bool Occluded(const Ray& ray, double t_max) override;
+    void IntersectPacket(const Ray* rays, int count,
+                         std::optional<ShadeablePoint>* hits) override;
+    void OccludedPacket(const Ray* rays, const double* t_max, int count,
+                        bool* occluded) override;
+    AaBox GetAaBox() const override { return box_; }
+    DVec3 EstimateCenter() const override { return box_.EstimateCenter(); }
+    bool IsShadeable() const override { return true; }
+    Material* material() const override;
+    DVec2 GetUv(const ShadeablePoint& point) override;
+    DVec3 GetNormal(const ShadeablePoint& point) override;
+    Model* GetParentModel() override;
+
+   private:
+    // Sets `local` to `ray` in mesh space, with a normalized direction, and
+    // returns the length of the world space unit direction in mesh space,
+    // which scales distances from world to mesh space.
+    double ToLocal(const Ray& ray, Ray* local) const;
+
+    SceneGeometry* geometry_;
+    uint32_t index_;
+    const LinearBvh* blas_;
+    DMat4 to_world_;
+    DMat4 to_local_;
+    AaBox box_;
+  };
+
+  SceneGeometry* geometry_;
+  // Holds the mapped trees, if they were loaded from a file.
+  std::unique_ptr<SceneCache> cache_;
+  // Indexed by mesh; empty meshes have none.
+  std::vector<std::unique_ptr<LinearBvh>> blases_;
+  std::vector<Instance> instances_;
+  std::unique_ptr<LinearBvh> tlas_;
+};
+
+#endif
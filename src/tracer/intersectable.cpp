@@ -3,9 +3,8 @@
 #include <algorithm>
 #include <iostream>
 
-#include "shapes/interpolation.hpp"
-
-std::optional<DVec3> IntersectTri(Ray ray, const std::array<DVec3, 3>& verts) {
+std::optional<TriHit> IntersectTriHit(Ray ray,
+                                      const std::array<DVec3, 3>& verts) {
   ray.dir = glm::normalize(ray.dir);
   double eps = epsilon(verts[0]);
   DVec3 edge0 = verts[1] - verts[0];
@@ -30,11 +29,40 @@ std::optional<DVec3> IntersectTri(Ray ray, const std::array<DVec3, 3>& verts) {
   double t = glm::dot(edge1, q) * invDeterminant;
 
   if (t > eps) {
-    return ray.origin + t * ray.dir;
+    return TriHit({ray.origin + t * ray.dir, t, u, v});
   }
   return std::nullopt;
 }
 
+std::optional<DVec3> IntersectTri(Ray ray, const std::array<DVec3, 3>& verts) {
+  std::optional<TriHit> hit = IntersectTriHit(ray, verts);
+  if (!hit.has_value()) {
+    return std::nullopt;
+  }
+  return hit->point;
+}
+
+bool Intersectable::Occluded(const Ray& ray, double t_max) {
+  std::optional<ShadeablePoint> inter = Intersect(ray);
+  return inter.has_value() && inter->t < t_max;
+}
+
+void Intersectable::IntersectPacket(const Ray* rays, int count,
+                                    std::optional<ShadeablePoint>* hits) {
+  for (int i = 0; i < count; i++) {
+    hits[i] = Intersect(rays[i]);
+  }
+}
+
+void Intersectable::OccludedPacket(const Ray* rays, const double* t_max,
+                                   int count, bool* occluded) {
+  for (int i = 0; i < count; i++) {
+    if (!occluded[i]) {
+      occluded[i] = Occluded(rays[i], t_max[i]);
+    }
+  }
+}
+
 double Intersectable::SurfaceArea() const { return GetAaBox().SurfaceArea(); }
 
 AaBox::AaBox(DVec3 bot, DVec3 top) {
@@ -62,6 +90,38 @@ std::optional<DVec3> AaBox::EarliestIntersect(const Ray& ray) {
 
   Ray r = ray;
   r.dir = glm::normalize(PreventZero(r.dir));
+  double tMin, tMax;
+  if (!SlabIntersect(r, &tMin, &tMax)) return std::nullopt;
+
+  DVec3 res;
+  if (tMin <= 0) {
+    if (tMax <= 0)
+      return std::nullopt;
+    else
+      res = r.origin + tMax * r.dir;
+  } else {
+    res = r.origin + tMin * r.dir;
+  }
+
+  return res;
+}
+
+bool AaBox::EntryDistance(const Ray& ray, double max_dist,
+                          double* dist) const {
+  if (!initialized_) {
+    std::cerr << "ERROR: called `EntryDistance` on uninitialized AaBox."
+              << std::endl;
+    exit(-1);
+  }
+  Ray r = ray;
+  r.dir = glm::normalize(PreventZero(r.dir));
+  double tMin, tMax;
+  if (!SlabIntersect(r, &tMin, &tMax) || tMax <= 0) return false;
+  *dist = std::max(tMin, 0.0);
+  return *dist <= max_dist;
+}
+
+bool AaBox::SlabIntersect(const Ray& r, double* t_min, double* t_max) const {
   DVec3 closePlanes(0);
   DVec3 farPlanes(0);
   DVec3 invDir(1.0 / r.dir.x, 1.0 / r.dir.y, 1.0 / r.dir.z);
@@ -80,28 +140,20 @@ std::optional<DVec3> AaBox::EarliestIntersect(const Ray& ray) {
   double tyMin = (closePlanes.y - r.origin.y) * invDir.y;
   double tyMax = (farPlanes.y - r.origin.y) * invDir.y;
 
-  if (tMin > tyMax || tyMin > tMax) return std::nullopt;
+  if (tMin > tyMax || tyMin > tMax) return false;
   if (tyMin > tMin) tMin = tyMin;
   if (tyMax < tMax) tMax = tyMax;
 
   double tzMin = (closePlanes.z - r.origin.z) * invDir.z;
   double tzMax = (farPlanes.z - r.origin.z) * invDir.z;
 
-  if (tMin > tzMax || tzMin > tMax) return std::nullopt;
+  if (tMin > tzMax || tzMin > tMax) return false;
   if (tzMin > tMin) tMin = tzMin;
   if (tzMax < tMax) tMax = tzMax;
 
-  DVec3 res;
-  if (tMin <= 0) {
-    if (tMax <= 0)
-      return std::nullopt;
-    else
-      res = r.origin + tMax * r.dir;
-  } else {
-    res = r.origin + tMin * r.dir;
-  }
-
-  return res;
+  *t_min = tMin;
+  *t_max = tMax;
+  return true;
 }
 
 std::optional<DVec3> AaBox::EarliestIntersectSlowTriBased(const Ray& ray) {
@@ -232,15 +284,15 @@ InterTri::InterTri(Material* material, Model* parent, DVertex vert0, DVertex ver
 }
 
 std::optional<ShadeablePoint> InterTri::Intersect(const Ray& ray) {
-  std::optional<DVec3> point = IntersectTri(ray, {
-                                                     verts_[0].Position,
-                                                     verts_[1].Position,
-                                                     verts_[2].Position,
-                                                 });
-  if (!point.has_value()) {
+  std::optional<TriHit> hit = IntersectTriHit(ray, {
+                                                      verts_[0].Position,
+                                                      verts_[1].Position,
+                                                      verts_[2].Position,
+                                                  });
+  if (!hit.has_value()) {
     return std::nullopt;
   }
-  return ShadeablePoint({*point, this, ray});
+  return ShadeablePoint({hit->point, this, ray, hit->t, hit->u, hit->v});
 }
 
 std::optional<DVec3> InterTri::EarliestIntersect(const Ray& ray) {
@@ -251,6 +303,15 @@ std::optional<DVec3> InterTri::EarliestIntersect(const Ray& ray) {
   return std::nullopt;
 }
 
+bool InterTri::Occluded(const Ray& ray, double t_max) {
+  std::optional<TriHit> hit = IntersectTriHit(ray, {
+                                                      verts_[0].Position,
+                                                      verts_[1].Position,
+                                                      verts_[2].Position,
+                                                  });
+  return hit.has_value() && hit->t < t_max;
+}
+
 AaBox InterTri::GetAaBox() const {
   AaBox box;
   for (int i = 0; i < 3; i++) {
@@ -263,24 +324,20 @@ DVec3 InterTri::EstimateCenter() const {
   return (verts_[0].Position + verts_[1].Position + verts_[2].Position) / 3.0;
 }
 
+bool InterTri::GetTriangle(std::array<DVec3, 3>* verts) const {
+  *verts = {verts_[0].Position, verts_[1].Position, verts_[2].Position};
+  return true;
+}
+
 Material* InterTri::material() const { return material_; }
 
-DVec2 InterTri::GetUv(DVec3 point) {
-  DVec3 weights = GetBarycentricWeights(verts_[0].Position, verts_[1].Position,
-                                        verts_[2].Position, point);
-  DVec2 uv(0.0);
-  for (int i = 0; i < 3; i++) {
-    uv += weights[i] * verts_[i].TexCoords;
-  }
-  return uv;
+DVec2 InterTri::GetUv(const ShadeablePoint& point) {
+  return (1.0 - point.u - point.v) * verts_[0].TexCoords +
+         point.u * verts_[1].TexCoords + point.v * verts_[2].TexCoords;
 }
 
-DVec3 InterTri::GetNormal(DVec3 point) {
-  DVec3 weights = GetBarycentricWeights(verts_[0].Position, verts_[1].Position,
-                                        verts_[2].Position, point);
-  DVec3 normal(0.0);
-  for (int i = 0; i < 3; i++) {
-    normal += weights[i] * verts_[i].Normal;
-  }
-  return glm::normalize(normal);
+DVec3 InterTri::GetNormal(const ShadeablePoint& point) {
+  return glm::normalize((1.0 - point.u - point.v) * verts_[0].Normal +
+                        point.u * verts_[1].Normal +
+                        point.v * verts_[2].Normal);
 }
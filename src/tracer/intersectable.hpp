@@ -2,6 +2,7 @@
 #define TRACER_INTERSECTABLE_HPP
 
 #include <array>
+#include <cstdint>
 #include <memory>
 #include <optional>
 #include <vector>
@@ -24,8 +25,26 @@ struct ShadeablePoint {
   DVec3 point;
   Shadeable* shape;
   Ray ray;
+  // Distance from `ray.origin` to `point`.
+  double t = 0.0;
+  // Barycentric weights of the second and third vertices of a triangle hit.
+  double u = 0.0;
+  double v = 0.0;
+  // See `Shadeable::GetPrimIndex`.
+  uint32_t prim_index = 0;
 };
 
+// A ray-triangle hit. `t` is the distance along the ray and `u`, `v` are the
+// barycentric weights of the second and third vertices.
+struct TriHit {
+  DVec3 point;
+  double t;
+  double u;
+  double v;
+};
+
+std::optional<TriHit> IntersectTriHit(Ray ray,
+                                      const std::array<DVec3, 3>& verts);
 std::optional<DVec3> IntersectTri(Ray ray, const std::array<DVec3, 3>& verts);
 
 class Intersectable {
@@ -33,6 +52,17 @@ class Intersectable {
   virtual ~Intersectable() = default;
   virtual std::optional<ShadeablePoint> Intersect(const Ray& ray) = 0;
   virtual std::optional<DVec3> EarliestIntersect(const Ray& ray) = 0;
+  // Returns true if `ray` hits anything less than `t_max` from its origin.
+  // Unlike `Intersect` this may stop at the first such hit.
+  virtual bool Occluded(const Ray& ray, double t_max);
+  // Packet versions of `Intersect` and `Occluded` for `count` coherent rays,
+  // such as neighbouring primary rays. `hits[i]` is set to the hit of
+  // `rays[i]`; `occluded[i]` is only traced, and set, if it is false. By
+  // default each ray is traced on its own.
+  virtual void IntersectPacket(const Ray* rays, int count,
+                               std::optional<ShadeablePoint>* hits);
+  virtual void OccludedPacket(const Ray* rays, const double* t_max, int count,
+                              bool* occluded);
   virtual AaBox GetAaBox() const = 0;
   virtual double SurfaceArea() const;
   virtual DVec3 EstimateCenter() const = 0;
@@ -44,9 +74,19 @@ using InterPtr = std::unique_ptr<Intersectable>;
 class Shadeable : public Intersectable {
  public:
   virtual Material* material() const = 0;
-  virtual DVec2 GetUv(DVec3 point) = 0;
-  virtual DVec3 GetNormal(DVec3 point) = 0;
+  // Both use the hit's barycentrics rather than reconstructing them from
+  // `point.point`.
+  virtual DVec2 GetUv(const ShadeablePoint& point) = 0;
+  virtual DVec3 GetNormal(const ShadeablePoint& point) = 0;
   virtual Model* GetParentModel() = 0;
+  // Index of this shape in the store that owns it, e.g. its `SceneGeometry`
+  // triangle index. Zero for shapes without one.
+  virtual uint32_t GetPrimIndex() const { return 0; }
+  // If this shape is a triangle that intersects exactly like `IntersectTri`
+  // on some vertices, sets `verts` to them and returns true.
+  virtual bool GetTriangle(std::array<DVec3, 3>* /*verts*/) const {
+    return false;
+  }
 };
 
 class AaBox : public Intersectable {
@@ -56,6 +96,10 @@ class AaBox : public Intersectable {
   std::optional<ShadeablePoint> Intersect(const Ray& ray) override;
   std::optional<DVec3> EarliestIntersect(const Ray& ray) override;
   std::optional<DVec3> EarliestIntersectSlowTriBased(const Ray& ray);
+  // Sets `dist` to the distance along `ray` at which it enters the box, or
+  // zero if the ray starts inside it. Returns false if the ray misses the box
+  // or enters it farther than `max_dist`.
+  bool EntryDistance(const Ray& ray, double max_dist, double* dist) const;
   AaBox GetAaBox() const override;
   double SurfaceArea() const override;
   DVec3 EstimateCenter() const override;
@@ -67,10 +111,14 @@ class AaBox : public Intersectable {
   virtual bool Contains(const Intersectable& inter) const;
   std::vector<std::array<DVec3, 3>> ToTris() const;
 
-  DVec3 bot() { return bot_; }
-  DVec3 top() { return top_; }
+  DVec3 bot() const { return bot_; }
+  DVec3 top() const { return top_; }
 
  protected:
+  // Slab test against a ray with a normalized, nonzero direction. Returns
+  // false if the ray's line misses the box.
+  bool SlabIntersect(const Ray& r, double* t_min, double* t_max) const;
+
   bool initialized_ = false;
   DVec3 bot_;
   DVec3 top_;
@@ -81,13 +129,15 @@ class InterTri : public Shadeable {
   InterTri(Material* material, Model* parent, DVertex vert0, DVertex vert1, DVertex vert2);
   std::optional<ShadeablePoint> Intersect(const Ray& ray) override;
   std::optional<DVec3> EarliestIntersect(const Ray& ray) override;
+  bool Occluded(const Ray& ray, double t_max) override;
   AaBox GetAaBox() const override;
   DVec3 EstimateCenter() const override;
   bool IsShadeable() const override { return true; }
   Material* material() const override;
-  DVec2 GetUv(DVec3 point) override;
-  DVec3 GetNormal(DVec3 point) override;
+  DVec2 GetUv(const ShadeablePoint& point) override;
+  DVec3 GetNormal(const ShadeablePoint& point) override;
   Model* GetParentModel() override { return parent_; }
+  bool GetTriangle(std::array<DVec3, 3>* verts) const override;
 
  protected:
   Material* material_;
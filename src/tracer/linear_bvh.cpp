@@ -0,0 +1,978 @@
+#include "tracer/linear_bvh.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "profile/trace.hpp"
+#include "tracer/render_stats.hpp"
+
+namespace {
+
+// Traversal keeps at most one pending entry per level of the tree.
+constexpr int kStackSize = 128;
+// Leaves hold at most this many primitives, which stays within `prim_count`
+// once triangle leaves are padded.
+constexpr size_t kMaxLeafPrims = 0xfff0;
+constexpr int kBlockWidth = TriangleSoa::kWidth;
+
+float RoundDown(double val) {
+  float res = (float)val;
+  if (res > val) {
+    res = std::nextafter(res, -std::numeric_limits<float>::infinity());
+  }
+  return res;
+}
+
+float RoundUp(double val) {
+  float res = (float)val;
+  if (res < val) {
+    res = std::nextafter(res, std::numeric_limits<float>::infinity());
+  }
+  return res;
+}
+
+bool HasPrims(BoundShape* shape) {
+  if (!shape->inter_children().empty()) {
+    return true;
+  }
+  for (const BoundPtr& child : shape->bound_children()) {
+    if (HasPrims(child.get())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Node tests are done in `Real`, which is double, or float for
+// `LinearBvh::UseSinglePrecision`.
+template <typename Real>
+using Vec3 = std::conditional_t<std::is_same_v<Real, float>, glm::vec3, DVec3>;
+
+template <typename Real>
+struct RaySetup {
+  Vec3<Real> origin;
+  Vec3<Real> inv_dir;
+};
+
+template <typename Real>
+RaySetup<Real> GetRaySetup(const Ray& ray) {
+  // Distances along the normalized direction match the distances that
+  // `BoundShape::Intersect` compares.
+  DVec3 dir = glm::normalize(PreventZero(ray.dir));
+  return {Vec3<Real>(ray.origin),
+          Vec3<Real>(DVec3(1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z))};
+}
+
+template <typename Real>
+bool HasNan(const RaySetup<Real>& setup) {
+  for (int i = 0; i < 3; i++) {
+    if (std::isnan(setup.origin[i]) || std::isnan(setup.inv_dir[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Relative error bound of `n` rounded float operations.
+constexpr float Gamma(int n) {
+  constexpr float kUnitRoundoff = std::numeric_limits<float>::epsilon() / 2;
+  return (n * kUnitRoundoff) / (1 - n * kUnitRoundoff);
+}
+
+// Float slab distances are each within `Gamma(3)` of the exact ones, so
+// scaling the exit distances by this keeps every box a ray passes through.
+constexpr float kSlabScale = 1 + 2 * Gamma(3);
+
+// How triangles are stored and tested for each precision of node tests.
+template <typename Real>
+struct Kernel;
+
+template <>
+struct Kernel<double> {
+  using BlockRay = TriangleSoa::BlockRay;
+
+  static BlockRay GetBlockRay(const Ray& ray) {
+    return {ray.origin, glm::normalize(ray.dir)};
+  }
+  // The distance up to which nodes are searched for hits closer than `max_t`.
+  static double NodeLimit(const BlockRay& /*ray*/, double max_t) {
+    return max_t;
+  }
+  // Sets `t`, `u` and `v` as `TriangleSoa::IntersectBlock` does. Hits beyond
+  // `max_t` may be reported.
+  static void IntersectBlock(const LinearBvh& bvh, const BlockRay& ray,
+                             uint32_t first, double /*max_t*/, double* t,
+                             double* u, double* v) {
+    bvh.triangles().IntersectBlock(ray, first, t, u, v);
+  }
+};
+
+template <>
+struct Kernel<float> {
+  using BlockRay = FloatTriangleSoa::BlockRay;
+
+  static BlockRay GetBlockRay(const Ray& ray) {
+    return FloatTriangleSoa::GetBlockRay(ray.origin, glm::normalize(ray.dir));
+  }
+  // Nodes are tested with the origin rounded to float, which can move a hit
+  // by up to `t_slack`.
+  static double NodeLimit(const BlockRay& ray, double max_t) {
+    return (max_t + ray.t_slack) * kSlabScale;
+  }
+  static void IntersectBlock(const LinearBvh& bvh, const BlockRay& ray,
+                             uint32_t first, double max_t, double* t,
+                             double* u, double* v) {
+    bvh.float_triangles().IntersectBlock(ray, first, max_t, t, u, v);
+  }
+};
+
+// Slab test against the node bounds, limited to [0, max_t]. On a hit,
+// `t_entry` is set to the distance at which the ray enters the box, or zero
+// if the origin is inside it.
+template <typename Real>
+bool IntersectNode(const LinearBvhNode& node, const RaySetup<Real>& setup,
+                   double max_t, double* t_entry) {
+  Real t_min = 0;
+  Real t_max = max_t;
+  for (int i = 0; i < 3; i++) {
+    Real t0 = (node.bot[i] - setup.origin[i]) * setup.inv_dir[i];
+    Real t1 = (node.top[i] - setup.origin[i]) * setup.inv_dir[i];
+    if (t0 > t1) std::swap(t0, t1);
+    if constexpr (std::is_same_v<Real, float>) {
+      t1 *= kSlabScale;
+    }
+    t_min = std::max(t_min, t0);
+    t_max = std::min(t_max, t1);
+  }
+  *t_entry = t_min;
+  return t_min <= t_max;
+}
+
+// Tests both children of an interior node, as `IntersectNode` does, and
+// returns a mask with bit 0 set if `a` is hit and bit 1 if `b` is.
+template <typename Real>
+int IntersectChildren(const LinearBvhNode& a, const LinearBvhNode& b,
+                      const RaySetup<Real>& setup, double max_t, double* t_a,
+                      double* t_b) {
+  int hit_a = IntersectNode(a, setup, max_t, t_a);
+  int hit_b = IntersectNode(b, setup, max_t, t_b);
+  return hit_a | hit_b << 1;
+}
+
+#if defined(__SSE2__)
+
+// Sets `near` and `far` to the slab distances of `node` in lanes 0 to 2.
+inline void NodeSlabs(const LinearBvhNode& node, __m128 origin, __m128 inv_dir,
+                      __m128* near, __m128* far) {
+  static_assert(offsetof(LinearBvhNode, top) ==
+                    offsetof(LinearBvhNode, bot) + 3 * sizeof(float),
+                "The bounds must be six consecutive floats");
+  // Lane 3 holds another bound, and is left out by the callers.
+  __m128 bot = _mm_loadu_ps(node.bot);
+  __m128 top = _mm_loadu_ps(node.bot + 2);
+  top = _mm_shuffle_ps(top, top, _MM_SHUFFLE(3, 3, 2, 1));
+  __m128 t0 = _mm_mul_ps(_mm_sub_ps(bot, origin), inv_dir);
+  __m128 t1 = _mm_mul_ps(_mm_sub_ps(top, origin), inv_dir);
+  *near = _mm_min_ps(t0, t1);
+  *far = _mm_mul_ps(_mm_max_ps(t0, t1), _mm_set1_ps(kSlabScale));
+}
+
+// The single precision version, with the slabs of both children side by
+// side.
+inline int IntersectChildren(const LinearBvhNode& a, const LinearBvhNode& b,
+                             const RaySetup<float>& setup, double max_t,
+                             double* t_a, double* t_b) {
+  __m128 origin =
+      _mm_setr_ps(setup.origin.x, setup.origin.y, setup.origin.z, 0.0f);
+  __m128 inv_dir =
+      _mm_setr_ps(setup.inv_dir.x, setup.inv_dir.y, setup.inv_dir.z, 0.0f);
+  __m128 near_a;
+  __m128 far_a;
+  __m128 near_b;
+  __m128 far_b;
+  NodeSlabs(a, origin, inv_dir, &near_a, &far_a);
+  NodeSlabs(b, origin, inv_dir, &near_b, &far_b);
+  // Lanes 0 and 1 reduce the three slabs of `a` and `b` respectively.
+  __m128 near_lo = _mm_unpacklo_ps(near_a, near_b);
+  __m128 near_hi = _mm_unpackhi_ps(near_a, near_b);
+  __m128 t_min =
+      _mm_max_ps(_mm_max_ps(near_lo, _mm_movehl_ps(near_lo, near_lo)),
+                 _mm_max_ps(near_hi, _mm_setzero_ps()));
+  __m128 far_lo = _mm_unpacklo_ps(far_a, far_b);
+  __m128 far_hi = _mm_unpackhi_ps(far_a, far_b);
+  __m128 t_max =
+      _mm_min_ps(_mm_min_ps(far_lo, _mm_movehl_ps(far_lo, far_lo)),
+                 _mm_min_ps(far_hi, _mm_set1_ps((float)max_t)));
+  alignas(16) float t_entry[4];
+  _mm_store_ps(t_entry, t_min);
+  *t_a = t_entry[0];
+  *t_b = t_entry[1];
+  return _mm_movemask_ps(_mm_cmple_ps(t_min, t_max)) & 3;
+}
+
+#endif
+
+// Finds the closest hit of `ray` in the subtree at `root` that is nearer than
+// `*closest`, and updates `*closest` and `*closest_inter` if there is one.
+template <typename Real>
+void IntersectSubtree(const LinearBvh& bvh, uint32_t root, const Ray& ray,
+                      const RaySetup<Real>& setup,
+                      const typename Kernel<Real>::BlockRay& block_ray,
+                      double* closest,
+                      std::optional<ShadeablePoint>* closest_inter,
+                      TraversalStats* stats) {
+  const LinearBvhNode* nodes = bvh.nodes();
+  struct StackEntry {
+    uint32_t node;
+    double t_entry;
+  };
+  StackEntry stack[kStackSize];
+  int stack_size = 0;
+  double root_t;
+  stats->box_tests++;
+  if (!IntersectNode(nodes[root], setup,
+                     Kernel<Real>::NodeLimit(block_ray, *closest), &root_t)) {
+    return;
+  }
+  stack[stack_size++] = {root, root_t};
+
+  while (stack_size > 0) {
+    StackEntry entry = stack[--stack_size];
+    double limit = Kernel<Real>::NodeLimit(block_ray, *closest);
+    if (entry.t_entry > limit) {
+      // Everything in this subtree is farther than the current hit.
+      continue;
+    }
+    stats->node_visits++;
+    const LinearBvhNode& node = nodes[entry.node];
+    if (node.is_triangle_leaf()) {
+      for (uint32_t first = node.offset;
+           first < node.offset + node.prim_count; first += kBlockWidth) {
+        double t[kBlockWidth];
+        double u[kBlockWidth];
+        double v[kBlockWidth];
+        Kernel<Real>::IntersectBlock(bvh, block_ray, first, *closest, t, u, v);
+        stats->triangle_tests += kBlockWidth;
+        for (int lane = 0; lane < kBlockWidth; lane++) {
+          if (t[lane] < *closest) {
+            stats->triangle_hits++;
+            *closest = t[lane];
+            Shadeable* shape = bvh.triangle_shapes()[first + lane];
+            *closest_inter = ShadeablePoint(
+                {block_ray.origin + t[lane] * block_ray.dir, shape, ray,
+                 t[lane], u[lane], v[lane], shape->GetPrimIndex()});
+          }
+        }
+      }
+      continue;
+    }
+    if (node.is_leaf()) {
+      for (uint32_t i = node.offset; i < node.offset + node.prim_count; i++) {
+        std::optional<ShadeablePoint> inter = bvh.prims()[i]->Intersect(ray);
+        if (inter.has_value() && inter->t < *closest) {
+          *closest = inter->t;
+          *closest_inter = inter;
+        }
+      }
+      continue;
+    }
+    uint32_t near_node = entry.node + 1;
+    uint32_t far_node = node.offset;
+    double near_t;
+    double far_t;
+    stats->box_tests += 2;
+    int hits = IntersectChildren(nodes[near_node], nodes[far_node], setup,
+                                 limit, &near_t, &far_t);
+    bool hit_near = hits & 1;
+    bool hit_far = hits & 2;
+    if (!hit_near || (hit_far && far_t < near_t)) {
+      std::swap(near_node, far_node);
+      std::swap(near_t, far_t);
+      std::swap(hit_near, hit_far);
+    }
+    // Push the farther child first so the nearer one is visited next.
+    if (hit_far) {
+      stack[stack_size++] = {far_node, far_t};
+    }
+    if (hit_near) {
+      stack[stack_size++] = {near_node, near_t};
+    }
+  }
+}
+
+// Whether `ray` hits anything in the subtree at `root` closer than `t_max`.
+template <typename Real>
+bool OccludedSubtree(const LinearBvh& bvh, uint32_t root, const Ray& ray,
+                     const RaySetup<Real>& setup,
+                     const typename Kernel<Real>::BlockRay& block_ray,
+                     double t_max, TraversalStats* stats) {
+  const LinearBvhNode* nodes = bvh.nodes();
+  uint32_t stack[kStackSize];
+  int stack_size = 0;
+  double limit = Kernel<Real>::NodeLimit(block_ray, t_max);
+  double t_entry;
+  stats->box_tests++;
+  if (!IntersectNode(nodes[root], setup, limit, &t_entry)) {
+    return false;
+  }
+  stack[stack_size++] = root;
+
+  // Any hit will do, so children are not ordered.
+  while (stack_size > 0) {
+    uint32_t index = stack[--stack_size];
+    stats->node_visits++;
+    const LinearBvhNode& node = nodes[index];
+    if (node.is_triangle_leaf()) {
+      for (uint32_t first = node.offset;
+           first < node.offset + node.prim_count; first += kBlockWidth) {
+        double t[kBlockWidth];
+        double u[kBlockWidth];
+        double v[kBlockWidth];
+        Kernel<Real>::IntersectBlock(bvh, block_ray, first, t_max, t, u, v);
+        stats->triangle_tests += kBlockWidth;
+        for (int lane = 0; lane < kBlockWidth; lane++) {
+          if (t[lane] < t_max) {
+            stats->triangle_hits++;
+            return true;
+          }
+        }
+      }
+      continue;
+    }
+    if (node.is_leaf()) {
+      for (uint32_t i = node.offset; i < node.offset + node.prim_count; i++) {
+        if (bvh.prims()[i]->Occluded(ray, t_max)) {
+          return true;
+        }
+      }
+      continue;
+    }
+    double t_second;
+    stats->box_tests += 2;
+    int hits = IntersectChildren(nodes[node.offset], nodes[index + 1], setup,
+                                 limit, &t_second, &t_entry);
+    if (hits & 1) {
+      stack[stack_size++] = node.offset;
+    }
+    if (hits & 2) {
+      stack[stack_size++] = index + 1;
+    }
+  }
+  return false;
+}
+
+// The rays of a packet are tracked as bits of a mask.
+using RayMask = uint64_t;
+static_assert(LinearBvh::kMaxPacketSize <= 64, "Packets must fit a RayMask");
+
+// Packets with fewer rays than this left in a subtree have diverged, and
+// finish it one ray at a time.
+constexpr int kMinPacketRays = 4;
+
+template <typename Real>
+struct PacketRay {
+  RaySetup<Real> setup;
+  typename Kernel<Real>::BlockRay block_ray;
+  // The closest hit so far, or the occlusion distance.
+  double t_max;
+};
+
+// Bounds of the origins and inverse directions of a packet's rays, to reject
+// nodes that every ray misses with one interval arithmetic test. Only
+// `valid` if the directions agree in sign on every axis.
+template <typename Real>
+struct PacketBounds {
+  bool valid = false;
+  Vec3<Real> origin_min;
+  Vec3<Real> origin_max;
+  Vec3<Real> inv_dir_min;
+  Vec3<Real> inv_dir_max;
+};
+
+template <typename Real>
+PacketBounds<Real> GetPacketBounds(const PacketRay<Real>* rays,
+                                   RayMask mask) {
+  PacketBounds<Real> bounds;
+  const RaySetup<Real>& first = rays[std::countr_zero(mask)].setup;
+  bounds.origin_min = bounds.origin_max = first.origin;
+  bounds.inv_dir_min = bounds.inv_dir_max = first.inv_dir;
+  for (RayMask bits = mask; bits != 0; bits &= bits - 1) {
+    const RaySetup<Real>& setup = rays[std::countr_zero(bits)].setup;
+    bounds.origin_min = glm::min(bounds.origin_min, setup.origin);
+    bounds.origin_max = glm::max(bounds.origin_max, setup.origin);
+    bounds.inv_dir_min = glm::min(bounds.inv_dir_min, setup.inv_dir);
+    bounds.inv_dir_max = glm::max(bounds.inv_dir_max, setup.inv_dir);
+  }
+  for (int i = 0; i < 3; i++) {
+    if (!(bounds.inv_dir_min[i] > 0 || bounds.inv_dir_max[i] < 0) ||
+        std::isinf(bounds.inv_dir_min[i]) ||
+        std::isinf(bounds.inv_dir_max[i])) {
+      return bounds;
+    }
+  }
+  bounds.valid = true;
+  return bounds;
+}
+
+// False only if no ray within `bounds` can hit `node` closer than `max_t`.
+// Subtraction and multiplication round monotonically, so the extremes of
+// what `IntersectNode` computes for each ray are at the corners of the
+// bounds, and this never rejects a node that one of the rays would hit.
+template <typename Real>
+bool PacketMayHit(const LinearBvhNode& node, const PacketBounds<Real>& bounds,
+                  double max_t) {
+  Real t_min = 0;
+  Real t_max = max_t;
+  for (int i = 0; i < 3; i++) {
+    bool positive = bounds.inv_dir_min[i] > 0;
+    Real near = positive ? node.bot[i] : node.top[i];
+    Real far = positive ? node.top[i] : node.bot[i];
+    Real near0 = (near - bounds.origin_min[i]) * bounds.inv_dir_min[i];
+    Real near1 = (near - bounds.origin_min[i]) * bounds.inv_dir_max[i];
+    Real near2 = (near - bounds.origin_max[i]) * bounds.inv_dir_min[i];
+    Real near3 = (near - bounds.origin_max[i]) * bounds.inv_dir_max[i];
+    Real far0 = (far - bounds.origin_min[i]) * bounds.inv_dir_min[i];
+    Real far1 = (far - bounds.origin_min[i]) * bounds.inv_dir_max[i];
+    Real far2 = (far - bounds.origin_max[i]) * bounds.inv_dir_min[i];
+    Real far3 = (far - bounds.origin_max[i]) * bounds.inv_dir_max[i];
+    Real far_max = std::max({far0, far1, far2, far3});
+    if constexpr (std::is_same_v<Real, float>) {
+      // As in `IntersectNode`.
+      far_max *= kSlabScale;
+    }
+    t_min = std::max(t_min, std::min({near0, near1, near2, near3}));
+    t_max = std::min(t_max, far_max);
+  }
+  return t_min <= t_max;
+}
+
+// Sets up the rays of a packet, leaving out those with NaNs, which the single
+// ray traversal also misses. Returns the rays to trace.
+template <typename Real>
+RayMask SetUpPacket(const Ray* rays, int count, PacketRay<Real>* packet) {
+  RayMask mask = 0;
+  for (int i = 0; i < count; i++) {
+    packet[i].setup = GetRaySetup<Real>(rays[i]);
+    packet[i].block_ray = Kernel<Real>::GetBlockRay(rays[i]);
+    packet[i].t_max = std::numeric_limits<double>::infinity();
+    if (!HasNan(packet[i].setup)) {
+      mask |= RayMask(1) << i;
+    }
+  }
+  return mask;
+}
+
+// Drops the rays in `*mask` before the first one that hits `node`. Later rays
+// are only tested once they reach a leaf; a ray that misses a node misses
+// all of its descendants too. Returns false if no ray is left.
+template <typename Real>
+bool FirstActiveRay(const LinearBvhNode& node, const PacketRay<Real>* packet,
+                    const PacketBounds<Real>& bounds, RayMask* mask,
+                    TraversalStats* stats) {
+  if (bounds.valid) {
+    double max_t = 0.0;
+    for (RayMask bits = *mask; bits != 0; bits &= bits - 1) {
+      const PacketRay<Real>& ray = packet[std::countr_zero(bits)];
+      max_t = std::max(max_t,
+                       Kernel<Real>::NodeLimit(ray.block_ray, ray.t_max));
+    }
+    stats->box_tests++;
+    if (!PacketMayHit(node, bounds, max_t)) {
+      return false;
+    }
+  }
+  for (; *mask != 0; *mask &= *mask - 1) {
+    const PacketRay<Real>& ray = packet[std::countr_zero(*mask)];
+    double t_entry;
+    stats->box_tests++;
+    if (IntersectNode(node, ray.setup,
+                      Kernel<Real>::NodeLimit(ray.block_ray, ray.t_max),
+                      &t_entry)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The rays of `mask` that hit `node`.
+template <typename Real>
+RayMask LeafRays(const LinearBvhNode& node, const PacketRay<Real>* packet,
+                 RayMask mask, TraversalStats* stats) {
+  RayMask leaf_mask = 0;
+  for (RayMask bits = mask; bits != 0; bits &= bits - 1) {
+    int i = std::countr_zero(bits);
+    const PacketRay<Real>& ray = packet[i];
+    double t_entry;
+    stats->box_tests++;
+    if (IntersectNode(node, ray.setup,
+                      Kernel<Real>::NodeLimit(ray.block_ray, ray.t_max),
+                      &t_entry)) {
+      leaf_mask |= RayMask(1) << i;
+    }
+  }
+  return leaf_mask;
+}
+
+template <typename Real>
+void IntersectPacketChunk(const LinearBvh& bvh, const Ray* rays, int count,
+                          std::optional<ShadeablePoint>* hits,
+                          TraversalStats* stats) {
+  PacketRay<Real> packet[LinearBvh::kMaxPacketSize];
+  RayMask active = SetUpPacket(rays, count, packet);
+  if (bvh.num_nodes() == 0 || active == 0) {
+    return;
+  }
+  PacketBounds<Real> bounds = GetPacketBounds(packet, active);
+  const LinearBvhNode* nodes = bvh.nodes();
+  struct StackEntry {
+    uint32_t node;
+    RayMask mask;
+  };
+  StackEntry stack[kStackSize];
+  int stack_size = 0;
+  stack[stack_size++] = {0, active};
+
+  while (stack_size > 0) {
+    StackEntry entry = stack[--stack_size];
+    const LinearBvhNode& node = nodes[entry.node];
+    RayMask mask = entry.mask;
+    stats->node_visits++;
+    if (!FirstActiveRay(node, packet, bounds, &mask, stats)) {
+      continue;
+    }
+    if (std::popcount(mask) < kMinPacketRays) {
+      for (RayMask bits = mask; bits != 0; bits &= bits - 1) {
+        int i = std::countr_zero(bits);
+        IntersectSubtree(bvh, entry.node, rays[i], packet[i].setup,
+                         packet[i].block_ray, &packet[i].t_max, &hits[i],
+                         stats);
+      }
+      continue;
+    }
+    if (node.is_triangle_leaf()) {
+      RayMask leaf_mask = LeafRays(node, packet, mask, stats);
+      for (uint32_t first = node.offset;
+           first < node.offset + node.prim_count; first += kBlockWidth) {
+        for (RayMask bits = leaf_mask; bits != 0; bits &= bits - 1) {
+          int i = std::countr_zero(bits);
+          PacketRay<Real>& ray = packet[i];
+          double t[kBlockWidth];
+          double u[kBlockWidth];
+          double v[kBlockWidth];
+          Kernel<Real>::IntersectBlock(bvh, ray.block_ray, first, ray.t_max, t,
+                                       u, v);
+          stats->triangle_tests += kBlockWidth;
+          for (int lane = 0; lane < kBlockWidth; lane++) {
+            if (t[lane] < ray.t_max) {
+              stats->triangle_hits++;
+              ray.t_max = t[lane];
+              Shadeable* shape = bvh.triangle_shapes()[first + lane];
+              hits[i] = ShadeablePoint(
+                  {ray.block_ray.origin + t[lane] * ray.block_ray.dir, shape,
+                   rays[i], t[lane], u[lane], v[lane], shape->GetPrimIndex()});
+            }
+          }
+        }
+      }
+      continue;
+    }
+    if (node.is_leaf()) {
+      // Primitives such as instances trace the rays as a packet too.
+      RayMask leaf_mask = LeafRays(node, packet, mask, stats);
+      Ray leaf_rays[LinearBvh::kMaxPacketSize];
+      int leaf_indices[LinearBvh::kMaxPacketSize];
+      int leaf_count = 0;
+      for (RayMask bits = leaf_mask; bits != 0; bits &= bits - 1) {
+        int i = std::countr_zero(bits);
+        leaf_rays[leaf_count] = rays[i];
+        leaf_indices[leaf_count++] = i;
+      }
+      std::optional<ShadeablePoint> leaf_hits[LinearBvh::kMaxPacketSize];
+      for (uint32_t p = node.offset; p < node.offset + node.prim_count; p++) {
+        bvh.prims()[p]->IntersectPacket(leaf_rays, leaf_count, leaf_hits);
+        for (int j = 0; j < leaf_count; j++) {
+          PacketRay<Real>& ray = packet[leaf_indices[j]];
+          if (leaf_hits[j].has_value() && leaf_hits[j]->t < ray.t_max) {
+            ray.t_max = leaf_hits[j]->t;
+            hits[leaf_indices[j]] = leaf_hits[j];
+          }
+        }
+      }
+      continue;
+    }
+    // Children are ordered for the first active ray.
+    const PacketRay<Real>& first = packet[std::countr_zero(mask)];
+    double limit = Kernel<Real>::NodeLimit(first.block_ray, first.t_max);
+    uint32_t near_node = entry.node + 1;
+    uint32_t far_node = node.offset;
+    double near_t;
+    double far_t;
+    stats->box_tests += 2;
+    bool hit_near =
+        IntersectNode(nodes[near_node], first.setup, limit, &near_t);
+    bool hit_far = IntersectNode(nodes[far_node], first.setup, limit, &far_t);
+    if (!hit_near || (hit_far && far_t < near_t)) {
+      std::swap(near_node, far_node);
+    }
+    stack[stack_size++] = {far_node, mask};
+    stack[stack_size++] = {near_node, mask};
+  }
+}
+
+template <typename Real>
+void OccludedPacketChunk(const LinearBvh& bvh, const Ray* rays,
+                         const double* t_max, int count, bool* occluded,
+                         TraversalStats* stats) {
+  PacketRay<Real> packet[LinearBvh::kMaxPacketSize];
+  RayMask active = SetUpPacket(rays, count, packet);
+  for (int i = 0; i < count; i++) {
+    packet[i].t_max = t_max[i];
+    if (occluded[i]) {
+      active &= ~(RayMask(1) << i);
+    }
+  }
+  if (bvh.num_nodes() == 0 || active == 0) {
+    return;
+  }
+  PacketBounds<Real> bounds = GetPacketBounds(packet, active);
+  const LinearBvhNode* nodes = bvh.nodes();
+  struct StackEntry {
+    uint32_t node;
+    RayMask mask;
+  };
+  StackEntry stack[kStackSize];
+  int stack_size = 0;
+  stack[stack_size++] = {0, active};
+
+  // Rays leave every entry once they are known to be occluded.
+  while (stack_size > 0 && active != 0) {
+    StackEntry entry = stack[--stack_size];
+    const LinearBvhNode& node = nodes[entry.node];
+    RayMask mask = entry.mask & active;
+    if (mask == 0) {
+      continue;
+    }
+    stats->node_visits++;
+    if (!FirstActiveRay(node, packet, bounds, &mask, stats)) {
+      continue;
+    }
+    if (std::popcount(mask) < kMinPacketRays) {
+      for (RayMask bits = mask; bits != 0; bits &= bits - 1) {
+        int i = std::countr_zero(bits);
+        if (OccludedSubtree(bvh, entry.node, rays[i], packet[i].setup,
+                            packet[i].block_ray, packet[i].t_max, stats)) {
+          occluded[i] = true;
+          active &= ~(RayMask(1) << i);
+        }
+      }
+      continue;
+    }
+    if (node.is_triangle_leaf()) {
+      RayMask leaf_mask = LeafRays(node, packet, mask, stats);
+      for (uint32_t first = node.offset;
+           first < node.offset + node.prim_count && leaf_mask != 0;
+           first += kBlockWidth) {
+        for (RayMask bits = leaf_mask; bits != 0; bits &= bits - 1) {
+          int i = std::countr_zero(bits);
+          double t[kBlockWidth];
+          double u[kBlockWidth];
+          double v[kBlockWidth];
+          Kernel<Real>::IntersectBlock(bvh, packet[i].block_ray, first,
+                                       packet[i].t_max, t, u, v);
+          stats->triangle_tests += kBlockWidth;
+          for (int lane = 0; lane < kBlockWidth; lane++) {
+            if (t[lane] < packet[i].t_max) {
+              stats->triangle_hits++;
+              occluded[i] = true;
+              active &= ~(RayMask(1) << i);
+              leaf_mask &= ~(RayMask(1) << i);
+              break;
+            }
+          }
+        }
+      }
+      continue;
+    }
+    if (node.is_leaf()) {
+      RayMask leaf_mask = LeafRays(node, packet, mask, stats);
+      Ray leaf_rays[LinearBvh::kMaxPacketSize];
+      double leaf_t_max[LinearBvh::kMaxPacketSize];
+      bool leaf_occluded[LinearBvh::kMaxPacketSize];
+      int leaf_indices[LinearBvh::kMaxPacketSize];
+      int leaf_count = 0;
+      for (RayMask bits = leaf_mask; bits != 0; bits &= bits - 1) {
+        int i = std::countr_zero(bits);
+        leaf_rays[leaf_count] = rays[i];
+        leaf_t_max[leaf_count] = packet[i].t_max;
+        leaf_occluded[leaf_count] = false;
+        leaf_indices[leaf_count++] = i;
+      }
+      for (uint32_t p = node.offset; p < node.offset + node.prim_count; p++) {
+        bvh.prims()[p]->OccludedPacket(leaf_rays, leaf_t_max, leaf_count,
+                                       leaf_occluded);
+      }
+      for (int j = 0; j < leaf_count; j++) {
+        if (leaf_occluded[j]) {
+          occluded[leaf_indices[j]] = true;
+          active &= ~(RayMask(1) << leaf_indices[j]);
+        }
+      }
+      continue;
+    }
+    stack[stack_size++] = {node.offset, mask};
+    stack[stack_size++] = {entry.node + 1, mask};
+  }
+}
+
+template <typename Real>
+std::optional<ShadeablePoint> IntersectRay(const LinearBvh& bvh,
+                                           const Ray& ray) {
+  RaySetup<Real> setup = GetRaySetup<Real>(ray);
+  if (HasNan(setup)) {
+    // std::max/std::min drop NaN slabs, so such a ray (e.g. from a degenerate
+    // refraction) would otherwise visit every node. The bound tree misses it.
+    return std::nullopt;
+  }
+  typename Kernel<Real>::BlockRay block_ray = Kernel<Real>::GetBlockRay(ray);
+  double closest = std::numeric_limits<double>::infinity();
+  std::optional<ShadeablePoint> closest_inter;
+  TraversalStats stats;
+  IntersectSubtree(bvh, 0, ray, setup, block_ray, &closest, &closest_inter,
+                   &stats);
+  RenderStats::CountTraversal(stats);
+  return closest_inter;
+}
+
+template <typename Real>
+bool OccludedRay(const LinearBvh& bvh, const Ray& ray, double t_max) {
+  RaySetup<Real> setup = GetRaySetup<Real>(ray);
+  if (HasNan(setup)) {
+    return false;
+  }
+  typename Kernel<Real>::BlockRay block_ray = Kernel<Real>::GetBlockRay(ray);
+  TraversalStats stats;
+  bool occluded = OccludedSubtree(bvh, 0, ray, setup, block_ray, t_max, &stats);
+  RenderStats::CountTraversal(stats);
+  return occluded;
+}
+
+}  // namespace
+
+LinearBvh::LinearBvh(BoundShape* root) {
+  TRACE_ZONE("linear bvh compile");
+  if (HasPrims(root)) {
+    Flatten(root, 0);
+  }
+  node_data_ = nodes_.data();
+  num_nodes_ = nodes_.size();
+}
+
+LinearBvh::LinearBvh(const LinearBvhNode* nodes, size_t num_nodes,
+                     TriangleSoa triangles,
+                     std::vector<Shadeable*> triangle_shapes)
+    : node_data_(nodes),
+      num_nodes_(num_nodes),
+      triangles_(std::move(triangles)),
+      triangle_shapes_(std::move(triangle_shapes)) {}
+
+size_t LinearBvh::MemoryUsage() const {
+  return nodes_.capacity() * sizeof(LinearBvhNode) +
+         prims_.capacity() * sizeof(Intersectable*) +
+         triangles_.MemoryUsage() + float_triangles_.MemoryUsage() +
+         triangle_shapes_.capacity() * sizeof(Shadeable*);
+}
+
+std::optional<ShadeablePoint> LinearBvh::Intersect(const Ray& ray) const {
+  if (num_nodes_ == 0) {
+    return std::nullopt;
+  }
+  return single_precision_ ? IntersectRay<float>(*this, ray)
+                           : IntersectRay<double>(*this, ray);
+}
+
+bool LinearBvh::Occluded(const Ray& ray, double t_max) const {
+  if (num_nodes_ == 0) {
+    return false;
+  }
+  return single_precision_ ? OccludedRay<float>(*this, ray, t_max)
+                           : OccludedRay<double>(*this, ray, t_max);
+}
+
+void LinearBvh::IntersectPacket(const Ray* rays, int count,
+                                std::optional<ShadeablePoint>* hits) const {
+  for (int i = 0; i < count; i++) {
+    hits[i].reset();
+  }
+  TraversalStats stats;
+  for (int first = 0; first < count; first += kMaxPacketSize) {
+    int chunk = std::min(kMaxPacketSize, count - first);
+    if (single_precision_) {
+      IntersectPacketChunk<float>(*this, rays + first, chunk, hits + first,
+                                  &stats);
+    } else {
+      IntersectPacketChunk<double>(*this, rays + first, chunk, hits + first,
+                                   &stats);
+    }
+  }
+  RenderStats::CountTraversal(stats);
+}
+
+void LinearBvh::OccludedPacket(const Ray* rays, const double* t_max, int count,
+                               bool* occluded) const {
+  TraversalStats stats;
+  for (int first = 0; first < count; first += kMaxPacketSize) {
+    int chunk = std::min(kMaxPacketSize, count - first);
+    if (single_precision_) {
+      OccludedPacketChunk<float>(*this, rays + first, t_max + first, chunk,
+                                 occluded + first, &stats);
+    } else {
+      OccludedPacketChunk<double>(*this, rays + first, t_max + first, chunk,
+                                  occluded + first, &stats);
+    }
+  }
+  RenderStats::CountTraversal(stats);
+}
+
+void LinearBvh::UseSinglePrecision() {
+  if (single_precision_) {
+    return;
+  }
+  for (Shadeable* shape : triangle_shapes_) {
+    std::array<DVec3, 3> verts;
+    if (shape != nullptr && shape->GetTriangle(&verts)) {
+      float_triangles_.Add(verts);
+    } else {
+      float_triangles_.AddPadding();
+    }
+  }
+  triangles_ = TriangleSoa();
+  single_precision_ = true;
+}
+
+void LinearBvh::Flatten(BoundShape* shape, int depth) {
+  std::vector<BuildItem> items;
+  const std::vector<Intersectable*>& inters = shape->inter_children();
+  for (size_t i = 0; i < inters.size(); i += kMaxLeafPrims) {
+    BuildItem item;
+    for (size_t j = i; j < std::min(inters.size(), i + kMaxLeafPrims); j++) {
+      item.box.Update(inters[j]->GetAaBox());
+      item.leaf_prims.push_back(inters[j]);
+    }
+    items.push_back(std::move(item));
+  }
+  for (const BoundPtr& child : shape->bound_children()) {
+    if (!HasPrims(child.get())) {
+      continue;
+    }
+    BuildItem item;
+    item.box = child->GetAaBox();
+    item.bound = child.get();
+    items.push_back(std::move(item));
+  }
+  EmitItems(&items, 0, items.size(), depth);
+}
+
+void LinearBvh::EmitItems(std::vector<BuildItem>* items, size_t begin,
+                          size_t end, int depth) {
+  if (end - begin == 1) {
+    EmitItem(&(*items)[begin], depth);
+    return;
+  }
+  AaBox box;
+  for (size_t i = begin; i < end; i++) {
+    box.Update((*items)[i].box);
+  }
+  uint32_t index = AddNode(box, depth);
+  size_t mid = begin + (end - begin) / 2;
+  EmitItems(items, begin, mid, depth + 1);
+  nodes_[index].offset = nodes_.size();
+  EmitItems(items, mid, end, depth + 1);
+}
+
+void LinearBvh::EmitItem(BuildItem* item, int depth) {
+  if (item->bound != nullptr) {
+    Flatten(item->bound, depth);
+    return;
+  }
+  std::vector<Shadeable*> tris;
+  std::vector<Intersectable*> others;
+  AaBox tris_box;
+  AaBox others_box;
+  for (Intersectable* prim : item->leaf_prims) {
+    Shadeable* shape = dynamic_cast<Shadeable*>(prim);
+    std::array<DVec3, 3> verts;
+    if (shape != nullptr && shape->GetTriangle(&verts)) {
+      tris.push_back(shape);
+      tris_box.Update(prim->GetAaBox());
+    } else {
+      others.push_back(prim);
+      others_box.Update(prim->GetAaBox());
+    }
+  }
+  if (tris.empty()) {
+    EmitLeaf(item->box, others, depth);
+  } else if (others.empty()) {
+    EmitLeaf(item->box, tris, depth);
+  } else {
+    // Triangle and generic leaves are laid out differently, so mixed leaves
+    // become an interior node over one of each.
+    uint32_t index = AddNode(item->box, depth);
+    EmitLeaf(tris_box, tris, depth + 1);
+    nodes_[index].offset = nodes_.size();
+    EmitLeaf(others_box, others, depth + 1);
+  }
+}
+
+void LinearBvh::EmitLeaf(const AaBox& box, const std::vector<Shadeable*>& tris,
+                         int depth) {
+  uint32_t index = AddNode(box, depth);
+  nodes_[index].offset = triangles_.size();
+  nodes_[index].flags = LinearBvhNode::kTriangleLeaf;
+  for (Shadeable* tri : tris) {
+    std::array<DVec3, 3> verts;
+    tri->GetTriangle(&verts);
+    triangles_.Add(verts);
+    triangle_shapes_.push_back(tri);
+  }
+  triangles_.Pad();
+  triangle_shapes_.resize(triangles_.size(), nullptr);
+  nodes_[index].prim_count = triangles_.size() - nodes_[index].offset;
+}
+
+void LinearBvh::EmitLeaf(const AaBox& box,
+                         const std::vector<Intersectable*>& prims, int depth) {
+  uint32_t index = AddNode(box, depth);
+  nodes_[index].offset = prims_.size();
+  nodes_[index].prim_count = prims.size();
+  prims_.insert(prims_.end(), prims.begin(), prims.end());
+}
+
+uint32_t LinearBvh::AddNode(const AaBox& box, int depth) {
+  if (depth >= kStackSize) {
+    std::cerr << "LinearBvh: tree is deeper than the traversal stack ("
+              << kStackSize << ")" << std::endl;
+    exit(-1);
+  }
+  LinearBvhNode node;
+  DVec3 bot = box.bot();
+  DVec3 top = box.top();
+  for (int i = 0; i < 3; i++) {
+    node.bot[i] = RoundDown(bot[i]);
+    node.top[i] = RoundUp(top[i]);
+  }
+  node.offset = 0;
+  node.prim_count = 0;
+  node.flags = 0;
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
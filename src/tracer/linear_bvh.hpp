@@ -0,0 +1,124 @@
+#ifndef TRACER_LINEAR_BVH_HPP
+#define TRACER_LINEAR_BVH_HPP
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "tracer/bound.hpp"
+#include "tracer/float_triangle_soa.hpp"
+#include "tracer/intersectable.hpp"
+#include "tracer/triangle_soa.hpp"
+
+// A single node of a `LinearBvh`. Bounds are stored as floats, rounded
+// outwards so that they always contain the double precision bounds they were
+// built from.
+struct LinearBvhNode {
+  float bot[3];
+  float top[3];
+  static constexpr uint16_t kTriangleLeaf = 1;
+
+  // For leaves, the index of the first primitive in `LinearBvh::prims()`, or
+  // for triangle leaves the first slot in `LinearBvh::triangles()`.
+  // For interior nodes, the index of the second child; the first child is
+  // always stored immediately after its parent.
+  uint32_t offset;
+  // Zero for interior nodes. Triangle leaves count their padding slots.
+  uint16_t prim_count;
+  uint16_t flags;
+
+  bool is_leaf() const { return prim_count != 0; }
+  bool is_triangle_leaf() const { return flags & kTriangleLeaf; }
+};
+
+static_assert(sizeof(LinearBvhNode) == 32, "LinearBvhNode must be 32 bytes");
+
+// A compiled, read-only copy of a `BoundShape` tree. Nodes live in one
+// contiguous array in depth-first order and every leaf refers to a
+// contiguous range of a reordered primitive array, so traversal walks flat
+// memory. Triangles (see `Shadeable::GetTriangle`) are copied into a
+// `TriangleSoa` and tested a block at a time, with each triangle leaf padded
+// to whole blocks; other primitives are tested through virtual dispatch from
+// leaves of their own. Any `BoundShape` tree can be compiled, including ones
+// with mixed primitive and bound children; such nodes are binarized.
+class LinearBvh {
+ public:
+  explicit LinearBvh(BoundShape* root);
+  // A tree over the arrays of one built earlier, e.g. mapped from a
+  // `SceneCache` file. `nodes` and the data of `triangles` are used in place
+  // and must outlive this. The tree may not have generic leaves.
+  LinearBvh(const LinearBvhNode* nodes, size_t num_nodes,
+            TriangleSoa triangles, std::vector<Shadeable*> triangle_shapes);
+  LinearBvh(const LinearBvh&) = delete;
+  LinearBvh& operator=(const LinearBvh&) = delete;
+
+  std::optional<ShadeablePoint> Intersect(const Ray& ray) const;
+  // See `Intersectable::Occluded`.
+  bool Occluded(const Ray& ray, double t_max) const;
+
+  // Rays traced together by the packet functions below; larger batches are
+  // split.
+  static constexpr int kMaxPacketSize = 64;
+  // See `Intersectable::IntersectPacket` and `Intersectable::OccludedPacket`.
+  // The rays descend the tree together as long as enough of them hit each
+  // node, with the whole packet tested against a node's bounds at once when
+  // the directions agree in sign, and finish one at a time once they
+  // diverge. Hits are the same as those of `Intersect` and `Occluded`, up to
+  // ties between equally distant primitives.
+  void IntersectPacket(const Ray* rays, int count,
+                       std::optional<ShadeablePoint>* hits) const;
+  void OccludedPacket(const Ray* rays, const double* t_max, int count,
+                      bool* occluded) const;
+
+  // Switches traversal to single precision: node tests in float, and
+  // watertight tests against a `FloatTriangleSoa`, which replaces
+  // `triangles()`. Hits agree with double precision traversal up to the
+  // rounding of the vertices to float, and their distances are still
+  // computed in double. Call before tracing, after any `SceneCache::Write`.
+  void UseSinglePrecision();
+  bool single_precision() const { return single_precision_; }
+
+  const LinearBvhNode* nodes() const { return node_data_; }
+  size_t num_nodes() const { return num_nodes_; }
+  const std::vector<Intersectable*>& prims() const { return prims_; }
+  const TriangleSoa& triangles() const { return triangles_; }
+  // Only filled once `UseSinglePrecision` is called.
+  const FloatTriangleSoa& float_triangles() const { return float_triangles_; }
+  // The shape in each slot of `triangles()`, or null for padding.
+  const std::vector<Shadeable*>& triangle_shapes() const {
+    return triangle_shapes_;
+  }
+  // Bytes held by this object's buffers.
+  size_t MemoryUsage() const;
+
+ private:
+  struct BuildItem {
+    AaBox box;
+    // Exactly one of `bound` and `leaf_prims` is set.
+    BoundShape* bound = nullptr;
+    std::vector<Intersectable*> leaf_prims;
+  };
+
+  void Flatten(BoundShape* shape, int depth);
+  void EmitItems(std::vector<BuildItem>* items, size_t begin, size_t end,
+                 int depth);
+  void EmitItem(BuildItem* item, int depth);
+  void EmitLeaf(const AaBox& box, const std::vector<Shadeable*>& tris,
+                int depth);
+  void EmitLeaf(const AaBox& box, const std::vector<Intersectable*>& prims,
+                int depth);
+  uint32_t AddNode(const AaBox& box, int depth);
+
+  // Only filled while building; traversal reads `node_data_`, which points
+  // either into it or at the nodes given to the constructor.
+  std::vector<LinearBvhNode> nodes_;
+  const LinearBvhNode* node_data_ = nullptr;
+  size_t num_nodes_ = 0;
+  std::vector<Intersectable*> prims_;
+  TriangleSoa triangles_;
+  FloatTriangleSoa float_triangles_;
+  std::vector<Shadeable*> triangle_shapes_;
+  bool single_precision_ = false;
+};
+
+#endif
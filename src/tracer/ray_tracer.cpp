@@ -1,65 +1,884 @@
 #include "tracer/ray_tracer.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <unordered_map>
 
-#include "GLFW/glfw3.h"
+#include "profile/clock.hpp"
+#include "profile/trace.hpp"
 #include "texture/tex_canvas.hpp"
-#include "texture/texture_gen.hpp"
 #include "tracer/acceleration.hpp"
 
+namespace {
+
+// The ray from `point` towards `light`, past any self intersection. Sets
+// `light_dist` to the distance left along it to the light, since only objects
+// between the point and the light cast a shadow.
+Ray PointShadowRay(DVec3 point, const Light& light, double* light_dist) {
+  DVec3 light_position(light.Position);
+  Ray out_ray = {
+      .origin = point,
+      .dir = glm::normalize(light_position - point),
+  };
+  EpsilonAdvance(&out_ray);
+  *light_dist = glm::distance(point, light_position) -
+                glm::distance(point, out_ray.origin);
+  return out_ray;
+}
+
+SceneLights NormalizeLights(const SceneLights& scene_lights) {
+  SceneLights lights = scene_lights;
+  if (lights.directional_light_in_dir.has_value()) {
+    lights.directional_light_in_dir =
+        glm::normalize(*lights.directional_light_in_dir);
+  }
+  return lights;
+}
+
+// Stores `color` as the three floats of a pixel of an `HdrImage` or tile.
+void PutColor(DVec3 color, float* rgb) {
+  rgb[0] = color.x;
+  rgb[1] = color.y;
+  rgb[2] = color.z;
+}
+
+// Where in its pixel the `index`th progressive sample goes. The first is at
+// the center and the rest follow the R2 sequence, which covers the pixel
+// evenly however many samples there are.
+DVec2 SampleOffset(int index) {
+  constexpr double kR2X = 0.7548776662466927;
+  constexpr double kR2Y = 0.5698402909980532;
+  return DVec2(std::fmod(0.5 + index * kR2X, 1.0),
+               std::fmod(0.5 + index * kR2Y, 1.0));
+}
+
+// The number of lights `RecursiveContext::lights_occluded` covers.
+int NumLights(const SceneLights& lights) {
+  return lights.points.size() +
+         (lights.directional_light_in_dir.has_value() ? 1 : 0);
+}
+
+Ray DirectionalShadowRay(DVec3 point, DVec3 light_in_dir) {
+  Ray out_ray = {
+      .origin = point,
+      .dir = glm::normalize(-1.0 * light_in_dir),
+  };
+  EpsilonAdvance(&out_ray);
+  return out_ray;
+}
+
+BoundPtr BuildNoAcceleration(ThreadPool* /*thread_pool*/,
+                             const std::vector<Intersectable*>& inters) {
+  return ConstructBoundsNoAcceleration(inters);
+}
+
+BoundPtr BuildTopDownTriple(ThreadPool* thread_pool,
+                            const std::vector<Intersectable*>& inters) {
+  BoundTopDownTripleOptions bound_options;
+  bound_options.thread_pool = thread_pool;
+  return ConstructBoundsTopDownTriple(bound_options, inters);
+}
+
+BoundPtr BuildSah(const SahOptions& sah, ThreadPool* thread_pool,
+                  const std::vector<Intersectable*>& inters) {
+  SahOptions bound_options = sah;
+  bound_options.thread_pool = thread_pool;
+  return ConstructBoundsSah(bound_options, inters);
+}
+
+}  // namespace
+
 std::unique_ptr<RayTracer> RayTracer::CreateNoAcceleration(
     Options options, std::vector<InterPtr> inters) {
-  double start = glfwGetTime();
-  BoundPtr outer_bound = ConstructBoundsNoAcceleration(&inters);
-  double elapsed = glfwGetTime() - start;
-  std::cerr << "Acceleration time: " << elapsed << std::endl;
-  return std::unique_ptr<RayTracer>(
-      new RayTracer(options, std::move(inters), std::move(outer_bound)));
+  return CreateWithBounds(std::move(options), std::move(inters), nullptr,
+                          BuildNoAcceleration);
 }
 
 std::unique_ptr<RayTracer> RayTracer::CreateTopDownTriple(
     Options options, std::vector<InterPtr> inters) {
-  double start = glfwGetTime();
-  BoundPtr outer_bound =
-      ConstructBoundsTopDownTriple(BoundTopDownTripleOptions(), &inters);
-  double elapsed = glfwGetTime() - start;
+  return CreateWithBounds(std::move(options), std::move(inters), nullptr,
+                          BuildTopDownTriple);
+}
+
+std::unique_ptr<RayTracer> RayTracer::CreateSah(Options options,
+                                                std::vector<InterPtr> inters,
+                                                const SahOptions& sah) {
+  return CreateWithBounds(
+      std::move(options), std::move(inters), nullptr,
+      [&sah](ThreadPool* thread_pool,
+             const std::vector<Intersectable*>& prims) {
+        return BuildSah(sah, thread_pool, prims);
+      });
+}
+
+std::unique_ptr<RayTracer> RayTracer::CreateNoAcceleration(
+    Options options, std::unique_ptr<SceneGeometry> geometry) {
+  return CreateWithBounds(std::move(options), {}, std::move(geometry),
+                          BuildNoAcceleration);
+}
+
+std::unique_ptr<RayTracer> RayTracer::CreateTopDownTriple(
+    Options options, std::unique_ptr<SceneGeometry> geometry) {
+  return CreateWithBounds(std::move(options), {}, std::move(geometry),
+                          BuildTopDownTriple);
+}
+
+std::unique_ptr<RayTracer> RayTracer::CreateSah(
+    Options options, std::unique_ptr<SceneGeometry> geometry,
+    const SahOptions& sah) {
+  return CreateWithBounds(
+      std::move(options), {}, std::move(geometry),
+      [&sah](ThreadPool* thread_pool,
+             const std::vector<Intersectable*>& prims) {
+        return BuildSah(sah, thread_pool, prims);
+      });
+}
+
+std::unique_ptr<RayTracer> RayTracer::CreateWithBounds(
+    Options options, std::vector<InterPtr> inters,
+    std::unique_ptr<SceneGeometry> geometry,
+    const BoundsBuilder& build_bounds) {
+  std::unique_ptr<ThreadPool> thread_pool(new ThreadPool(options.num_threads));
+  std::vector<Intersectable*> pointers;
+  if (geometry) {
+    pointers = geometry->GetIntersectables();
+  } else {
+    pointers.reserve(inters.size());
+    for (const InterPtr& inter : inters) {
+      pointers.push_back(inter.get());
+    }
+  }
+  double start = Seconds();
+  BoundPtr outer_bound = build_bounds(thread_pool.get(), pointers);
+  double elapsed = Seconds() - start;
   std::cerr << "Acceleration time: " << elapsed << std::endl;
+  if (geometry) {
+    return std::unique_ptr<RayTracer>(
+        new RayTracer(options, std::move(geometry), std::move(outer_bound),
+                      std::move(thread_pool)));
+  }
   return std::unique_ptr<RayTracer>(
-      new RayTracer(options, std::move(inters), std::move(outer_bound)));
+      new RayTracer(options, std::move(inters), std::move(outer_bound),
+                    std::move(thread_pool)));
+}
+
+std::unique_ptr<RayTracer> RayTracer::CreateInstanced(
+    Options options, std::unique_ptr<SceneGeometry> geometry,
+    const SahOptions& sah) {
+  std::unique_ptr<ThreadPool> thread_pool(new ThreadPool(options.num_threads));
+  std::unique_ptr<RayTracer> tracer(
+      new RayTracer(options, std::move(geometry), BoundPtr(new BoundBox()),
+                    std::move(thread_pool)));
+  SahOptions bound_options = sah;
+  bound_options.thread_pool = tracer->thread_pool_.get();
+  double start = Seconds();
+  tracer->instanced_bvh_.reset(new InstancedBvh(
+      bound_options, tracer->geometry_.get(), tracer->thread_pool_.get(),
+      options.scene_cache_path, options.single_precision));
+  double elapsed = Seconds() - start;
+  std::cerr << "Acceleration time: " << elapsed
+            << (tracer->instanced_bvh_->loaded_from_cache()
+                    ? " (loaded from scene cache)"
+                    : "")
+            << std::endl;
+  std::cerr << "Acceleration memory: "
+            << tracer->instanced_bvh_->MemoryUsage() / (1024.0 * 1024.0)
+            << " MiB" << std::endl;
+  return tracer;
+}
+
+RayTracer::RayTracer(Options options, std::unique_ptr<SceneGeometry> geometry,
+                     BoundPtr outer_bound,
+                     std::unique_ptr<ThreadPool> thread_pool)
+    : RayTracer(std::move(options), std::vector<InterPtr>(),
+                std::move(outer_bound), std::move(thread_pool)) {
+  geometry_ = std::move(geometry);
 }
 
 RayTracer::RayTracer(Options options, std::vector<InterPtr> inters,
-                     BoundPtr outer_bound)
+                     BoundPtr outer_bound,
+                     std::unique_ptr<ThreadPool> thread_pool)
     : options_(std::move(options)),
       inters_(std::move(inters)),
-      outer_bound_(std::move(outer_bound)) {}
+      outer_bound_(std::move(outer_bound)),
+      thread_pool_(std::move(thread_pool)) {
+  if (options_.use_linear_bvh) {
+    linear_bvh_.reset(new LinearBvh(outer_bound_.get()));
+    if (options_.single_precision) {
+      linear_bvh_->UseSinglePrecision();
+    }
+  }
+}
+
+void RayTracer::SetDynamicGeometry(std::unique_ptr<SceneGeometry> geometry,
+                                   DynamicBvh::Options dynamic_options) {
+  double start = Seconds();
+  dynamic_bvh_.reset();
+  dynamic_geometry_ = std::move(geometry);
+  dynamic_bvh_.reset(new DynamicBvh(std::move(dynamic_options),
+                                    dynamic_geometry_.get(),
+                                    thread_pool_.get()));
+  bvh_report_.reset();
+  dynamic_bvh_report_.reset();
+  double elapsed = Seconds() - start;
+  std::cerr << "Dynamic acceleration time: " << elapsed << std::endl;
+}
+
+void RayTracer::UpdateDynamicGeometry() {
+  double start = Seconds();
+  int rebuilds = dynamic_bvh_->num_rebuilds();
+  dynamic_bvh_->Update();
+  bvh_report_.reset();
+  dynamic_bvh_report_.reset();
+  double elapsed = Seconds() - start;
+  std::cerr << "Dynamic refit time: " << elapsed << " ("
+            << dynamic_bvh_->num_rebuilds() - rebuilds << " rebuilt)"
+            << std::endl;
+}
 
 Texture RayTracer::Render(Camera camera, const SceneLights& scene_lights) {
-  SceneLights lights = scene_lights;
-  if (lights.directional_light_in_dir.has_value()) {
-    lights.directional_light_in_dir =
-        glm::normalize(*lights.directional_light_in_dir);
-  }
-  double start = glfwGetTime();
-  TexCanvas canvas = GetColorCanvas(options_.background_color,
-                                    camera.opts().w_px, camera.opts().h_px);
+  TexCanvas canvas(camera.opts().w_px, camera.opts().h_px);
+  CanvasSink sink(&canvas);
+  RenderToSink(camera, scene_lights, &sink);
+  return canvas.ToTexture();
+}
+
+void RayTracer::RenderToSink(Camera camera, const SceneLights& scene_lights,
+                             ImageSink* sink) {
+  sink->Begin(camera.opts().w_px, camera.opts().h_px);
+  RenderTiles(camera, scene_lights,
+              [&](int x_begin, int y_begin, int x_end, int y_end,
+                  const float* rgb) {
+                std::vector<RgbPix> pixels((x_end - x_begin) *
+                                           (y_end - y_begin));
+                ToneMap(rgb, pixels.size(), options_.tone_mapping,
+                        pixels.data());
+                sink->WriteTile(x_begin, y_begin, x_end, y_end,
+                                pixels.data());
+              });
+  sink->Finish();
+}
+
+HdrImage RayTracer::RenderHdr(Camera camera, const SceneLights& scene_lights) {
+  HdrImage image(camera.opts().w_px, camera.opts().h_px);
+  RenderTiles(camera, scene_lights,
+              [&](int x_begin, int y_begin, int x_end, int y_end,
+                  const float* rgb) {
+                image.WriteTile(x_begin, y_begin, x_end, y_end, rgb);
+              });
+  return image;
+}
+
+void RayTracer::RenderTiles(Camera camera, const SceneLights& scene_lights,
+                            const TileFn& on_tile) {
+  TRACE_ZONE("render");
+  SceneLights lights = NormalizeLights(scene_lights);
+  StartStats();
+  double start = Seconds();
   outer_bound_->RecursiveAssertSanity();
-  for (int y = 0; y < camera.opts().h_px; y++) {
-    for (int x = 0; x < camera.opts().w_px; x++) {
-      std::vector<Ray> pix_rays = camera.GetScreenRays(x, y);
-      for (Ray ray : pix_rays) {
-        std::optional<ShadeablePoint> point = IntersectScene(ray);
-        if (point.has_value()) {
-          RecursiveContext context;
-          RgbPix color = RgbPix::Convert(Shade(*point, lights, context));
-          canvas.SetPix(x, y, color);
+  CameraRayGenerator generator(camera, options_.subpixel_pattern);
+  if (options_.adaptive_sampling && camera.opts().subpix > 1) {
+    RenderAdaptive(generator, camera.opts(), lights, on_tile);
+  } else {
+    // Every pixel is traced independently and written exactly once, so tiles
+    // can run in any order and on any thread without changing the output.
+    ForEachTile(camera.opts().w_px, camera.opts().h_px,
+                [&](int x_begin, int y_begin, int x_end, int y_end) {
+                  std::vector<float> rgb(3 * (x_end - x_begin) *
+                                         (y_end - y_begin));
+                  RenderTile(generator, lights, x_begin, y_begin, x_end,
+                             y_end, rgb.data());
+                  on_tile(x_begin, y_begin, x_end, y_end, rgb.data());
+                });
+  }
+  double elapsed = Seconds() - start;
+  std::cerr << "Render time: " << elapsed << std::endl;
+  FinishStats(elapsed);
+}
+
+void RayTracer::CountStats(const std::function<void()>& fn) {
+  if (!collect_stats()) {
+    fn();
+    return;
+  }
+  // Each call counts on its own and merges once, so threads only contend at
+  // the end.
+  RenderStats stats;
+  {
+    RenderStats::Collect collect(&stats);
+    fn();
+  }
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.Merge(stats);
+}
+
+void RayTracer::StartStats() { stats_ = RenderStats(); }
+
+void RayTracer::FinishStats(double seconds) {
+  if (!collect_stats()) {
+    return;
+  }
+  stats_.seconds = seconds;
+  if (!bvh_report_.has_value()) {
+    if (instanced_bvh_) {
+      bvh_report_ = GetBvhReport(instanced_bvh_->tlas());
+    } else if (linear_bvh_) {
+      bvh_report_ = GetBvhReport(*linear_bvh_);
+    } else {
+      bvh_report_ = GetBvhReport(outer_bound_.get());
+    }
+    if (dynamic_bvh_ && dynamic_bvh_->top()) {
+      dynamic_bvh_report_ = GetBvhReport(dynamic_bvh_->top());
+    }
+  }
+  stats_.bvh = bvh_report_;
+  stats_.dynamic_bvh = dynamic_bvh_report_;
+  if (!options_.stats_path.empty()) {
+    stats_.WriteJson(options_.stats_path);
+  }
+}
+
+void RayTracer::ForEachTile(
+    int width, int height,
+    const std::function<void(int x_begin, int y_begin, int x_end, int y_end)>&
+        fn) {
+  int tile_size = std::max(1, options_.tile_size);
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+  thread_pool_->ParallelFor(tiles_x * tiles_y, [&](int tile) {
+    int x_begin = (tile % tiles_x) * tile_size;
+    int y_begin = (tile / tiles_x) * tile_size;
+    TRACE_ZONE("tile");
+    CountStats([&]() {
+      fn(x_begin, y_begin, std::min(width, x_begin + tile_size),
+         std::min(height, y_begin + tile_size));
+    });
+  });
+}
+
+void RayTracer::RenderTile(const CameraRayGenerator& generator,
+                           const SceneLights& lights, int x_begin, int y_begin,
+                           int x_end, int y_end, float* rgb) {
+  // Packets hold the same sub-ray of each pixel in a square bundle.
+  int bundle_size = std::clamp(options_.packet_size, 1, kMaxPacketSide);
+  int tile_width = x_end - x_begin;
+  int rays_per_pixel = generator.rays_per_pixel();
+  int tile_rays = tile_width * (y_end - y_begin) * rays_per_pixel;
+  std::vector<Ray> bundle_rays(bundle_size * bundle_size * rays_per_pixel);
+  std::vector<int> bundle_pix(bundle_size * bundle_size);
+  std::vector<Ray> rays(tile_rays);
+  std::vector<int> ray_pix(tile_rays);
+  int next_ray = 0;
+  for (int y0 = y_begin; y0 < y_end; y0 += bundle_size) {
+    for (int x0 = x_begin; x0 < x_end; x0 += bundle_size) {
+      int x1 = std::min(x_end, x0 + bundle_size);
+      int y1 = std::min(y_end, y0 + bundle_size);
+      int num_pix = 0;
+      for (int y = y0; y < y1; y++) {
+        generator.GetRowRays(y, x0, x1,
+                             &bundle_rays[num_pix * rays_per_pixel]);
+        for (int x = x0; x < x1; x++) {
+          bundle_pix[num_pix++] = (y - y_begin) * tile_width + (x - x_begin);
+        }
+      }
+      for (int k = 0; k < rays_per_pixel; k++) {
+        for (int i = 0; i < num_pix; i++) {
+          rays[next_ray] = bundle_rays[i * rays_per_pixel + k];
+          ray_pix[next_ray++] = bundle_pix[i];
         }
       }
     }
   }
-  double elapsed = glfwGetTime() - start;
-  std::cerr << "Render time: " << elapsed << std::endl;
-  return canvas.ToTexture();
+  std::vector<DVec3> colors(rays.size());
+  std::unique_ptr<bool[]> hit(new bool[rays.size()]);
+  TraceSamples(rays.data(), rays.size(), lights, colors.data(), hit.get());
+
+  // Each pixel averages its sub-rays, with misses seeing the background.
+  std::vector<DVec3> sums(tile_width * (y_end - y_begin), DVec3(0.0));
+  std::vector<bool> any_hit(sums.size(), false);
+  for (size_t i = 0; i < rays.size(); i++) {
+    sums[ray_pix[i]] +=
+        hit[i] ? colors[i] : options_.background_color.ToFloat();
+    any_hit[ray_pix[i]] = any_hit[ray_pix[i]] || hit[i];
+  }
+  // Pixels that no sub-ray hits get the background color as it is.
+  for (size_t pix = 0; pix < sums.size(); pix++) {
+    PutColor(any_hit[pix] ? sums[pix] / (double)rays_per_pixel
+                          : options_.background_color.ToFloat(),
+             &rgb[3 * pix]);
+  }
+}
+
+void RayTracer::RenderAdaptive(const CameraRayGenerator& generator,
+                               const CameraTracerOpts& camera_opts,
+                               const SceneLights& lights,
+                               const TileFn& on_tile) {
+  int width = camera_opts.w_px;
+  int height = camera_opts.h_px;
+  // First one ray through the center of every pixel.
+  std::vector<DVec3> centers(width * height);
+  std::vector<char> center_hits(width * height);
+  int bundle_size = std::clamp(options_.packet_size, 1, kMaxPacketSide);
+  ForEachTile(width, height, [&](int x_begin, int y_begin, int x_end,
+                                 int y_end) {
+    std::vector<Ray> rays;
+    std::vector<int> ray_pix;
+    for (int y0 = y_begin; y0 < y_end; y0 += bundle_size) {
+      for (int x0 = x_begin; x0 < x_end; x0 += bundle_size) {
+        for (int y = y0; y < std::min(y_end, y0 + bundle_size); y++) {
+          for (int x = x0; x < std::min(x_end, x0 + bundle_size); x++) {
+            rays.push_back(generator.GetRay(
+                DVec2((x + 0.5) / width, (y + 0.5) / height)));
+            ray_pix.push_back(y * width + x);
+          }
+        }
+      }
+    }
+    std::vector<DVec3> colors(rays.size());
+    std::unique_ptr<bool[]> hit(new bool[rays.size()]);
+    TraceSamples(rays.data(), rays.size(), lights, colors.data(), hit.get());
+    for (size_t i = 0; i < rays.size(); i++) {
+      centers[ray_pix[i]] =
+          hit[i] ? colors[i] : options_.background_color.ToFloat();
+      center_hits[ray_pix[i]] = hit[i];
+    }
+  });
+
+  // Then the camera's whole sub-pixel grid, only in pixels that differ from a
+  // neighbour: in whether the center ray hit anything, or by more than
+  // `adaptive_threshold` in a channel of the displayed color.
+  const ToneMapping& tone_mapping = options_.tone_mapping;
+  std::vector<DVec3> displayed(centers.size());
+  for (size_t pix = 0; pix < centers.size(); pix++) {
+    displayed[pix] = DVec3(tone_mapping.Map(centers[pix].x),
+                           tone_mapping.Map(centers[pix].y),
+                           tone_mapping.Map(centers[pix].z));
+  }
+  auto differs = [&](int a, int b) {
+    DVec3 diff = glm::abs(displayed[a] - displayed[b]);
+    return center_hits[a] != center_hits[b] ||
+           std::max({diff.x, diff.y, diff.z}) > options_.adaptive_threshold;
+  };
+  std::atomic<int> num_refined = 0;
+  ForEachTile(width, height, [&](int x_begin, int y_begin, int x_end,
+                                 int y_end) {
+    int tile_width = x_end - x_begin;
+    std::vector<float> rgb(3 * tile_width * (y_end - y_begin));
+    for (size_t pix = 0; pix < rgb.size() / 3; pix++) {
+      PutColor(options_.background_color.ToFloat(), &rgb[3 * pix]);
+    }
+    std::vector<Ray> rays;
+    std::vector<int> ray_pix;
+    for (int y = y_begin; y < y_end; y++) {
+      for (int x = x_begin; x < x_end; x++) {
+        int pix = y * width + x;
+        int tile_pix = (y - y_begin) * tile_width + (x - x_begin);
+        bool refine = false;
+        for (int ny = std::max(0, y - 1); ny <= std::min(height - 1, y + 1);
+             ny++) {
+          for (int nx = std::max(0, x - 1); nx <= std::min(width - 1, x + 1);
+               nx++) {
+            refine = refine || differs(pix, ny * width + nx);
+          }
+        }
+        if (!refine) {
+          if (center_hits[pix]) {
+            PutColor(centers[pix], &rgb[3 * tile_pix]);
+          }
+          continue;
+        }
+        rays.resize(rays.size() + generator.rays_per_pixel());
+        ray_pix.resize(rays.size(), tile_pix);
+        generator.GetRowRays(y, x, x + 1,
+                             &rays[rays.size() - generator.rays_per_pixel()]);
+      }
+    }
+    std::vector<DVec3> colors(rays.size());
+    std::unique_ptr<bool[]> hit(new bool[rays.size()]);
+    TraceSamples(rays.data(), rays.size(), lights, colors.data(), hit.get());
+    // As in `RenderTile`, but the rays of a pixel are consecutive.
+    for (size_t first = 0; first < rays.size();) {
+      int pix = ray_pix[first];
+      DVec3 sum(0.0);
+      bool any_hit = false;
+      size_t last = first;
+      for (; last < rays.size() && ray_pix[last] == pix; last++) {
+        sum += hit[last] ? colors[last] : options_.background_color.ToFloat();
+        any_hit = any_hit || hit[last];
+      }
+      if (any_hit) {
+        PutColor(sum / (double)(last - first), &rgb[3 * pix]);
+      }
+      first = last;
+      num_refined++;
+    }
+    on_tile(x_begin, y_begin, x_end, y_end, rgb.data());
+  });
+  std::cerr << "Adaptive sampling refined " << num_refined << " of "
+            << width * height << " pixels" << std::endl;
+}
+
+void RayTracer::TracePrimaryPacket(const Ray* rays, int count,
+                                   const SceneLights& lights, DVec3* colors,
+                                   bool* hit) {
+  std::optional<ShadeablePoint> points[kMaxPacketSide * kMaxPacketSide];
+  IntersectScenePacket(rays, count, points);
+
+  // Only hits that `Shade` lights need shadow rays.
+  int shaded[kMaxPacketSide * kMaxPacketSide];
+  int num_shaded = 0;
+  for (int i = 0; i < count; i++) {
+    hit[i] = points[i].has_value();
+    if (hit[i] && options_.max_depth > 0 &&
+        points[i]->shape->material()->apply_shading()) {
+      shaded[num_shaded++] = i;
+    }
+  }
+  DVec3 shaded_points[kMaxPacketSide * kMaxPacketSide];
+  for (int j = 0; j < num_shaded; j++) {
+    shaded_points[j] = points[shaded[j]]->point;
+  }
+  int num_lights = NumLights(lights);
+  std::unique_ptr<bool[]> lights_occluded(new bool[num_shaded * num_lights]);
+  TraceLightOcclusion(shaded_points, num_shaded, lights, lights_occluded.get());
+
+  for (int i = 0, j = 0; i < count; i++) {
+    if (!hit[i]) {
+      continue;
+    }
+    RecursiveContext context;
+    if (j < num_shaded && shaded[j] == i) {
+      context.lights_occluded = &lights_occluded[j * num_lights];
+      j++;
+    }
+    colors[i] = Shade(*points[i], lights, context);
+  }
+}
+
+void RayTracer::TraceLightOcclusion(const DVec3* points, int count,
+                                    const SceneLights& lights,
+                                    bool* lights_occluded) {
+  int num_lights = NumLights(lights);
+  bool directional = lights.directional_light_in_dir.has_value();
+  std::vector<Ray> shadow_rays(count);
+  std::vector<double> light_dists(count);
+  std::unique_ptr<bool[]> occluded(new bool[count]);
+  for (int light = 0; light < num_lights && count > 0; light++) {
+    for (int i = 0; i < count; i++) {
+      if (directional && light == 0) {
+        shadow_rays[i] =
+            DirectionalShadowRay(points[i], *lights.directional_light_in_dir);
+        light_dists[i] = std::numeric_limits<double>::infinity();
+      } else {
+        shadow_rays[i] = PointShadowRay(
+            points[i], lights.points[light - (directional ? 1 : 0)],
+            &light_dists[i]);
+      }
+    }
+    OccludedScenePacket(shadow_rays.data(), light_dists.data(), count,
+                        occluded.get());
+    for (int i = 0; i < count; i++) {
+      lights_occluded[i * num_lights + light] = occluded[i];
+    }
+  }
+}
+
+void RayTracer::PathQueue::Push(const Ray& ray, DVec3 throughput, int depth,
+                                uint32_t sample, uint32_t stack) {
+  rays.push_back(ray);
+  throughputs.push_back(throughput);
+  depths.push_back(depth);
+  samples.push_back(sample);
+  stacks.push_back(stack);
+}
+
+void RayTracer::PathQueue::Clear() {
+  rays.clear();
+  throughputs.clear();
+  depths.clear();
+  samples.clear();
+  stacks.clear();
+}
+
+void RayTracer::TraceWavefront(const Ray* rays, int count,
+                               const SceneLights& lights, DVec3* colors,
+                               bool* hit) {
+  // Every ray starts a sample, with the empty stack that primary rays start
+  // with.
+  PathQueue queue;
+  std::vector<InsideModelStack> stacks(1);
+  for (int i = 0; i < count; i++) {
+    queue.Push(rays[i], DVec3(1.0), 0, i, 0);
+    colors[i] = DVec3(0.0);
+    hit[i] = false;
+  }
+  PathQueue next;
+  std::vector<std::optional<ShadeablePoint>> hits;
+  while (queue.size() > 0) {
+    hits.resize(queue.size());
+    IntersectScenePacket(queue.rays.data(), queue.size(), hits.data());
+    for (size_t i = 0; i < queue.size(); i++) {
+      if (queue.depths[i] == 0) {
+        hit[queue.samples[i]] = hits[i].has_value();
+      }
+    }
+    ShadeWavefront(lights, queue, hits, &stacks, colors, &next);
+    std::swap(queue, next);
+    next.Clear();
+  }
+}
+
+void RayTracer::ShadeWavefront(
+    const SceneLights& lights, const PathQueue& queue,
+    const std::vector<std::optional<ShadeablePoint>>& hits,
+    std::vector<InsideModelStack>* stacks, DVec3* colors, PathQueue* next) {
+  // Misses see the background, except for primary rays, which leave their
+  // pixel alone. Hits deeper than `max_depth` are black.
+  std::vector<uint32_t> order;
+  for (uint32_t i = 0; i < queue.size(); i++) {
+    if (!hits[i].has_value()) {
+      if (queue.depths[i] > 0) {
+        colors[queue.samples[i]] +=
+            queue.throughputs[i] * options_.background_color.ToFloat();
+      }
+    } else if (queue.depths[i] < options_.max_depth) {
+      order.push_back(i);
+    }
+  }
+
+  // Shade hits on the same material together. Materials are numbered in
+  // order of appearance so that the order, and so the rounding of each
+  // sample's sum, does not depend on where they are in memory.
+  std::unordered_map<const Material*, int> material_ids;
+  std::vector<int> ids(queue.size());
+  for (uint32_t i : order) {
+    ids[i] = material_ids
+                 .emplace(hits[i]->shape->material(), material_ids.size())
+                 .first->second;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+
+  std::vector<DVec3> shaded_points;
+  for (uint32_t i : order) {
+    if (hits[i]->shape->material()->apply_shading()) {
+      shaded_points.push_back(hits[i]->point);
+    }
+  }
+  int num_lights = NumLights(lights);
+  std::unique_ptr<bool[]> lights_occluded(
+      new bool[shaded_points.size() * num_lights]);
+  TraceLightOcclusion(shaded_points.data(), shaded_points.size(), lights,
+                      lights_occluded.get());
+
+  // Follows `Shade`, with each recursive call replaced by queueing its ray
+  // with the weight that its color would have had.
+  int num_shaded = 0;
+  for (uint32_t i : order) {
+    const ShadeablePoint& point = *hits[i];
+    const Material* material = point.shape->material();
+    DVec3 throughput = queue.throughputs[i];
+    DVec3& color = colors[queue.samples[i]];
+    int depth = queue.depths[i] + 1;
+    DVec3 diffuse =
+        material->diff_texture().Sample(point.shape->GetUv(point)).ToFloat();
+    if (!material->apply_shading()) {
+      color += throughput * diffuse;
+      continue;
+    }
+    const bool* occluded = &lights_occluded[num_shaded++ * num_lights];
+    DVec3 normal = point.shape->GetNormal(point);
+    DVec3 direct_lighting = 0.1 * diffuse;
+    int light_index = 0;
+    if (lights.directional_light_in_dir.has_value()) {
+      direct_lighting += CalculateDirectionalLight(
+          point, *lights.directional_light_in_dir,
+          lights.directional_light_color, diffuse, diffuse, normal,
+          occluded[light_index++]);
+    }
+    for (const Light& light : lights.points) {
+      direct_lighting += CalculatePointLight(point, light, diffuse, diffuse,
+                                             normal, occluded[light_index++]);
+    }
+    double direct_lighting_component_strength =
+        std::max(0.0, 1.0 - (material->options().transparency +
+                             material->options().reflectivity));
+
+    // The weight of everything but the refracted light.
+    DVec3 surface_throughput = throughput;
+    if (material->is_transparent()) {
+      InsideModelStack inside_models = (*stacks)[queue.stacks[i]];
+      Refraction refraction = GetRefraction(point, &inside_models);
+      if (refraction.absorption_percent > 0) {
+        color += throughput * refraction.absorption_percent *
+                 refraction.absorption_color;
+        throughput *= 1 - refraction.absorption_percent;
+      }
+      DVec3 refracted = throughput * material->options().transparency;
+      if (refraction.ray.has_value() && refracted != DVec3(0.0)) {
+        stacks->push_back(std::move(inside_models));
+        RenderStats::CountRays(RenderStats::kRefraction, depth, 1);
+        next->Push(*refraction.ray, refracted, depth, queue.samples[i],
+                   stacks->size() - 1);
+      }
+      surface_throughput = throughput * (1 - material->options().transparency);
+    }
+    color += surface_throughput * direct_lighting_component_strength *
+             direct_lighting;
+    DVec3 reflected = surface_throughput * material->options().reflectivity;
+    if (material->is_reflective() && reflected != DVec3(0.0)) {
+      Ray ray = {
+          .origin = point.point,
+          .dir = glm::normalize(glm::reflect(point.ray.dir, normal)),
+      };
+      RenderStats::CountRays(RenderStats::kReflection, depth, 1);
+      next->Push(ray, reflected, depth, queue.samples[i], queue.stacks[i]);
+    }
+  }
+}
+
+Texture RayTracer::RenderProgressive(Camera camera,
+                                     const SceneLights& scene_lights,
+                                     const ProgressiveOptions& progressive) {
+  SceneLights lights = NormalizeLights(scene_lights);
+  StartStats();
+  double start = Seconds();
+  int width = camera.opts().w_px;
+  int height = camera.opts().h_px;
+  int tile_size = std::max(1, options_.tile_size);
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+  // Packets are square bundles of pixels within a tile.
+  int bundle_size = std::clamp(options_.packet_size, 1, kMaxPacketSide);
+  CameraRayGenerator generator(camera);
+
+  // A tile is only skipped whole, so every pixel in it has the same number
+  // of samples.
+  HdrImage sums(width, height);
+  std::vector<int> tile_samples(tiles_x * tiles_y, 0);
+  HdrImage average(width, height);
+  std::vector<RgbPix> pixels(width * height);
+  TexCanvas canvas(width, height);
+  auto resolve = [&]() {
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        int samples = tile_samples[y / tile_size * tiles_x + x / tile_size];
+        float* pixel = average.Pixel(x, y);
+        if (samples > 0) {
+          const float* sum = sums.Pixel(x, y);
+          for (int c = 0; c < 3; c++) {
+            pixel[c] = sum[c] / samples;
+          }
+        } else {
+          PutColor(options_.background_color.ToFloat(), pixel);
+        }
+      }
+    }
+    ToneMap(average.data(), pixels.size(), options_.tone_mapping,
+            pixels.data());
+    CanvasSink(&canvas).WriteTile(0, 0, width, height, pixels.data());
+    return canvas.ToTexture();
+  };
+
+  std::atomic<bool> stop = false;
+  auto out_of_time = [&]() {
+    return progressive.time_budget > 0 &&
+           Seconds() - start >= progressive.time_budget;
+  };
+  int passes = 0;
+  double last_preview = start;
+  while (!stop && (progressive.max_samples <= 0 ||
+                   passes < progressive.max_samples)) {
+    TRACE_ZONE("progressive pass");
+    DVec2 offset = SampleOffset(passes);
+    thread_pool_->ParallelFor(tiles_x * tiles_y, [&](int tile) {
+      if (stop || out_of_time()) {
+        stop = true;
+        return;
+      }
+      int x_begin = (tile % tiles_x) * tile_size;
+      int y_begin = (tile / tiles_x) * tile_size;
+      int x_end = std::min(width, x_begin + tile_size);
+      int y_end = std::min(height, y_begin + tile_size);
+      std::vector<Ray> rays;
+      std::vector<int> ray_pix;
+      for (int y0 = y_begin; y0 < y_end; y0 += bundle_size) {
+        for (int x0 = x_begin; x0 < x_end; x0 += bundle_size) {
+          for (int y = y0; y < std::min(y_end, y0 + bundle_size); y++) {
+            for (int x = x0; x < std::min(x_end, x0 + bundle_size); x++) {
+              rays.push_back(generator.GetRay(
+                  DVec2((x + offset.x) / width, (y + offset.y) / height)));
+              ray_pix.push_back(y * width + x);
+            }
+          }
+        }
+      }
+      TRACE_ZONE("tile");
+      std::vector<DVec3> colors(rays.size());
+      std::unique_ptr<bool[]> hit(new bool[rays.size()]);
+      CountStats([&]() {
+        TraceSamples(rays.data(), rays.size(), lights, colors.data(),
+                     hit.get());
+      });
+      for (size_t i = 0; i < rays.size(); i++) {
+        DVec3 color = hit[i] ? colors[i] : options_.background_color.ToFloat();
+        float* sum = sums.data() + 3 * ray_pix[i];
+        for (int c = 0; c < 3; c++) {
+          sum[c] += color[c];
+        }
+      }
+      tile_samples[tile]++;
+    });
+    passes++;
+    double now = Seconds();
+    bool done = stop || passes == progressive.max_samples || out_of_time();
+    if (!done && progressive.on_preview &&
+        now - last_preview >= progressive.preview_interval) {
+      last_preview = now;
+      if (!progressive.on_preview(resolve(), passes)) {
+        stop = true;
+      }
+    }
+    stop = stop || done;
+  }
+  double elapsed = Seconds() - start;
+  std::cerr << "Render time: " << elapsed << " (" << passes
+            << " progressive passes)" << std::endl;
+  FinishStats(elapsed);
+  Texture image = resolve();
+  if (progressive.hdr_image != nullptr) {
+    *progressive.hdr_image = std::move(average);
+  }
+  return image;
+}
+
+void RayTracer::TraceSamples(const Ray* rays, int count,
+                             const SceneLights& lights, DVec3* colors,
+                             bool* hit) {
+  RenderStats::CountRays(RenderStats::kPrimary, 0, count);
+  if (options_.wavefront) {
+    TraceWavefront(rays, count, lights, colors, hit);
+    return;
+  }
+  if (options_.packet_size > 1) {
+    int packet_size = std::min(options_.packet_size, kMaxPacketSide);
+    int max_count = packet_size * packet_size;
+    for (int first = 0; first < count; first += max_count) {
+      TracePrimaryPacket(rays + first, std::min(max_count, count - first),
+                         lights, colors + first, hit + first);
+    }
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    std::optional<ShadeablePoint> point = IntersectScene(rays[i]);
+    hit[i] = point.has_value();
+    if (hit[i]) {
+      colors[i] = Shade(*point, lights, RecursiveContext());
+    }
+  }
 }
 
 /*std::optional<ShadeablePoint> RayTracer::IntersectScene(Ray ray) {
@@ -83,35 +902,133 @@ Texture RayTracer::Render(Camera camera, const SceneLights& scene_lights) {
 
 std::optional<ShadeablePoint> RayTracer::IntersectScene(Ray ray) {
   ray.origin = ray.origin + ray.dir * epsilon(ray.origin);
-  return outer_bound_->Intersect(ray);
+  std::optional<ShadeablePoint> closest;
+  if (instanced_bvh_) {
+    closest = instanced_bvh_->Intersect(ray);
+  } else if (linear_bvh_) {
+    closest = linear_bvh_->Intersect(ray);
+  } else {
+    closest = outer_bound_->Intersect(ray);
+  }
+  if (dynamic_bvh_) {
+    std::optional<ShadeablePoint> dynamic = dynamic_bvh_->Intersect(ray);
+    if (dynamic.has_value() &&
+        (!closest.has_value() || dynamic->t < closest->t)) {
+      return dynamic;
+    }
+  }
+  return closest;
+}
+
+bool RayTracer::OccludedScene(Ray ray, double t_max) {
+  RenderStats::CountRays(RenderStats::kShadow, 0, 1);
+  DVec3 start = ray.origin;
+  ray.origin = ray.origin + ray.dir * epsilon(ray.origin);
+  t_max -= glm::distance(start, ray.origin);
+  if (dynamic_bvh_ && dynamic_bvh_->Occluded(ray, t_max)) {
+    return true;
+  }
+  if (instanced_bvh_) {
+    return instanced_bvh_->Occluded(ray, t_max);
+  }
+  if (linear_bvh_) {
+    return linear_bvh_->Occluded(ray, t_max);
+  }
+  return outer_bound_->Occluded(ray, t_max);
+}
+
+void RayTracer::IntersectScenePacket(const Ray* rays, int count,
+                                     std::optional<ShadeablePoint>* hits) {
+  if (!instanced_bvh_ && !linear_bvh_) {
+    for (int i = 0; i < count; i++) {
+      hits[i] = IntersectScene(rays[i]);
+    }
+    return;
+  }
+  std::vector<Ray> advanced(rays, rays + count);
+  for (Ray& ray : advanced) {
+    ray.origin = ray.origin + ray.dir * epsilon(ray.origin);
+  }
+  if (instanced_bvh_) {
+    instanced_bvh_->IntersectPacket(advanced.data(), count, hits);
+  } else {
+    linear_bvh_->IntersectPacket(advanced.data(), count, hits);
+  }
+  if (dynamic_bvh_) {
+    for (int i = 0; i < count; i++) {
+      std::optional<ShadeablePoint> dynamic =
+          dynamic_bvh_->Intersect(advanced[i]);
+      if (dynamic.has_value() &&
+          (!hits[i].has_value() || dynamic->t < hits[i]->t)) {
+        hits[i] = dynamic;
+      }
+    }
+  }
+}
+
+void RayTracer::OccludedScenePacket(const Ray* rays, const double* t_max,
+                                    int count, bool* occluded) {
+  RenderStats::CountRays(RenderStats::kShadow, 0, count);
+  std::vector<Ray> advanced(rays, rays + count);
+  std::vector<double> advanced_t_max(t_max, t_max + count);
+  for (int i = 0; i < count; i++) {
+    Ray& ray = advanced[i];
+    ray.origin = ray.origin + ray.dir * epsilon(ray.origin);
+    advanced_t_max[i] -= glm::distance(rays[i].origin, ray.origin);
+    occluded[i] =
+        dynamic_bvh_ && dynamic_bvh_->Occluded(ray, advanced_t_max[i]);
+  }
+  if (instanced_bvh_) {
+    instanced_bvh_->OccludedPacket(advanced.data(), advanced_t_max.data(),
+                                   count, occluded);
+  } else if (linear_bvh_) {
+    linear_bvh_->OccludedPacket(advanced.data(), advanced_t_max.data(), count,
+                                occluded);
+  } else {
+    for (int i = 0; i < count; i++) {
+      occluded[i] = occluded[i] ||
+                    outer_bound_->Occluded(advanced[i], advanced_t_max[i]);
+    }
+  }
 }
 
 DVec3 RayTracer::Shade(const ShadeablePoint& point, const SceneLights& lights,
                        RecursiveContext context) {
   context.depth += 1;
+  // Shadows traced ahead of time only hold for this point.
+  const bool* lights_occluded = context.lights_occluded;
+  context.lights_occluded = nullptr;
+  auto light_occluded = [&](int light) -> std::optional<bool> {
+    if (lights_occluded == nullptr) {
+      return std::nullopt;
+    }
+    return lights_occluded[light];
+  };
   if (context.depth > options_.max_depth) {
     return DVec3(0.0);
   }
   DVec3 diffuse = point.shape->material()
                       ->diff_texture()
-                      .Sample(point.shape->GetUv(point.point))
+                      .Sample(point.shape->GetUv(point))
                       .ToFloat();
   if (!point.shape->material()->apply_shading()) {
     return diffuse;
   }
   DVec3 specular = diffuse;
-  DVec3 normal = point.shape->GetNormal(point.point);
+  DVec3 normal = point.shape->GetNormal(point);
   DVec3 direct_lighting(0.0);
   // Hard-coded ambient light
   direct_lighting += 0.1 * diffuse;
+  int light_index = 0;
   if (lights.directional_light_in_dir.has_value()) {
     direct_lighting += CalculateDirectionalLight(
         point, *lights.directional_light_in_dir, lights.directional_light_color,
-        diffuse, specular, normal);
+        diffuse, specular, normal, light_occluded(light_index++));
   }
   for (const Light& light : lights.points) {
     direct_lighting +=
-        CalculatePointLight(point, light, diffuse, specular, normal);
+        CalculatePointLight(point, light, diffuse, specular, normal,
+                            light_occluded(light_index++));
   }
   double direct_lighting_component_strength =
       std::max(0.0, 1.0 - (point.shape->material()->options().transparency +
@@ -158,31 +1075,43 @@ DVec3 RayTracer::IntersectAndShade(Ray ray, const SceneLights& lights,
 DVec3 RayTracer::CalculateReflectionColor(const ShadeablePoint& start_point,
                                           const SceneLights& lights,
                                           RecursiveContext context) {
-  DVec3 normal = start_point.shape->GetNormal(start_point.point);
+  DVec3 normal = start_point.shape->GetNormal(start_point);
   Ray ray = {
       .origin = start_point.point,
       .dir = glm::normalize(glm::reflect(start_point.ray.dir, normal)),
   };
+  RenderStats::CountRays(RenderStats::kReflection, context.depth, 1);
   return IntersectAndShade(ray, lights, context);
 }
 
 RayTracer::TransparencyData RayTracer::CalculateRefractionColor(
     const ShadeablePoint& start_point, const SceneLights& lights,
     RecursiveContext context) {
-  DVec3 normal = start_point.shape->GetNormal(start_point.point);
+  Refraction refraction = GetRefraction(start_point, &context.inside_models);
+  DVec3 color(0.0);
+  if (refraction.ray.has_value()) {
+    RenderStats::CountRays(RenderStats::kRefraction, context.depth, 1);
+    color = IntersectAndShade(*refraction.ray, lights, context);
+  }
+  return {color, refraction.absorption_percent, refraction.absorption_color};
+}
+
+RayTracer::Refraction RayTracer::GetRefraction(
+    const ShadeablePoint& start_point, InsideModelStack* inside_models) {
+  DVec3 normal = start_point.shape->GetNormal(start_point);
   double normal_dot = glm::dot(start_point.ray.dir, normal);
 
   if (normal_dot > 0) {
     // We are coming out of the object.
-    if (context.inside_models.Contains(start_point.shape->GetParentModel())) {
+    if (inside_models->Contains(start_point.shape->GetParentModel())) {
       // We were already inside the object, as expected.
       // Calculate light absorption and refract.
-      Material* previous_material = context.inside_models.CurrentMaterial();
-      std::optional<ShadeablePoint> entry_point =
-          context.inside_models.Pop(start_point.shape->GetParentModel());
-      Material* next_material = context.inside_models.CurrentMaterial();
+      Material* previous_material = inside_models->CurrentMaterial();
+      std::optional<InsideModelStack::Entry> entry_point =
+          inside_models->Pop(start_point.shape->GetParentModel());
+      Material* next_material = inside_models->CurrentMaterial();
       if (!entry_point.has_value()) {
-        std::cerr << "Error in CalculateRefractionColor; Contains() and Pop() "
+        std::cerr << "Error in GetRefraction; Contains() and Pop() "
                      "are not in agreement"
                   << std::endl;
         exit(-1);
@@ -196,7 +1125,7 @@ RayTracer::TransparencyData RayTracer::CalculateRefractionColor(
         // No total internal refraction, proceed as planned.
       } else {
         // Total internal refraction occurred, push back onto the stack.
-        context.inside_models.Push(start_point);
+        inside_models->Push(start_point);
       }
 
       Ray ray = {
@@ -205,23 +1134,22 @@ RayTracer::TransparencyData RayTracer::CalculateRefractionColor(
       };
 
       // Calculate light absorption over the duration of the shape.
-      Material* absorbing_material = entry_point->shape->material();
+      Material* absorbing_material = entry_point->material;
       double absorption_percent =
           absorbing_material->options().absorption_per_unit *
           glm::distance(entry_point->point, start_point.point);
       if (absorption_percent >= 1.0) {
         // All light was absorbed
-        return {DVec3(0.0), 1.0,
+        return {std::nullopt, 1.0,
                 absorbing_material->options().absorption_color};
       } else {
-        DVec3 result_color = IntersectAndShade(ray, lights, context);
-        return {result_color, absorption_percent,
+        return {ray, absorption_percent,
                 absorbing_material->options().absorption_color};
       }
     } else {
       // We are coming out of an object that we never entered.
       // Refract light but do not calculate light impedence.
-      Material* previous_material = context.inside_models.CurrentMaterial();
+      Material* previous_material = inside_models->CurrentMaterial();
       Material* next_material = start_point.shape->material();
       DVec3 new_vector = glm::normalize(Refract(
           glm::normalize(start_point.ray.dir), normal,
@@ -232,18 +1160,18 @@ RayTracer::TransparencyData RayTracer::CalculateRefractionColor(
         // No total internal refraction, proceed as planned.
       } else {
         // Total internal refraction occurred, push onto the stack.
-        context.inside_models.Push(start_point);
+        inside_models->Push(start_point);
       }
 
       Ray ray = {
           .origin = start_point.point + new_vector * epsilon(start_point.point),
           .dir = new_vector,
       };
-      return {IntersectAndShade(ray, lights, context), 0.0, DVec3(0.0)};
+      return {ray, 0.0, DVec3(0.0)};
     }
   } else {
     // We are coming into the object.
-    if (context.inside_models.Contains(start_point.shape->GetParentModel())) {
+    if (inside_models->Contains(start_point.shape->GetParentModel())) {
       // We are "entering" a model we were already inside. Continue the original
       // ray unchanged.
       Ray ray = {
@@ -251,11 +1179,11 @@ RayTracer::TransparencyData RayTracer::CalculateRefractionColor(
                     epsilon(start_point.point) * start_point.ray.dir,
           .dir = start_point.ray.dir,
       };
-      return {IntersectAndShade(ray, lights, context), 0.0, DVec3(0.0)};
+      return {ray, 0.0, DVec3(0.0)};
     } else {
       // We are entering a new object.
       // Refract light and push to the context object.
-      Material* previous_material = context.inside_models.CurrentMaterial();
+      Material* previous_material = inside_models->CurrentMaterial();
       Material* next_material = start_point.shape->material();
       DVec3 new_vector = glm::normalize(Refract(
           glm::normalize(start_point.ray.dir), normal,
@@ -265,22 +1193,26 @@ RayTracer::TransparencyData RayTracer::CalculateRefractionColor(
         // A total external? refraction occurred. We do not push the object into
         // the stack.
       } else {
-        context.inside_models.Push(start_point);
+        inside_models->Push(start_point);
       }
       Ray ray = {
           .origin = start_point.point + new_vector * epsilon(start_point.point),
           .dir = new_vector,
       };
-      return {IntersectAndShade(ray, lights, context), 0.0, DVec3(0.0)};
+      return {ray, 0.0, DVec3(0.0)};
     }
   }
 }
 
 DVec3 RayTracer::CalculatePointLight(const ShadeablePoint& point,
                                      const Light& light, DVec3 diffuse_color,
-                                     DVec3 specular_color, DVec3 normal) {
+                                     DVec3 specular_color, DVec3 normal,
+                                     std::optional<bool> occluded) {
   DVec3 view_dir = glm::normalize(-1.0 * point.ray.dir);
-  DVec3 point_shadow = DVec3(1.0) - CalculatePointShadow(point.point, light);
+  DVec3 point_shadow =
+      DVec3(1.0) - (occluded.has_value() ? DVec3(*occluded ? 1.0 : 0.0)
+                                         : CalculatePointShadow(point.point,
+                                                                light));
   DVec3 light_color(light.Color);
   if (point_shadow == DVec3(0.0)) {
     return DVec3(0.0);
@@ -304,35 +1236,23 @@ DVec3 RayTracer::CalculatePointLight(const ShadeablePoint& point,
 }
 
 DVec3 RayTracer::CalculatePointShadow(DVec3 point, const Light& light) {
-  DVec3 light_position(light.Position);
-  Ray out_ray = {
-      .origin = point,
-      .dir = glm::normalize(light_position - point),
-  };
-  EpsilonAdvance(&out_ray);
-  std::optional<ShadeablePoint> intersection = IntersectScene(out_ray);
-  if (intersection.has_value()) {
-    double light_dist = glm::distance(point, light_position);
-    if (glm::distance(intersection->point, point) >= light_dist) {
-      // Intersected object is farther away than light.
-      return DVec3(0.0);
-    } else {
-      return DVec3(1.0);
-    }
-  } else {
-    // Hit nothing, no shadow
-    return DVec3(0.0);
-  }
+  double light_dist;
+  Ray out_ray = PointShadowRay(point, light, &light_dist);
+  return OccludedScene(out_ray, light_dist) ? DVec3(1.0) : DVec3(0.0);
 }
 
 DVec3 RayTracer::CalculateDirectionalLight(const ShadeablePoint& point,
                                            DVec3 light_in_dir,
                                            DVec3 light_color,
                                            DVec3 diffuse_color,
-                                           DVec3 specular_color, DVec3 normal) {
+                                           DVec3 specular_color, DVec3 normal,
+                                           std::optional<bool> occluded) {
   DVec3 view_dir = glm::normalize(-1.0 * point.ray.dir);
   DVec3 directional_shadow =
-      DVec3(1.0) - CalculateDirectionalShadow(point.point, light_in_dir);
+      DVec3(1.0) -
+      (occluded.has_value()
+           ? DVec3(*occluded ? 1.0 : 0.0)
+           : CalculateDirectionalShadow(point.point, light_in_dir));
   if (directional_shadow == DVec3(0.0)) {
     return DVec3(0.0);
   }
@@ -350,11 +1270,9 @@ DVec3 RayTracer::CalculateDirectionalLight(const ShadeablePoint& point,
 }
 
 DVec3 RayTracer::CalculateDirectionalShadow(DVec3 point, DVec3 light_in_dir) {
-  Ray out_ray = {
-      .origin = point,
-      .dir = glm::normalize(-1.0 * light_in_dir),
-  };
-  EpsilonAdvance(&out_ray);
+  Ray out_ray = DirectionalShadowRay(point, light_in_dir);
   // If it hit something, full shadow, otherwise none.
-  return IntersectScene(out_ray).has_value() ? DVec3(1.0) : DVec3(0.0);
+  return OccludedScene(out_ray, std::numeric_limits<double>::infinity())
+             ? DVec3(1.0)
+             : DVec3(0.0);
 }
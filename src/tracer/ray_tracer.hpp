@@ -1,27 +1,106 @@
 #ifndef TRACER_RAY_TRACER_HPP
 #define TRACER_RAY_TRACER_HPP
 
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
 #include <vector>
 
 #include "learnopengl/camera.h"
 #include "learnopengl/mesh.h"
 #include "scene/primitives.hpp"
+#include "texture/hdr_image.hpp"
+#include "texture/image_sink.hpp"
+#include "texture/tex_canvas.hpp"
+#include "tracer/acceleration.hpp"
 #include "tracer/bound.hpp"
+#include "tracer/dynamic_bvh.hpp"
+#include "tracer/instanced_bvh.hpp"
 #include "tracer/intersectable.hpp"
+#include "tracer/linear_bvh.hpp"
+#include "tracer/render_stats.hpp"
+#include "tracer/scene_geometry.hpp"
+#include "tracer/thread_pool.hpp"
 #include "tracer/transparency.hpp"
 
 class RayTracer {
  public:
   struct Options {
     RgbPix background_color = {0, 0, 0};
+    // How the linear colors of pixels are mapped to 8 bits. Adaptive
+    // sampling compares pixels after mapping.
+    ToneMapping tone_mapping = {};
     int max_depth = 8;
+    // Compile the bound tree into a `LinearBvh` and trace against that.
+    bool use_linear_bvh = true;
+    // Traverse the linear or instanced trees in single precision; see
+    // `LinearBvh::UseSinglePrecision`. Shading stays in double precision.
+    bool single_precision = false;
+    // Threads used to build the hierarchy and by `Render`, including the
+    // calling thread. Zero or less uses every hardware thread.
+    int num_threads = 0;
+    // Width and height in pixels of the tiles `Render` hands to threads.
+    int tile_size = 32;
+    // If above one, `Render` traces primary rays in square bundles of this
+    // many pixels a side, and the shadow rays from their hits, as packets
+    // through the linear or instanced trees. At most `kMaxPacketSide`.
+    // Otherwise every ray is traced on its own.
+    int packet_size = 0;
+    // Render with a wavefront integrator instead of recursing per pixel. All
+    // the paths of a tile advance one bounce at a time: each pass traces a
+    // batch of rays, sorts the hits by material, shades them and queues the
+    // reflected and refracted rays for the next pass. Colors match the
+    // recursive integrator up to rounding.
+    bool wavefront = false;
+    // Trace one ray through the center of each pixel first, and the camera's
+    // full `subpix` grid only in pixels whose color differs from one of their
+    // eight neighbours' by more than `adaptive_threshold`, on a scale of 0 to
+    // 1, in some channel, or that hit something where a neighbour did not.
+    bool adaptive_sampling = false;
+    double adaptive_threshold = 0.05;
+    // Where in each cell of the camera's `subpix` grid sub-rays go.
+    CameraRayGenerator::Pattern subpixel_pattern =
+        CameraRayGenerator::Pattern::kStratified;
+    // If set, `CreateInstanced` keeps its compiled per-mesh trees in the
+    // `SceneCache` file at this path, so later runs over the same meshes
+    // load them instead of building them.
+    std::string scene_cache_path = {};
+    // Count the rays each render traces and the work of traversing the
+    // linear or instanced trees, for `stats()`. Off by default, though it
+    // costs little.
+    bool collect_stats = false;
+    // If set, each render also writes `stats()` to this path as JSON. Implies
+    // `collect_stats`.
+    std::string stats_path = {};
+  };
+
+  static constexpr int kMaxPacketSide = 8;
+
+  struct ProgressiveOptions {
+    // Passes to render. Zero or less for no limit.
+    int max_samples = 64;
+    // Seconds after which to stop, once the tiles in flight finish. Zero or
+    // less for no limit.
+    double time_budget = 0.0;
+    // Called on the calling thread between passes, at most once per
+    // `preview_interval` seconds, with the image so far and the number of
+    // finished passes. The image's data is reused by later previews and the
+    // final image. Returning false stops rendering after that pass.
+    std::function<bool(const Texture& image, int samples)> on_preview;
+    double preview_interval = 1.0;
+    // If set, receives the final image before tone mapping.
+    HdrImage* hdr_image = nullptr;
   };
 
   struct RecursiveContext {
     int depth = 0;
     InsideModelStack inside_models;
+    // If set, whether each light is occluded from the point being shaded,
+    // already traced as part of a packet: the directional light first, if
+    // any, then the point lights in order. Only applies to the first `Shade`.
+    const bool* lights_occluded = nullptr;
   };
 
   struct TransparencyData {
@@ -30,17 +109,177 @@ class RayTracer {
     DVec3 absorption_color;
   };
 
+  // How light continues through a transparent surface. `ray` is empty if it
+  // is all absorbed.
+  struct Refraction {
+    std::optional<Ray> ray;
+    double absorption_percent;
+    DVec3 absorption_color;
+  };
+
   static std::unique_ptr<RayTracer> CreateNoAcceleration(
       Options options, std::vector<InterPtr> inters);
   static std::unique_ptr<RayTracer> CreateTopDownTriple(
       Options options, std::vector<InterPtr> inters);
+  // `sah` tunes the binned SAH build; its `thread_pool` is replaced by the
+  // tracer's.
+  static std::unique_ptr<RayTracer> CreateSah(Options options,
+                                              std::vector<InterPtr> inters,
+                                              const SahOptions& sah = {});
+  // Same as above, but tracing the triangles of a compact `SceneGeometry`.
+  static std::unique_ptr<RayTracer> CreateNoAcceleration(
+      Options options, std::unique_ptr<SceneGeometry> geometry);
+  static std::unique_ptr<RayTracer> CreateTopDownTriple(
+      Options options, std::unique_ptr<SceneGeometry> geometry);
+  static std::unique_ptr<RayTracer> CreateSah(
+      Options options, std::unique_ptr<SceneGeometry> geometry,
+      const SahOptions& sah = {});
+  // Traces `geometry` through an `InstancedBvh`, so each unique mesh is only
+  // built once, with `sah` as for `CreateSah`. The geometry does not need
+  // `per_instance_tris`.
+  static std::unique_ptr<RayTracer> CreateInstanced(
+      Options options, std::unique_ptr<SceneGeometry> geometry,
+      const SahOptions& sah = {});
   virtual Texture Render(Camera camera, const SceneLights& scene_lights);
+  // Same as `Render`, but hands each tile to `sink` as soon as it is done
+  // instead of keeping the image, so writing it out overlaps rendering.
+  // Tiles reach the sink from the pool's threads.
+  void RenderToSink(Camera camera, const SceneLights& scene_lights,
+                    ImageSink* sink);
+  // Same as `Render`, but keeps the average of each pixel's sub-rays as a
+  // float, with no tone mapping.
+  HdrImage RenderHdr(Camera camera, const SceneLights& scene_lights);
+  // Renders in passes that each add one sample to every pixel, at a new
+  // position within the pixel, and averages them in a float buffer. Stops at
+  // the first limit in `progressive` that is reached, and returns the image
+  // so far; tiles that the last pass did not reach keep fewer samples. The
+  // camera's `subpix` is not used.
+  Texture RenderProgressive(Camera camera, const SceneLights& scene_lights,
+                            const ProgressiveOptions& progressive);
+
+  // Adds geometry that moves between renders, such as the output of
+  // `RtRenderer::GetDynamicGeometry`. It is traced through a `DynamicBvh`
+  // alongside the static scene, so a frame only costs a refit.
+  void SetDynamicGeometry(
+      std::unique_ptr<SceneGeometry> geometry,
+      DynamicBvh::Options dynamic_options = DynamicBvh::Options());
+  SceneGeometry* dynamic_geometry() { return dynamic_geometry_.get(); }
+  // Call after moving the instances of `dynamic_geometry()`.
+  void UpdateDynamicGeometry();
+
+  // What the last `Render` or `RenderProgressive` did, if stats are
+  // collected; see `Options::collect_stats`. The report of the tree is of
+  // the one traced, or of the top level tree if instanced.
+  const RenderStats& stats() const { return stats_; }
 
  protected:
+  // `thread_pool` is the pool the bounds were built with, kept for `Render`.
   RayTracer(Options options, std::vector<InterPtr> inters,
-            BoundPtr outer_bounds);
+            BoundPtr outer_bounds, std::unique_ptr<ThreadPool> thread_pool);
+  RayTracer(Options options, std::unique_ptr<SceneGeometry> geometry,
+            BoundPtr outer_bounds, std::unique_ptr<ThreadPool> thread_pool);
+  // Builds the bounds over the primitives of `inters`, or of `geometry` if
+  // set, with `build_bounds`, timing it, and makes a tracer of them. The
+  // builder is given the new tracer's thread pool.
+  using BoundsBuilder = std::function<BoundPtr(
+      ThreadPool* thread_pool, const std::vector<Intersectable*>& inters)>;
+  static std::unique_ptr<RayTracer> CreateWithBounds(
+      Options options, std::vector<InterPtr> inters,
+      std::unique_ptr<SceneGeometry> geometry,
+      const BoundsBuilder& build_bounds);
 
   virtual std::optional<ShadeablePoint> IntersectScene(Ray ray);
+  // Whether anything lies less than `t_max` from the ray's origin.
+  virtual bool OccludedScene(Ray ray, double t_max);
+  // Packet versions of the above. Unlike `OccludedScene`, every entry of
+  // `occluded` is set.
+  void IntersectScenePacket(const Ray* rays, int count,
+                            std::optional<ShadeablePoint>* hits);
+  void OccludedScenePacket(const Ray* rays, const double* t_max, int count,
+                           bool* occluded);
+  bool collect_stats() const {
+    return options_.collect_stats || !options_.stats_path.empty();
+  }
+  // Runs `fn`, counting its work into `stats_` if stats are collected. May be
+  // called from several threads at once.
+  void CountStats(const std::function<void()>& fn);
+  // Clears `stats_` before a render.
+  void StartStats();
+  // Fills in the rest of `stats_` after a render of `seconds` and writes it
+  // out if asked to.
+  void FinishStats(double seconds);
+  // Takes the linear colors of the pixels in [x_begin, x_end) x
+  // [y_begin, y_end), row by row, three floats each.
+  using TileFn = std::function<void(int x_begin, int y_begin, int x_end,
+                                    int y_end, const float* rgb)>;
+  // Renders every tile of the camera's image, passing each to `on_tile`
+  // from the pool's threads as it is done. Shared by the `Render` variants.
+  void RenderTiles(Camera camera, const SceneLights& scene_lights,
+                   const TileFn& on_tile);
+  // Calls `fn` on each tile of a `width` by `height` image, spread over the
+  // thread pool, counting stats.
+  void ForEachTile(
+      int width, int height,
+      const std::function<void(int x_begin, int y_begin, int x_end,
+                               int y_end)>& fn);
+  // Renders the pixels in [x_begin, x_end) x [y_begin, y_end) into `rgb`,
+  // as `TileFn` takes them, each the average of the camera's sub-rays for
+  // it.
+  void RenderTile(const CameraRayGenerator& generator,
+                  const SceneLights& lights, int x_begin, int y_begin,
+                  int x_end, int y_end, float* rgb);
+  // Renders with `Options::adaptive_sampling`. The center of every pixel is
+  // traced before any tile reaches `on_tile`.
+  void RenderAdaptive(const CameraRayGenerator& generator,
+                      const CameraTracerOpts& camera_opts,
+                      const SceneLights& lights, const TileFn& on_tile);
+  // Shades the `count` primary `rays`, tracing the shadow rays of their hits
+  // as packets too. `hit[i]` is set to whether `rays[i]` hit anything, and if
+  // so `colors[i]` to its color.
+  void TracePrimaryPacket(const Ray* rays, int count,
+                          const SceneLights& lights, DVec3* colors,
+                          bool* hit);
+  // Traces and shades the `count` primary `rays` as `TracePrimaryPacket`
+  // does, in packets of `options_.packet_size` squared rays or through the
+  // wavefront integrator if either is enabled.
+  void TraceSamples(const Ray* rays, int count, const SceneLights& lights,
+                    DVec3* colors, bool* hit);
+  // Traces the shadow rays from each of the `count` `points` to every light
+  // as packets. Sets `lights_occluded` to the
+  // `RecursiveContext::lights_occluded` of each point in turn.
+  void TraceLightOcclusion(const DVec3* points, int count,
+                           const SceneLights& lights, bool* lights_occluded);
+
+  // The paths in flight in `TraceWavefront`, one entry per path in each
+  // array.
+  struct PathQueue {
+    std::vector<Ray> rays;
+    // The weight of the path's color in its sample.
+    std::vector<DVec3> throughputs;
+    // The `RecursiveContext::depth` that shades the ray's hit.
+    std::vector<int> depths;
+    // Indices of the sample the path adds to, and of the models it is inside
+    // in the tile's list of `InsideModelStack`s, which paths share until one
+    // of them refracts.
+    std::vector<uint32_t> samples;
+    std::vector<uint32_t> stacks;
+
+    size_t size() const { return rays.size(); }
+    void Push(const Ray& ray, DVec3 throughput, int depth, uint32_t sample,
+              uint32_t stack);
+    void Clear();
+  };
+
+  // Traces and shades the `count` primary `rays` with the wavefront
+  // integrator. Sets `hit` and `colors` as `TracePrimaryPacket` does.
+  void TraceWavefront(const Ray* rays, int count, const SceneLights& lights,
+                      DVec3* colors, bool* hit);
+  // Shades the `hits` of the paths in `queue`, adding to the `colors` of
+  // their samples, and queues the rays they spawn in `next`.
+  void ShadeWavefront(const SceneLights& lights, const PathQueue& queue,
+                      const std::vector<std::optional<ShadeablePoint>>& hits,
+                      std::vector<InsideModelStack>* stacks, DVec3* colors,
+                      PathQueue* next);
 
   virtual DVec3 Shade(const ShadeablePoint& point, const SceneLights& lights,
                       RecursiveContext context);
@@ -54,22 +293,42 @@ class RayTracer {
   virtual TransparencyData CalculateRefractionColor(
       const ShadeablePoint& start_point, const SceneLights& lights,
       RecursiveContext context);
+  // Refracts the ray of `start_point`, which must be on a transparent shape,
+  // and updates `inside_models` for the refracted ray.
+  Refraction GetRefraction(const ShadeablePoint& start_point,
+                           InsideModelStack* inside_models);
 
-  // `view_dir` is the vector from the point to the camera
+  // `view_dir` is the vector from the point to the camera. If `occluded` is
+  // empty, the shadow ray is traced here.
   virtual DVec3 CalculatePointLight(const ShadeablePoint& point,
                                     const Light& light, DVec3 diffuse_color,
-                                    DVec3 specular_color, DVec3 normal);
+                                    DVec3 specular_color, DVec3 normal,
+                                    std::optional<bool> occluded);
   virtual DVec3 CalculatePointShadow(DVec3 point, const Light& light);
 
   virtual DVec3 CalculateDirectionalLight(const ShadeablePoint& point,
                                           DVec3 light_in_dir, DVec3 light_color,
                                           DVec3 diffuse_color,
-                                          DVec3 specular_color, DVec3 normal);
+                                          DVec3 specular_color, DVec3 normal,
+                                          std::optional<bool> occluded);
   virtual DVec3 CalculateDirectionalShadow(DVec3 point, DVec3 light_in_dir);
 
   std::vector<InterPtr> inters_;
+  std::unique_ptr<SceneGeometry> geometry_;
   BoundPtr outer_bound_;
+  std::unique_ptr<LinearBvh> linear_bvh_;
+  // Replaces `outer_bound_` and `linear_bvh_` when set.
+  std::unique_ptr<InstancedBvh> instanced_bvh_;
+  std::unique_ptr<SceneGeometry> dynamic_geometry_;
+  std::unique_ptr<DynamicBvh> dynamic_bvh_;
+  std::unique_ptr<ThreadPool> thread_pool_;
   Options options_;
+  RenderStats stats_;
+  std::mutex stats_mutex_;
+  // Only computed once stats are first collected, and again after the
+  // dynamic tree changes.
+  std::optional<BvhReport> bvh_report_;
+  std::optional<BvhReport> dynamic_bvh_report_;
 };
 
 #endif
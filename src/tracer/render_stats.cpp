@@ -0,0 +1,189 @@
+#include "tracer/render_stats.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "tracer/bound.hpp"
+#include "tracer/linear_bvh.hpp"
+
+constinit thread_local RenderStats* RenderStats::thread_stats_ = nullptr;
+
+namespace {
+
+constexpr const char* kRayTypeNames[RenderStats::kNumRayTypes] = {
+    "primary", "shadow", "reflection", "refraction"};
+
+void AddLeaf(uint64_t size, BvhReport* report) {
+  report->leaves++;
+  if (report->leaf_sizes.size() <= size) {
+    report->leaf_sizes.resize(size + 1, 0);
+  }
+  report->leaf_sizes[size]++;
+}
+
+// Adds the nodes of the subtree at `shape` to `report`, with its `sah_cost`
+// in surface area rather than relative to the root. Children that are trees
+// of their own, as the object subtrees under a `DynamicBvh`'s top tree are,
+// count as subtrees rather than primitives.
+void AddBoundShape(BoundShape* shape, int depth, BvhReport* report) {
+  report->nodes++;
+  report->max_depth = std::max(report->max_depth, depth);
+  std::vector<BoundShape*> subtrees;
+  uint64_t prims = 0;
+  for (Intersectable* child : shape->inter_children()) {
+    if (BoundShape* subtree = dynamic_cast<BoundShape*>(child)) {
+      subtrees.push_back(subtree);
+    } else {
+      prims++;
+    }
+  }
+  double area = shape->SurfaceArea();
+  report->sah_cost += area * (1 + prims);
+  if (shape->bound_children().empty() && subtrees.empty()) {
+    AddLeaf(prims, report);
+  }
+  for (const BoundPtr& child : shape->bound_children()) {
+    AddBoundShape(child.get(), depth + 1, report);
+  }
+  for (BoundShape* subtree : subtrees) {
+    AddBoundShape(subtree, depth + 1, report);
+  }
+}
+
+double NodeArea(const LinearBvhNode& node) {
+  double x = node.top[0] - node.bot[0];
+  double y = node.top[1] - node.bot[1];
+  double z = node.top[2] - node.bot[2];
+  return 2 * (x * y + y * z + x * z);
+}
+
+// As `AddBoundShape`.
+void AddLinearNode(const LinearBvh& bvh, uint32_t index, int depth,
+                   BvhReport* report) {
+  const LinearBvhNode& node = bvh.nodes()[index];
+  report->nodes++;
+  report->max_depth = std::max(report->max_depth, depth);
+  double area = NodeArea(node);
+  if (!node.is_leaf()) {
+    report->sah_cost += area;
+    AddLinearNode(bvh, index + 1, depth + 1, report);
+    AddLinearNode(bvh, node.offset, depth + 1, report);
+    return;
+  }
+  uint64_t size = node.prim_count;
+  if (node.is_triangle_leaf()) {
+    size = std::count_if(
+        bvh.triangle_shapes().begin() + node.offset,
+        bvh.triangle_shapes().begin() + node.offset + node.prim_count,
+        [](const Shadeable* shape) { return shape != nullptr; });
+  }
+  report->sah_cost += area * (1 + size);
+  AddLeaf(size, report);
+}
+
+void WriteCounts(std::ostream& out, const uint64_t* counts) {
+  out << "{";
+  for (int type = 0; type < RenderStats::kNumRayTypes; type++) {
+    out << (type > 0 ? ", " : "") << "\"" << kRayTypeNames[type]
+        << "\": " << counts[type];
+  }
+  out << "}";
+}
+
+void WriteArray(std::ostream& out, const uint64_t* values, size_t size) {
+  out << "[";
+  for (size_t i = 0; i < size; i++) {
+    out << (i > 0 ? ", " : "") << values[i];
+  }
+  out << "]";
+}
+
+void WriteBvh(std::ostream& out, const BvhReport& bvh) {
+  out << "{\"nodes\": " << bvh.nodes << ", \"leaves\": " << bvh.leaves
+      << ", \"max_depth\": " << bvh.max_depth
+      << ", \"sah_cost\": " << bvh.sah_cost << ", \"leaf_sizes\": ";
+  WriteArray(out, bvh.leaf_sizes.data(), bvh.leaf_sizes.size());
+  out << "}";
+}
+
+}  // namespace
+
+void TraversalStats::Merge(const TraversalStats& other) {
+  node_visits += other.node_visits;
+  box_tests += other.box_tests;
+  triangle_tests += other.triangle_tests;
+  triangle_hits += other.triangle_hits;
+}
+
+BvhReport GetBvhReport(BoundShape* root) {
+  BvhReport report;
+  AddBoundShape(root, 0, &report);
+  double root_area = root->SurfaceArea();
+  report.sah_cost = root_area > 0 ? report.sah_cost / root_area : 0.0;
+  return report;
+}
+
+BvhReport GetBvhReport(const LinearBvh& bvh) {
+  BvhReport report;
+  if (bvh.num_nodes() == 0) {
+    return report;
+  }
+  AddLinearNode(bvh, 0, 0, &report);
+  double root_area = NodeArea(bvh.nodes()[0]);
+  report.sah_cost = root_area > 0 ? report.sah_cost / root_area : 0.0;
+  return report;
+}
+
+uint64_t RenderStats::total_rays() const {
+  uint64_t total = 0;
+  for (uint64_t count : rays) {
+    total += count;
+  }
+  return total;
+}
+
+void RenderStats::Merge(const RenderStats& other) {
+  for (int type = 0; type < kNumRayTypes; type++) {
+    rays[type] += other.rays[type];
+  }
+  for (int depth = 0; depth < kDepthBins; depth++) {
+    depth_rays[depth] += other.depth_rays[depth];
+  }
+  traversal.Merge(other.traversal);
+}
+
+void RenderStats::WriteJson(std::ostream& out) const {
+  out << "{\n";
+  out << "  \"seconds\": " << seconds << ",\n";
+  out << "  \"total_rays\": " << total_rays() << ",\n";
+  out << "  \"rays_per_second\": "
+      << (seconds > 0 ? total_rays() / seconds : 0.0) << ",\n";
+  out << "  \"rays\": ";
+  WriteCounts(out, rays);
+  out << ",\n  \"depth_rays\": ";
+  WriteArray(out, depth_rays, kDepthBins);
+  out << ",\n  \"traversal\": {\"node_visits\": " << traversal.node_visits
+      << ", \"box_tests\": " << traversal.box_tests
+      << ", \"triangle_tests\": " << traversal.triangle_tests
+      << ", \"triangle_hits\": " << traversal.triangle_hits << "}";
+  if (bvh.has_value()) {
+    out << ",\n  \"bvh\": ";
+    WriteBvh(out, *bvh);
+  }
+  if (dynamic_bvh.has_value()) {
+    out << ",\n  \"dynamic_bvh\": ";
+    WriteBvh(out, *dynamic_bvh);
+  }
+  out << "\n}\n";
+}
+
+void RenderStats::WriteJson(const std::string& path) const {
+  std::ofstream out(path, std::ios::trunc);
+  WriteJson(out);
+  if (!out) {
+    std::cerr << "Failed to write render stats to " << path << std::endl;
+    exit(-1);
+  }
+}
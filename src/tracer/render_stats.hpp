@@ -0,0 +1,108 @@
+#ifndef TRACER_RENDER_STATS_HPP
+#define TRACER_RENDER_STATS_HPP
+
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class BoundShape;
+class LinearBvh;
+
+// Work done by one traversal of a `LinearBvh`. Traversals count into one of
+// these on the stack and add it to the thread's `RenderStats` once at the
+// end, so the loops never touch thread-local storage.
+struct TraversalStats {
+  uint64_t node_visits = 0;
+  // Ray and node box tests, including tests of a whole packet at once.
+  uint64_t box_tests = 0;
+  // Triangle slots tested, counting the padding at the end of leaves.
+  uint64_t triangle_tests = 0;
+  // Triangles hit closer than the closest hit so far, or the occlusion
+  // distance.
+  uint64_t triangle_hits = 0;
+
+  void Merge(const TraversalStats& other);
+};
+
+// The shape of a tree, as built.
+struct BvhReport {
+  uint64_t nodes = 0;
+  uint64_t leaves = 0;
+  // The root is at depth 0.
+  int max_depth = 0;
+  // The surface area heuristic estimate of the cost of a ray, relative to
+  // one box test, with a triangle test costing the same as a box test.
+  double sah_cost = 0.0;
+  // The number of leaves with each number of primitives.
+  std::vector<uint64_t> leaf_sizes;
+};
+
+// Any tree can be reported as a `BoundShape` tree, or as the `LinearBvh`
+// compiled from it, which is what is traced. Leaves of the latter do not count
+// their padding.
+BvhReport GetBvhReport(BoundShape* root);
+BvhReport GetBvhReport(const LinearBvh& bvh);
+
+// Counters of the work done by a render. Counting is opt-in: threads only
+// count while a `Collect` for them is alive, and otherwise each counting
+// point costs one thread-local load and branch.
+class RenderStats {
+ public:
+  enum RayType { kPrimary, kShadow, kReflection, kRefraction, kNumRayTypes };
+  static constexpr int kDepthBins = 16;
+
+  uint64_t rays[kNumRayTypes] = {};
+  // Rays other than shadow rays by the number of bounces before them, with
+  // the last bin holding the rest.
+  uint64_t depth_rays[kDepthBins] = {};
+  TraversalStats traversal;
+  double seconds = 0.0;
+  std::optional<BvhReport> bvh;
+  // The tree of moving geometry, if any, traced alongside `bvh`.
+  std::optional<BvhReport> dynamic_bvh;
+
+  // Counts the calling thread's work into `stats` while alive.
+  class Collect {
+   public:
+    explicit Collect(RenderStats* stats) : previous_(thread_stats_) {
+      thread_stats_ = stats;
+    }
+    ~Collect() { thread_stats_ = previous_; }
+    Collect(const Collect&) = delete;
+    Collect& operator=(const Collect&) = delete;
+
+   private:
+    RenderStats* previous_;
+  };
+
+  // Each of these does nothing unless the calling thread is collecting.
+  // `depth` is the number of bounces before the rays.
+  static void CountRays(RayType type, int depth, uint64_t count) {
+    if (RenderStats* stats = thread_stats_) {
+      stats->rays[type] += count;
+      if (type != kShadow) {
+        stats->depth_rays[depth < kDepthBins ? depth : kDepthBins - 1] +=
+            count;
+      }
+    }
+  }
+  static void CountTraversal(const TraversalStats& traversal) {
+    if (RenderStats* stats = thread_stats_) {
+      stats->traversal.Merge(traversal);
+    }
+  }
+
+  uint64_t total_rays() const;
+  // Adds the counters of `other`. Leaves `seconds` and the reports alone.
+  void Merge(const RenderStats& other);
+  void WriteJson(std::ostream& out) const;
+  // Exits on failure.
+  void WriteJson(const std::string& path) const;
+
+ private:
+  static constinit thread_local RenderStats* thread_stats_;
+};
+
+#endif
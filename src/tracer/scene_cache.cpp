@@ -0,0 +1,276 @@
+#include "tracer/scene_cache.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "tracer/fnv_hash.hpp"
+
+namespace {
+
+// Bumped whenever the layout below or anything it stores changes.
+constexpr uint32_t kVersion = 1;
+// Also catches files written with the other byte order.
+constexpr uint32_t kMagic = 0x43534c47;  // "GLSC"
+// Sections start at multiples of this, which covers every stored type.
+constexpr uint64_t kSectionAlignment = 64;
+// Triangle slots that only pad a block.
+constexpr uint32_t kPaddingSlot = 0xffffffff;
+
+struct FileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uint64_t num_meshes;
+  uint64_t file_size;
+};
+
+// Offsets are from the start of the file. Empty meshes have no nodes.
+struct MeshEntry {
+  uint64_t nodes_offset;
+  uint64_t num_nodes;
+  uint64_t blocks_offset;
+  uint64_t num_slots;
+  // One `uint32_t` per slot: the triangle's index within its mesh, or
+  // `kPaddingSlot`.
+  uint64_t slots_offset;
+};
+
+static_assert(TriangleSoa::kDataAlignment <= kSectionAlignment,
+              "Sections must be aligned for triangle blocks");
+
+template <typename T>
+void HashValue(const T& value, uint64_t* hash) {
+  HashBytes(&value, sizeof(value), hash);
+}
+
+uint64_t AlignSection(uint64_t offset) {
+  return (offset + kSectionAlignment - 1) / kSectionAlignment *
+         kSectionAlignment;
+}
+
+}  // namespace
+
+SceneCache::~SceneCache() {
+#ifndef _WIN32
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+#endif
+}
+
+uint64_t SceneCache::GetKey(const SahOptions& opts,
+                            const SceneGeometry& geometry) {
+  uint64_t hash = kHashOffset;
+  HashValue(kVersion, &hash);
+  HashValue(sizeof(LinearBvhNode), &hash);
+  HashValue(TriangleSoa::kWidth, &hash);
+  HashValue(opts.num_bins, &hash);
+  HashValue(opts.min_leaf_size, &hash);
+  HashValue(opts.max_leaf_size, &hash);
+  HashValue(opts.max_depth, &hash);
+  HashValue(opts.traversal_cost, &hash);
+  HashValue(opts.intersection_cost, &hash);
+  HashValue((uint64_t)geometry.num_meshes(), &hash);
+  for (uint32_t mesh = 0; mesh < geometry.num_meshes(); mesh++) {
+    HashValue(geometry.GetMeshHash(mesh), &hash);
+    HashValue(geometry.GetMeshNumTris(mesh), &hash);
+  }
+  return hash;
+}
+
+std::unique_ptr<SceneCache> SceneCache::Open(const std::string& path,
+                                             uint64_t key,
+                                             size_t num_meshes) {
+  std::unique_ptr<SceneCache> cache(new SceneCache());
+#ifdef _WIN32
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in) {
+    return nullptr;
+  }
+  cache->size_ = in.tellg();
+  if (cache->size_ < sizeof(FileHeader)) {
+    return nullptr;
+  }
+  cache->buffer_.resize((cache->size_ + sizeof(Chunk) - 1) / sizeof(Chunk));
+  in.seekg(0);
+  if (!in.read(cache->buffer_.front().bytes, cache->size_)) {
+    return nullptr;
+  }
+  cache->data_ = cache->buffer_.front().bytes;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(FileHeader)) {
+    close(fd);
+    return nullptr;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file alive on its own.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  cache->data_ = static_cast<const char*>(data);
+  cache->size_ = st.st_size;
+#endif
+
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(
+      cache->GetSection(0, sizeof(FileHeader)));
+  if (header == nullptr || header->magic != kMagic ||
+      header->version != kVersion || header->key != key ||
+      header->num_meshes != num_meshes || header->file_size != cache->size_ ||
+      cache->GetSection(sizeof(FileHeader), num_meshes * sizeof(MeshEntry)) ==
+          nullptr) {
+    std::cerr << "Ignoring stale scene cache " << path << std::endl;
+    return nullptr;
+  }
+  return cache;
+}
+
+bool SceneCache::Write(const std::string& path, uint64_t key,
+                       const SceneGeometry& geometry,
+                       const std::vector<std::unique_ptr<LinearBvh>>& trees) {
+  // Lay the sections out first, so the header and table can be written
+  // before the data.
+  std::vector<MeshEntry> entries(trees.size());
+  uint64_t offset = sizeof(FileHeader) + trees.size() * sizeof(MeshEntry);
+  for (size_t mesh = 0; mesh < trees.size(); mesh++) {
+    MeshEntry& entry = entries[mesh];
+    std::memset(&entry, 0, sizeof(entry));
+    const LinearBvh* tree = trees[mesh].get();
+    if (tree == nullptr) {
+      continue;
+    }
+    if (!tree->prims().empty()) {
+      std::cerr << "Scene cache only holds triangle trees" << std::endl;
+      return false;
+    }
+    entry.num_nodes = tree->num_nodes();
+    entry.num_slots = tree->triangles().size();
+    entry.nodes_offset = AlignSection(offset);
+    offset = entry.nodes_offset + entry.num_nodes * sizeof(LinearBvhNode);
+    entry.blocks_offset = AlignSection(offset);
+    offset = entry.blocks_offset + tree->triangles().data_size();
+    entry.slots_offset = AlignSection(offset);
+    offset = entry.slots_offset + entry.num_slots * sizeof(uint32_t);
+  }
+  FileHeader header = {kMagic, kVersion, key, trees.size(), offset};
+
+  // Written next to the final path and moved over it once complete, so a
+  // failed write never leaves a truncated cache behind. The process id keeps
+  // runs that share the path from writing the same file.
+#ifdef _WIN32
+  int pid = _getpid();
+#else
+  int pid = getpid();
+#endif
+  std::string temp_path = path + "." + std::to_string(pid) + ".tmp";
+  std::error_code error;
+  {
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    uint64_t written = 0;
+    auto write = [&](const void* data, uint64_t size) {
+      out.write(static_cast<const char*>(data), size);
+      written += size;
+    };
+    auto pad_to = [&](uint64_t section) {
+      static const char kZeros[kSectionAlignment] = {};
+      write(kZeros, section - written);
+    };
+    write(&header, sizeof(header));
+    write(entries.data(), entries.size() * sizeof(MeshEntry));
+    std::vector<uint32_t> slots;
+    for (size_t mesh = 0; mesh < trees.size(); mesh++) {
+      const LinearBvh* tree = trees[mesh].get();
+      if (tree == nullptr) {
+        continue;
+      }
+      const MeshEntry& entry = entries[mesh];
+      pad_to(entry.nodes_offset);
+      write(tree->nodes(), entry.num_nodes * sizeof(LinearBvhNode));
+      pad_to(entry.blocks_offset);
+      write(tree->triangles().data(), tree->triangles().data_size());
+      pad_to(entry.slots_offset);
+      uint32_t first_tri = geometry.GetMeshFirstTri(mesh);
+      slots.clear();
+      for (const Shadeable* shape : tree->triangle_shapes()) {
+        slots.push_back(shape ? shape->GetPrimIndex() - first_tri
+                              : kPaddingSlot);
+      }
+      write(slots.data(), slots.size() * sizeof(uint32_t));
+    }
+    if (!out) {
+      std::cerr << "Failed to write scene cache " << temp_path << std::endl;
+      out.close();
+      std::filesystem::remove(temp_path, error);
+      return false;
+    }
+  }
+  std::filesystem::rename(temp_path, path, error);
+  if (error) {
+    std::cerr << "Failed to move scene cache to " << path << ": "
+              << error.message() << std::endl;
+    std::filesystem::remove(temp_path, error);
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<LinearBvh> SceneCache::LoadTree(
+    uint32_t mesh, SceneGeometry* geometry) const {
+  const MeshEntry& entry = reinterpret_cast<const MeshEntry*>(
+      data_ + sizeof(FileHeader))[mesh];
+  if (entry.num_nodes == 0) {
+    return nullptr;
+  }
+  const char* nodes =
+      GetSection(entry.nodes_offset, entry.num_nodes * sizeof(LinearBvhNode));
+  const char* blocks =
+      GetSection(entry.blocks_offset, TriangleSoa::DataSize(entry.num_slots));
+  const char* slots =
+      GetSection(entry.slots_offset, entry.num_slots * sizeof(uint32_t));
+  if (nodes == nullptr || blocks == nullptr || slots == nullptr) {
+    std::cerr << "ERROR: scene cache is truncated." << std::endl;
+    exit(-1);
+  }
+
+  uint32_t first_tri = geometry->GetMeshFirstTri(mesh);
+  uint32_t num_tris = geometry->GetMeshNumTris(mesh);
+  std::vector<Shadeable*> shapes(entry.num_slots, nullptr);
+  const uint32_t* tris = reinterpret_cast<const uint32_t*>(slots);
+  for (size_t i = 0; i < entry.num_slots; i++) {
+    if (tris[i] == kPaddingSlot) {
+      continue;
+    }
+    if (tris[i] >= num_tris) {
+      std::cerr << "ERROR: scene cache refers to a missing triangle."
+                << std::endl;
+      exit(-1);
+    }
+    shapes[i] = &geometry->mesh_tris()[first_tri + tris[i]];
+  }
+  return std::unique_ptr<LinearBvh>(new LinearBvh(
+      reinterpret_cast<const LinearBvhNode*>(nodes), entry.num_nodes,
+      TriangleSoa::View(blocks, entry.num_slots), std::move(shapes)));
+}
+
+const char* SceneCache::GetSection(uint64_t offset, uint64_t size) const {
+  if (offset > size_ || size > size_ - offset) {
+    return nullptr;
+  }
+  return data_ + offset;
+}
@@ -0,0 +1,65 @@
+#ifndef TRACER_SCENE_CACHE_HPP
+#define TRACER_SCENE_CACHE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tracer/acceleration.hpp"
+#include "tracer/linear_bvh.hpp"
+#include "tracer/scene_geometry.hpp"
+
+// A binary file holding the compiled bottom level trees of an `InstancedBvh`,
+// one `LinearBvh` per unique mesh of a `SceneGeometry`, so that later runs
+// over the same meshes skip building them. The file is mapped into memory
+// and its nodes and triangle blocks are traced in place; loading a tree only
+// points each triangle slot back at its `MeshTri`.
+//
+// Files are keyed by a hash of the meshes' content and the build options, and
+// are only valid on the kind of machine that wrote them.
+class SceneCache {
+ public:
+  ~SceneCache();
+  SceneCache(const SceneCache&) = delete;
+  SceneCache& operator=(const SceneCache&) = delete;
+
+  // Hash of everything that the trees of `geometry`'s meshes depend on.
+  static uint64_t GetKey(const SahOptions& opts,
+                         const SceneGeometry& geometry);
+
+  // Maps the file at `path`. Returns null if there is none, or if it was
+  // written for another key or number of meshes.
+  static std::unique_ptr<SceneCache> Open(const std::string& path,
+                                          uint64_t key, size_t num_meshes);
+  // Writes `trees`, indexed by mesh and null for empty meshes, to `path`,
+  // replacing any file there. Returns false on failure.
+  static bool Write(const std::string& path, uint64_t key,
+                    const SceneGeometry& geometry,
+                    const std::vector<std::unique_ptr<LinearBvh>>& trees);
+
+  // The tree of mesh `mesh`, over the triangles of `geometry`, or null if
+  // the mesh is empty. It points into the mapped file, so this must outlive
+  // it.
+  std::unique_ptr<LinearBvh> LoadTree(uint32_t mesh,
+                                      SceneGeometry* geometry) const;
+
+ private:
+  SceneCache() = default;
+
+  // Returns `size` bytes at `offset` into the file, or null if they do not
+  // fit.
+  const char* GetSection(uint64_t offset, uint64_t size) const;
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  // Without `mmap` the file is read into memory instead.
+  struct alignas(64) Chunk {
+    char bytes[64];
+  };
+  std::vector<Chunk> buffer_;
+#endif
+};
+
+#endif
@@ -0,0 +1,352 @@
+#include "tracer/scene_geometry.hpp"
+
+#include <cstring>
+#include <iostream>
+
+#include "tracer/fnv_hash.hpp"
+
+namespace {
+
+// Only the attributes a `SceneGeometry` keeps are compared.
+bool SameVertex(const Vertex& vertex, const glm::vec3& position,
+                const glm::vec3& normal, const glm::vec2& tex_coords) {
+  return std::memcmp(&vertex.Position, &position, sizeof(position)) == 0 &&
+         std::memcmp(&vertex.Normal, &normal, sizeof(normal)) == 0 &&
+         std::memcmp(&vertex.TexCoords, &tex_coords, sizeof(tex_coords)) == 0;
+}
+
+}  // namespace
+
+std::optional<ShadeablePoint> GeometryTri::Intersect(const Ray& ray) {
+  std::optional<TriHit> hit =
+      IntersectTriHit(ray, geometry_->GetPositions(index_));
+  if (!hit.has_value()) {
+    return std::nullopt;
+  }
+  return ShadeablePoint(
+      {hit->point, this, ray, hit->t, hit->u, hit->v, index_});
+}
+
+std::optional<DVec3> GeometryTri::EarliestIntersect(const Ray& ray) {
+  return IntersectTri(ray, geometry_->GetPositions(index_));
+}
+
+bool GeometryTri::Occluded(const Ray& ray, double t_max) {
+  std::optional<TriHit> hit =
+      IntersectTriHit(ray, geometry_->GetPositions(index_));
+  return hit.has_value() && hit->t < t_max;
+}
+
+AaBox GeometryTri::GetAaBox() const {
+  AaBox box;
+  for (const DVec3& vert : geometry_->GetPositions(index_)) {
+    box.Update(vert);
+  }
+  return box;
+}
+
+DVec3 GeometryTri::EstimateCenter() const {
+  std::array<DVec3, 3> verts = geometry_->GetPositions(index_);
+  return (verts[0] + verts[1] + verts[2]) / 3.0;
+}
+
+bool GeometryTri::GetTriangle(std::array<DVec3, 3>* verts) const {
+  *verts = geometry_->GetPositions(index_);
+  return true;
+}
+
+Material* GeometryTri::material() const {
+  return geometry_->GetMaterial(index_);
+}
+
+DVec2 GeometryTri::GetUv(const ShadeablePoint& point) {
+  return geometry_->GetUv(index_, point.u, point.v);
+}
+
+DVec3 GeometryTri::GetNormal(const ShadeablePoint& point) {
+  return geometry_->GetNormal(index_, point.u, point.v);
+}
+
+Model* GeometryTri::GetParentModel() { return geometry_->GetModel(index_); }
+
+std::optional<ShadeablePoint> MeshTri::Intersect(const Ray& ray) {
+  std::optional<TriHit> hit =
+      IntersectTriHit(ray, geometry_->GetMeshPositions(index_));
+  if (!hit.has_value()) {
+    return std::nullopt;
+  }
+  return ShadeablePoint(
+      {hit->point, this, ray, hit->t, hit->u, hit->v, index_});
+}
+
+std::optional<DVec3> MeshTri::EarliestIntersect(const Ray& ray) {
+  return IntersectTri(ray, geometry_->GetMeshPositions(index_));
+}
+
+bool MeshTri::Occluded(const Ray& ray, double t_max) {
+  std::optional<TriHit> hit =
+      IntersectTriHit(ray, geometry_->GetMeshPositions(index_));
+  return hit.has_value() && hit->t < t_max;
+}
+
+AaBox MeshTri::GetAaBox() const {
+  AaBox box;
+  for (const DVec3& vert : geometry_->GetMeshPositions(index_)) {
+    box.Update(vert);
+  }
+  return box;
+}
+
+DVec3 MeshTri::EstimateCenter() const {
+  std::array<DVec3, 3> verts = geometry_->GetMeshPositions(index_);
+  return (verts[0] + verts[1] + verts[2]) / 3.0;
+}
+
+bool MeshTri::GetTriangle(std::array<DVec3, 3>* verts) const {
+  *verts = geometry_->GetMeshPositions(index_);
+  return true;
+}
+
+Material* MeshTri::material() const {
+  return geometry_->GetInstanceMaterial(geometry_->GetFirstInstance(mesh_));
+}
+
+DVec2 MeshTri::GetUv(const ShadeablePoint& point) {
+  return geometry_->GetMeshUv(index_, point.u, point.v);
+}
+
+DVec3 MeshTri::GetNormal(const ShadeablePoint& point) {
+  return geometry_->GetInstanceNormal(geometry_->GetFirstInstance(mesh_),
+                                      index_, point.u, point.v);
+}
+
+Model* MeshTri::GetParentModel() {
+  return geometry_->GetInstanceModel(geometry_->GetFirstInstance(mesh_));
+}
+
+void SceneGeometry::AddMesh(const std::vector<Vertex>& vertices,
+                            const std::vector<unsigned int>& indices,
+                            DMat4 mat, Material* material, Model* model) {
+  uint32_t instance = instances_.size();
+  instances_.emplace_back();
+  SetTransform(instance, mat);
+  instances_[instance].material = material;
+  instances_[instance].model = model;
+  uint32_t mesh = FindOrAddMesh(vertices, indices, instance);
+  instances_[instance].mesh = mesh;
+
+  if (!options_.per_instance_tris) {
+    return;
+  }
+  const MeshRecord& record = meshes_[mesh];
+  for (uint32_t i = 0; i < record.num_tris; i++) {
+    tris_.emplace_back(this, records_.size());
+    records_.push_back({record.first_tri + i, instance});
+  }
+}
+
+void SceneGeometry::SetTransform(uint32_t instance, DMat4 mat) {
+  instances_[instance].transform = mat;
+  instances_[instance].normal_transform =
+      glm::transpose(glm::inverse(DMat3(mat)));
+}
+
+uint32_t SceneGeometry::FindOrAddMesh(const std::vector<Vertex>& vertices,
+                                      const std::vector<unsigned int>& indices,
+                                      uint32_t instance) {
+  // Without a whole triangle the vertices do not matter.
+  static const std::vector<Vertex> kNoVertices;
+  static const std::vector<unsigned int> kNoIndices;
+  bool empty = vertices.empty() || indices.size() < 3;
+  const std::vector<Vertex>& used_vertices = empty ? kNoVertices : vertices;
+  const std::vector<unsigned int>& used_indices = empty ? kNoIndices : indices;
+  size_t num_tris = used_indices.size() / 3;
+
+  uint64_t hash = kHashOffset;
+  for (const Vertex& vertex : used_vertices) {
+    HashBytes(&vertex.Position, sizeof(vertex.Position), &hash);
+    HashBytes(&vertex.Normal, sizeof(vertex.Normal), &hash);
+    HashBytes(&vertex.TexCoords, sizeof(vertex.TexCoords), &hash);
+  }
+  HashBytes(used_indices.data(), num_tris * 3 * sizeof(unsigned int), &hash);
+  auto range = mesh_ids_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (MeshEquals(it->second, used_vertices, used_indices)) {
+      return it->second;
+    }
+  }
+
+  uint32_t mesh = meshes_.size();
+  MeshRecord record;
+  record.hash = hash;
+  record.first_vertex = positions_.size();
+  record.num_vertices = used_vertices.size();
+  record.first_tri = mesh_tri_records_.size();
+  record.num_tris = num_tris;
+  record.first_instance = instance;
+  meshes_.push_back(record);
+  mesh_ids_.insert({hash, mesh});
+  for (const Vertex& vertex : used_vertices) {
+    positions_.push_back(vertex.Position);
+    normals_.push_back(vertex.Normal);
+    tex_coords_.push_back(vertex.TexCoords);
+  }
+  for (size_t i = 0; i < num_tris; i++) {
+    MeshTriRecord tri;
+    for (int j = 0; j < 3; j++) {
+      tri.verts[j] = record.first_vertex + used_indices[3 * i + j];
+    }
+    if (!options_.per_instance_tris) {
+      mesh_tris_.emplace_back(this, mesh_tri_records_.size(), mesh);
+    }
+    mesh_tri_records_.push_back(tri);
+  }
+  return mesh;
+}
+
+bool SceneGeometry::MeshEquals(uint32_t mesh,
+                               const std::vector<Vertex>& vertices,
+                               const std::vector<unsigned int>& indices) const {
+  const MeshRecord& record = meshes_[mesh];
+  if (record.num_vertices != vertices.size() ||
+      record.num_tris != indices.size() / 3) {
+    return false;
+  }
+  for (size_t i = 0; i < vertices.size(); i++) {
+    size_t vert = record.first_vertex + i;
+    if (!SameVertex(vertices[i], positions_[vert], normals_[vert],
+                    tex_coords_[vert])) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < record.num_tris; i++) {
+    const MeshTriRecord& tri = mesh_tri_records_[record.first_tri + i];
+    for (int j = 0; j < 3; j++) {
+      if (tri.verts[j] != record.first_vertex + indices[3 * i + j]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void SceneGeometry::BeginObject() {
+  if (object_first_tris_.back() != tris_.size()) {
+    object_first_tris_.push_back(tris_.size());
+  }
+}
+
+std::vector<Intersectable*> SceneGeometry::GetIntersectables() {
+  if (!options_.per_instance_tris) {
+    std::cerr << "ERROR: SceneGeometry has no per instance triangles."
+              << std::endl;
+    exit(-1);
+  }
+  std::vector<Intersectable*> inters;
+  inters.reserve(tris_.size());
+  for (GeometryTri& tri : tris_) {
+    inters.push_back(&tri);
+  }
+  return inters;
+}
+
+std::vector<Intersectable*> SceneGeometry::GetObjectIntersectables(
+    size_t object) {
+  if (!options_.per_instance_tris) {
+    std::cerr << "ERROR: SceneGeometry has no per instance triangles."
+              << std::endl;
+    exit(-1);
+  }
+  size_t begin = object_first_tris_[object];
+  size_t end = object + 1 < object_first_tris_.size()
+                   ? object_first_tris_[object + 1]
+                   : tris_.size();
+  std::vector<Intersectable*> inters;
+  inters.reserve(end - begin);
+  for (size_t i = begin; i < end; i++) {
+    inters.push_back(&tris_[i]);
+  }
+  return inters;
+}
+
+std::array<DVec3, 3> SceneGeometry::GetPositions(uint32_t index) const {
+  const TriRecord& record = records_[index];
+  const MeshTriRecord& tri = mesh_tri_records_[record.mesh_tri];
+  const DMat4& transform = instances_[record.instance].transform;
+  std::array<DVec3, 3> verts;
+  for (int i = 0; i < 3; i++) {
+    DVec3 position(positions_[tri.verts[i]]);
+    verts[i] = DVec3(transform * DVec4(position, 1.0));
+  }
+  return verts;
+}
+
+DVec2 SceneGeometry::GetUv(uint32_t index, double u, double v) const {
+  const TriRecord& record = records_[index];
+  return GetMeshUv(record.mesh_tri, u, v);
+}
+
+DVec3 SceneGeometry::GetNormal(uint32_t index, double u, double v) const {
+  const TriRecord& record = records_[index];
+  return GetInstanceNormal(record.instance, record.mesh_tri, u, v);
+}
+
+Material* SceneGeometry::GetMaterial(uint32_t index) const {
+  return instances_[records_[index].instance].material;
+}
+
+Model* SceneGeometry::GetModel(uint32_t index) const {
+  return instances_[records_[index].instance].model;
+}
+
+std::vector<Intersectable*> SceneGeometry::GetMeshIntersectables(
+    uint32_t mesh) {
+  if (options_.per_instance_tris) {
+    std::cerr << "ERROR: SceneGeometry only has per instance triangles."
+              << std::endl;
+    exit(-1);
+  }
+  const MeshRecord& record = meshes_[mesh];
+  std::vector<Intersectable*> inters;
+  inters.reserve(record.num_tris);
+  for (uint32_t i = 0; i < record.num_tris; i++) {
+    inters.push_back(&mesh_tris_[record.first_tri + i]);
+  }
+  return inters;
+}
+
+std::array<DVec3, 3> SceneGeometry::GetMeshPositions(uint32_t mesh_tri) const {
+  const MeshTriRecord& tri = mesh_tri_records_[mesh_tri];
+  return {DVec3(positions_[tri.verts[0]]), DVec3(positions_[tri.verts[1]]),
+          DVec3(positions_[tri.verts[2]])};
+}
+
+DVec2 SceneGeometry::GetMeshUv(uint32_t mesh_tri, double u, double v) const {
+  const MeshTriRecord& tri = mesh_tri_records_[mesh_tri];
+  return (1.0 - u - v) * DVec2(tex_coords_[tri.verts[0]]) +
+         u * DVec2(tex_coords_[tri.verts[1]]) +
+         v * DVec2(tex_coords_[tri.verts[2]]);
+}
+
+DVec3 SceneGeometry::GetInstanceNormal(uint32_t instance, uint32_t mesh_tri,
+                                       double u, double v) const {
+  const MeshTriRecord& tri = mesh_tri_records_[mesh_tri];
+  const DMat3& normal_transform = instances_[instance].normal_transform;
+  DVec3 normal = (1.0 - u - v) * DVec3(normals_[tri.verts[0]]) +
+                 u * DVec3(normals_[tri.verts[1]]) +
+                 v * DVec3(normals_[tri.verts[2]]);
+  return glm::normalize(normal_transform * normal);
+}
+
+size_t SceneGeometry::MemoryUsage() const {
+  return positions_.capacity() * sizeof(glm::vec3) +
+         normals_.capacity() * sizeof(glm::vec3) +
+         tex_coords_.capacity() * sizeof(glm::vec2) +
+         meshes_.capacity() * sizeof(MeshRecord) +
+         mesh_tri_records_.capacity() * sizeof(MeshTriRecord) +
+         mesh_tris_.capacity() * sizeof(MeshTri) +
+         instances_.capacity() * sizeof(Instance) +
+         records_.capacity() * sizeof(TriRecord) +
+         tris_.capacity() * sizeof(GeometryTri) +
+         object_first_tris_.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,217 @@
+#ifndef TRACER_SCENE_GEOMETRY_HPP
+#define TRACER_SCENE_GEOMETRY_HPP
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "learnopengl/glitter.hpp"
+#include "scene/primitives.hpp"
+#include "tracer/intersectable.hpp"
+
+class SceneGeometry;
+
+// A triangle of a `SceneGeometry` instance, in world space. It only refers to
+// its index, so a scene's triangles live in one contiguous vector instead of
+// one allocation each. Positions are transformed when needed, and normals and
+// texture coordinates are only read when a hit is shaded.
+class GeometryTri : public Shadeable {
+ public:
+  GeometryTri(const SceneGeometry* geometry, uint32_t index)
+      : geometry_(geometry), index_(index) {}
+  std::optional<ShadeablePoint> Intersect(const Ray& ray) override;
+  std::optional<DVec3> EarliestIntersect(const Ray& ray) override;
+  bool Occluded(const Ray& ray, double t_max) override;
+  AaBox GetAaBox() const override;
+  DVec3 EstimateCenter() const override;
+  bool IsShadeable() const override { return true; }
+  bool GetTriangle(std::array<DVec3, 3>* verts) const override;
+  Material* material() const override;
+  DVec2 GetUv(const ShadeablePoint& point) override;
+  DVec3 GetNormal(const ShadeablePoint& point) override;
+  Model* GetParentModel() override;
+  uint32_t GetPrimIndex() const override { return index_; }
+
+ private:
+  const SceneGeometry* geometry_;
+  uint32_t index_;
+};
+
+// A triangle of one of a `SceneGeometry`'s unique meshes, in the mesh's own
+// space. Two level structures trace these once per mesh and shade the hits
+// per instance; on its own it is shaded like the first instance of its mesh.
+class MeshTri : public Shadeable {
+ public:
+  MeshTri(const SceneGeometry* geometry, uint32_t index, uint32_t mesh)
+      : geometry_(geometry), index_(index), mesh_(mesh) {}
+  std::optional<ShadeablePoint> Intersect(const Ray& ray) override;
+  std::optional<DVec3> EarliestIntersect(const Ray& ray) override;
+  bool Occluded(const Ray& ray, double t_max) override;
+  AaBox GetAaBox() const override;
+  DVec3 EstimateCenter() const override;
+  bool IsShadeable() const override { return true; }
+  bool GetTriangle(std::array<DVec3, 3>* verts) const override;
+  Material* material() const override;
+  DVec2 GetUv(const ShadeablePoint& point) override;
+  DVec3 GetNormal(const ShadeablePoint& point) override;
+  Model* GetParentModel() override;
+  uint32_t GetPrimIndex() const override { return index_; }
+
+ private:
+  const SceneGeometry* geometry_;
+  uint32_t index_;
+  uint32_t mesh_;
+};
+
+// Compact storage for the triangles of a scene. Meshes are kept once per
+// unique vertex and index content, with vertices in float as loaded, and each
+// placement of a mesh is an instance that only stores its transform,
+// material and model.
+class SceneGeometry {
+ public:
+  struct Options {
+    // List every triangle of every instance in `tris()`, for the builders
+    // that take world space triangles. Otherwise the triangles of the unique
+    // meshes are listed in `mesh_tris()` instead, for two level structures
+    // such as `InstancedBvh`, and memory does not grow with the number of
+    // instances.
+    bool per_instance_tris = true;
+  };
+
+  SceneGeometry() = default;
+  explicit SceneGeometry(Options options) : options_(options) {}
+  SceneGeometry(const SceneGeometry&) = delete;
+  SceneGeometry& operator=(const SceneGeometry&) = delete;
+
+  // Adds a mesh placed with `mat` as a new instance, even if the mesh is
+  // empty. Meshes with the same vertices and indices as an earlier one share
+  // its storage. Invalidates pointers into `tris()` and `mesh_tris()`.
+  void AddMesh(const std::vector<Vertex>& vertices,
+               const std::vector<unsigned int>& indices, DMat4 mat,
+               Material* material, Model* model);
+  // Moves instance `instance`, numbered in the order of `AddMesh` calls, to
+  // `mat`.
+  void SetTransform(uint32_t instance, DMat4 mat);
+
+  // Starts a new object: the triangles added until the next call are
+  // expected to move together, and get their own subtree in a `DynamicBvh`.
+  // Triangles added before the first call form the first object. Does
+  // nothing if the current object is still empty.
+  void BeginObject();
+  size_t num_objects() const { return object_first_tris_.size(); }
+
+  // World space triangles of every instance; empty unless
+  // `Options::per_instance_tris` is set.
+  std::vector<GeometryTri>& tris() { return tris_; }
+  std::vector<Intersectable*> GetIntersectables();
+  std::vector<Intersectable*> GetObjectIntersectables(size_t object);
+
+  // World space positions of triangle `index`, computed exactly as
+  // `DVertex::Apply` would.
+  std::array<DVec3, 3> GetPositions(uint32_t index) const;
+  // Interpolates the vertex attributes of triangle `index` at barycentric
+  // weights `u` and `v` of its second and third vertices.
+  DVec2 GetUv(uint32_t index, double u, double v) const;
+  DVec3 GetNormal(uint32_t index, double u, double v) const;
+  Material* GetMaterial(uint32_t index) const;
+  Model* GetModel(uint32_t index) const;
+
+  size_t num_meshes() const { return meshes_.size(); }
+  size_t num_instances() const { return instances_.size(); }
+  // Triangles of the unique meshes, in mesh space; empty if
+  // `Options::per_instance_tris` is set.
+  std::vector<MeshTri>& mesh_tris() { return mesh_tris_; }
+  std::vector<Intersectable*> GetMeshIntersectables(uint32_t mesh);
+  uint32_t GetInstanceMesh(uint32_t instance) const {
+    return instances_[instance].mesh;
+  }
+  const DMat4& GetTransform(uint32_t instance) const {
+    return instances_[instance].transform;
+  }
+  Material* GetInstanceMaterial(uint32_t instance) const {
+    return instances_[instance].material;
+  }
+  Model* GetInstanceModel(uint32_t instance) const {
+    return instances_[instance].model;
+  }
+  // Hash of mesh `mesh`'s vertices and indices, the same for equal meshes in
+  // any scene.
+  uint64_t GetMeshHash(uint32_t mesh) const { return meshes_[mesh].hash; }
+  // Mesh triangles of mesh `mesh` are numbered from this.
+  uint32_t GetMeshFirstTri(uint32_t mesh) const {
+    return meshes_[mesh].first_tri;
+  }
+  uint32_t GetMeshNumTris(uint32_t mesh) const {
+    return meshes_[mesh].num_tris;
+  }
+  // The instance that added mesh `mesh` first.
+  uint32_t GetFirstInstance(uint32_t mesh) const {
+    return meshes_[mesh].first_instance;
+  }
+  // Like the per triangle versions above, for mesh triangle `mesh_tri`.
+  // Positions are in mesh space, and texture coordinates are the same for
+  // every placement of the mesh. Normals are those of the mesh placed by
+  // `instance`.
+  std::array<DVec3, 3> GetMeshPositions(uint32_t mesh_tri) const;
+  DVec2 GetMeshUv(uint32_t mesh_tri, double u, double v) const;
+  DVec3 GetInstanceNormal(uint32_t instance, uint32_t mesh_tri, double u,
+                          double v) const;
+
+  // Bytes held by this object's buffers.
+  size_t MemoryUsage() const;
+
+ private:
+  struct MeshRecord {
+    uint64_t hash;
+    uint32_t first_vertex;
+    uint32_t num_vertices;
+    uint32_t first_tri;
+    uint32_t num_tris;
+    uint32_t first_instance;
+  };
+
+  struct Instance {
+    DMat4 transform;
+    DMat3 normal_transform;
+    uint32_t mesh;
+    Material* material;
+    Model* model;
+  };
+
+  // Vertex indices into `positions_`, `normals_` and `tex_coords_`.
+  struct MeshTriRecord {
+    uint32_t verts[3];
+  };
+
+  struct TriRecord {
+    uint32_t mesh_tri;
+    uint32_t instance;
+  };
+
+  // Returns the id of the mesh with this content, adding it first if there
+  // is none.
+  uint32_t FindOrAddMesh(const std::vector<Vertex>& vertices,
+                         const std::vector<unsigned int>& indices,
+                         uint32_t instance);
+  bool MeshEquals(uint32_t mesh, const std::vector<Vertex>& vertices,
+                  const std::vector<unsigned int>& indices) const;
+
+  Options options_;
+  std::vector<glm::vec3> positions_;
+  std::vector<glm::vec3> normals_;
+  std::vector<glm::vec2> tex_coords_;
+  std::vector<MeshRecord> meshes_;
+  std::vector<MeshTriRecord> mesh_tri_records_;
+  std::vector<MeshTri> mesh_tris_;
+  std::vector<Instance> instances_;
+  std::vector<TriRecord> records_;
+  std::vector<GeometryTri> tris_;
+  // Index of the first triangle of each object.
+  std::vector<uint32_t> object_first_tris_ = {0};
+
+  // Mesh ids by a hash of their content.
+  std::unordered_multimap<uint64_t, uint32_t> mesh_ids_;
+};
+
+#endif
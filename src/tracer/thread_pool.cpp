@@ -0,0 +1,146 @@
+#include "tracer/thread_pool.hpp"
+
+#include <algorithm>
+#include <string>
+
+#include "profile/trace.hpp"
+
+namespace {
+
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local int current_worker = -1;
+
+}  // namespace
+
+ThreadPool::ThreadPool(int num_threads) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (int i = 0; i < num_threads - 1; i++) {
+    workers_.emplace_back(new Worker());
+  }
+  for (int i = 0; i < num_threads - 1; i++) {
+    threads_.emplace_back([this, i]() { WorkerLoop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)>& fn) {
+  if (workers_.empty() || count == 1) {
+    for (int i = 0; i < count; i++) {
+      fn(i);
+    }
+    return;
+  }
+  int self = CurrentWorker();
+  std::atomic<int> pending(count);
+  for (int i = 0; i < count; i++) {
+    // Outside threads deal the batch out round robin; workers keep it on their
+    // own deque and let idle workers steal.
+    int queue = self >= 0 ? self
+                          : (int)(next_queue_.fetch_add(1) % workers_.size());
+    Push(queue, {[&fn, i]() { fn(i); }, &pending});
+  }
+  Wait(self, pending);
+}
+
+void ThreadPool::Run(const std::function<void()>& a,
+                     const std::function<void()>& b) {
+  if (workers_.empty()) {
+    a();
+    b();
+    return;
+  }
+  int self = CurrentWorker();
+  std::atomic<int> pending(1);
+  int queue =
+      self >= 0 ? self : (int)(next_queue_.fetch_add(1) % workers_.size());
+  Push(queue, {b, &pending});
+  a();
+  Wait(self, pending);
+}
+
+void ThreadPool::Push(int queue, Task task) {
+  {
+    std::lock_guard<std::mutex> lock(workers_[queue]->mutex);
+    workers_[queue]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    queued_++;
+  }
+  wake_.notify_one();
+}
+
+bool ThreadPool::RunOne(int self) {
+  Task task;
+  bool found = false;
+  if (self >= 0) {
+    Worker& own = *workers_[self];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      found = true;
+    }
+  }
+  int num_workers = (int)workers_.size();
+  for (int i = 1; !found && i <= num_workers; i++) {
+    int victim_index = (self + i + num_workers) % num_workers;
+    if (victim_index == self) {
+      continue;
+    }
+    Worker& victim = *workers_[victim_index];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      found = true;
+    }
+  }
+  if (!found) {
+    return false;
+  }
+  queued_--;
+  task.fn();
+  task.pending->fetch_sub(1, std::memory_order_release);
+  return true;
+}
+
+void ThreadPool::Wait(int self, const std::atomic<int>& pending) {
+  while (pending.load(std::memory_order_acquire) > 0) {
+    if (!RunOne(self)) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void ThreadPool::WorkerLoop(int self) {
+  current_pool = this;
+  current_worker = self;
+  TRACE_THREAD_NAME("worker " + std::to_string(self));
+  while (true) {
+    if (RunOne(self)) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    wake_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+    if (stop_ && queued_ == 0) {
+      return;
+    }
+  }
+}
+
+int ThreadPool::CurrentWorker() const {
+  return current_pool == this ? current_worker : -1;
+}
@@ -0,0 +1,72 @@
+#ifndef TRACER_THREAD_POOL_HPP
+#define TRACER_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fork-join pool where every worker owns a task deque. Workers pop their
+// own newest task first and steal the oldest task from other workers when
+// they run dry, so large batches spread out while nested work stays local.
+//
+// Any thread that waits on a batch (including the thread that submitted it
+// and workers waiting on nested batches) runs queued tasks until the batch is
+// done, so `ParallelFor` and `Run` may be called from inside a task.
+class ThreadPool {
+ public:
+  // `num_threads` counts the calling thread, so 1 runs everything inline.
+  // Zero or less uses `std::thread::hardware_concurrency()`.
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Calls `fn(i)` for every `i` in [0, count) and returns once all calls have
+  // finished. Calls may run concurrently and in any order.
+  void ParallelFor(int count, const std::function<void(int)>& fn);
+
+  // Runs `a` and `b`, possibly concurrently, and returns once both finished.
+  void Run(const std::function<void()>& a, const std::function<void()>& b);
+
+  int num_threads() const { return (int)workers_.size() + 1; }
+
+ private:
+  struct Task {
+    std::function<void()> fn;
+    std::atomic<int>* pending;
+  };
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // `queue` is the index of the deque to push onto.
+  void Push(int queue, Task task);
+  // Runs one queued task, preferring `self`'s deque. Returns false if every
+  // deque was empty.
+  bool RunOne(int self);
+  void Wait(int self, const std::atomic<int>& pending);
+  void WorkerLoop(int self);
+  // Index of the calling thread's deque, or -1 for threads outside the pool.
+  int CurrentWorker() const;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+
+  // Guards sleeping workers; `queued_` is only incremented while it is held so
+  // that wake-ups are not lost.
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  std::atomic<int> queued_{0};
+  bool stop_ = false;
+  std::atomic<unsigned int> next_queue_{0};
+};
+
+#endif
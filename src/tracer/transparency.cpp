@@ -5,61 +5,83 @@
 
 #include "learnopengl/glitter.hpp"
 
+InsideModelStack::InsideModelStack(const InsideModelStack& other) {
+  *this = other;
+}
+
+InsideModelStack& InsideModelStack::operator=(const InsideModelStack& other) {
+  // Only the used entries are copied.
+  size_ = other.size_;
+  std::copy(other.inline_.begin(),
+            other.inline_.begin() + std::min(size_, kInlineSize),
+            inline_.begin());
+  spill_ = other.spill_;
+  return *this;
+}
+
 void InsideModelStack::Push(const ShadeablePoint& point) {
   const Model* model = point.shape->GetParentModel();
-  RemoveFromVector(model);
-  inside_stack_.push_back({model, point});
+  Remove(model);
+  Entry entry = {model, point.point, point.shape->material()};
+  if (size_ < kInlineSize) {
+    inline_[size_] = entry;
+  } else {
+    spill_.push_back(entry);
+  }
+  size_++;
 }
 
-bool InsideModelStack::Contains(const Model* model) {
-  auto iter =
-      std::find_if(inside_stack_.begin(), inside_stack_.end(),
-                   [model](const std::pair<const Model*, ShadeablePoint>& m) {
-                     return m.first == model;
-                   });
-  return iter != inside_stack_.end();
+bool InsideModelStack::Contains(const Model* model) const {
+  return Find(model) >= 0;
 }
 
-std::optional<ShadeablePoint> InsideModelStack::Pop(const Model* model) {
-  return RemoveFromVector(model);
+std::optional<InsideModelStack::Entry> InsideModelStack::Pop(
+    const Model* model) {
+  return Remove(model);
 }
 
-std::optional<ShadeablePoint> InsideModelStack::Get(const Model* model) {
-  auto iter =
-      std::find_if(inside_stack_.begin(), inside_stack_.end(),
-                   [model](const std::pair<const Model*, ShadeablePoint>& m) {
-                     return m.first == model;
-                   });
-  if (iter != inside_stack_.end()) {
-    return iter->second;
-  } else {
+std::optional<InsideModelStack::Entry> InsideModelStack::Get(
+    const Model* model) const {
+  int index = Find(model);
+  if (index < 0) {
     return std::nullopt;
   }
+  return at(index);
 }
 
-Material* InsideModelStack::CurrentMaterial() {
-  if (inside_stack_.empty()) {
+Material* InsideModelStack::CurrentMaterial() const {
+  if (size_ == 0) {
     return &air_;
   } else {
-    return inside_stack_.back().second.shape->material();
+    return at(size_ - 1).material;
   }
 }
 
-std::optional<ShadeablePoint> InsideModelStack::RemoveFromVector(
+int InsideModelStack::Find(const Model* model) const {
+  for (int i = 0; i < size_; i++) {
+    if (at(i).model == model) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+std::optional<InsideModelStack::Entry> InsideModelStack::Remove(
     const Model* model) {
-  std::optional<ShadeablePoint> point;
-  inside_stack_.erase(
-      std::remove_if(
-          inside_stack_.begin(), inside_stack_.end(),
-          [model, &point](const std::pair<const Model*, ShadeablePoint>& m) {
-            if (m.first == model) {
-              point = m.second;
-              return true;
-            }
-            return false;
-          }),
-      inside_stack_.end());
-  return point;
+  // A model is only ever on the stack once, since `Push` removes it first.
+  int index = Find(model);
+  if (index < 0) {
+    return std::nullopt;
+  }
+  Entry entry = at(index);
+  for (int i = index; i + 1 < size_; i++) {
+    at(i) = at(i + 1);
+  }
+  size_--;
+  if (size_ >= kInlineSize) {
+    spill_.pop_back();
+  }
+  return entry;
 }
 
 Material InsideModelStack::air_ = Material(Texture(), Material::Options({
@@ -1,10 +1,9 @@
 #ifndef TRACER_TRANSPARENCY_HPP
 #define TRACER_TRANSPARENCY_HPP
 
-#include <list>
-#include <map>
+#include <array>
 #include <optional>
-#include <utility>
+#include <vector>
 
 #include "learnopengl/glitter.hpp"
 #include "learnopengl/model.h"
@@ -12,21 +11,47 @@
 
 class Model;
 
+// The transparent models a ray is inside, most recently entered last. Up to
+// `kInlineSize` entries are held inline, so copying a stack for each bounce
+// does not touch the heap; deeper nesting spills into a vector.
 class InsideModelStack {
  public:
+  struct Entry {
+    const Model* model;
+    // Where the ray entered the model, and the model's material there.
+    DVec3 point;
+    Material* material;
+  };
+
+  InsideModelStack() = default;
+  InsideModelStack(const InsideModelStack& other);
+  InsideModelStack& operator=(const InsideModelStack& other);
+
   void Push(const ShadeablePoint& point);
-  bool Contains(const Model* model);
-  std::optional<ShadeablePoint> Pop(const Model* model);
-  std::optional<ShadeablePoint> Get(const Model* model);
+  bool Contains(const Model* model) const;
+  std::optional<Entry> Pop(const Model* model);
+  std::optional<Entry> Get(const Model* model) const;
   // Returns the material of the most recently pushed model
   // that has not been popped. If the stack is empty, returns
   // a pointer to the air material.
-  Material* CurrentMaterial();
+  Material* CurrentMaterial() const;
 
  private:
-  std::optional<ShadeablePoint> RemoveFromVector(const Model* model);
-
-  std::list<std::pair<const Model*, ShadeablePoint>> inside_stack_;
+  static constexpr int kInlineSize = 8;
+
+  Entry& at(int i) {
+    return i < kInlineSize ? inline_[i] : spill_[i - kInlineSize];
+  }
+  const Entry& at(int i) const {
+    return i < kInlineSize ? inline_[i] : spill_[i - kInlineSize];
+  }
+  // Returns the index of `model`'s entry, or -1.
+  int Find(const Model* model) const;
+  std::optional<Entry> Remove(const Model* model);
+
+  std::array<Entry, kInlineSize> inline_;
+  std::vector<Entry> spill_;
+  int size_ = 0;
   static Material air_;
 };
 
@@ -0,0 +1,230 @@
+#include "tracer/triangle_soa.hpp"
+
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+constexpr double kInfinity = std::numeric_limits<double>::infinity();
+
+}  // namespace
+
+size_t TriangleSoa::Add(const std::array<DVec3, 3>& verts) {
+  size_t index = size_++;
+  if (index % kWidth == 0) {
+    blocks_.emplace_back();
+  }
+  Block& block = blocks_.back();
+  int lane = index % kWidth;
+  DVec3 edge0 = verts[1] - verts[0];
+  DVec3 edge1 = verts[2] - verts[0];
+  for (int i = 0; i < 3; i++) {
+    block.v0[i][lane] = verts[0][i];
+    block.edge0[i][lane] = edge0[i];
+    block.edge1[i][lane] = edge1[i];
+  }
+  return index;
+}
+
+TriangleSoa TriangleSoa::View(const void* data, size_t size) {
+  TriangleSoa soa;
+  soa.view_ = static_cast<const Block*>(data);
+  soa.size_ = size;
+  return soa;
+}
+
+void TriangleSoa::Pad() {
+  // Zero edges give a zero determinant, which is always a miss.
+  while (size_ % kWidth != 0) {
+    Add({DVec3(0.0), DVec3(0.0), DVec3(0.0)});
+  }
+}
+
+// The arithmetic below mirrors `IntersectTri` operation for operation,
+// including glm's evaluation order for `cross` and `dot`.
+void TriangleSoa::IntersectBlockScalar(const BlockRay& ray, size_t first,
+                                       double* t, double* u,
+                                       double* v) const {
+  const Block& block = blocks()[first / kWidth];
+  double eps = epsilon(ray.origin);
+  const DVec3& dir = ray.dir;
+  for (int lane = 0; lane < kWidth; lane++) {
+    t[lane] = kInfinity;
+    u[lane] = 0.0;
+    v[lane] = 0.0;
+    DVec3 v0(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+    DVec3 edge0(block.edge0[0][lane], block.edge0[1][lane],
+                block.edge0[2][lane]);
+    DVec3 edge1(block.edge1[0][lane], block.edge1[1][lane],
+                block.edge1[2][lane]);
+    DVec3 p = glm::cross(dir, edge1);
+    double determinant = glm::dot(edge0, p);
+    if (determinant > -eps && determinant < eps) continue;
+    double inv_determinant = 1 / determinant;
+    DVec3 vert_to_origin = ray.origin - v0;
+    double bary_u = glm::dot(vert_to_origin, p) * inv_determinant;
+    if (bary_u < 0 || bary_u > 1) continue;
+    DVec3 q = glm::cross(vert_to_origin, edge0);
+    double bary_v = glm::dot(dir, q) * inv_determinant;
+    if (bary_v < 0 || bary_u + bary_v > 1) continue;
+    double dist = glm::dot(edge1, q) * inv_determinant;
+    if (dist > eps) {
+      t[lane] = dist;
+      u[lane] = bary_u;
+      v[lane] = bary_v;
+    }
+  }
+}
+
+#if defined(__AVX2__)
+
+void TriangleSoa::IntersectBlock(const BlockRay& ray, size_t first,
+                                 double* t, double* u, double* v) const {
+  const Block& block = blocks()[first / kWidth];
+  __m256d eps = _mm256_set1_pd(epsilon(ray.origin));
+  __m256d neg_eps = _mm256_set1_pd(-epsilon(ray.origin));
+  __m256d zero = _mm256_setzero_pd();
+  __m256d one = _mm256_set1_pd(1.0);
+  __m256d dx = _mm256_set1_pd(ray.dir.x);
+  __m256d dy = _mm256_set1_pd(ray.dir.y);
+  __m256d dz = _mm256_set1_pd(ray.dir.z);
+  __m256d e0x = _mm256_load_pd(block.edge0[0]);
+  __m256d e0y = _mm256_load_pd(block.edge0[1]);
+  __m256d e0z = _mm256_load_pd(block.edge0[2]);
+  __m256d e1x = _mm256_load_pd(block.edge1[0]);
+  __m256d e1y = _mm256_load_pd(block.edge1[1]);
+  __m256d e1z = _mm256_load_pd(block.edge1[2]);
+
+  // p = cross(dir, edge1)
+  __m256d px = _mm256_sub_pd(_mm256_mul_pd(dy, e1z), _mm256_mul_pd(dz, e1y));
+  __m256d py = _mm256_sub_pd(_mm256_mul_pd(dz, e1x), _mm256_mul_pd(dx, e1z));
+  __m256d pz = _mm256_sub_pd(_mm256_mul_pd(dx, e1y), _mm256_mul_pd(dy, e1x));
+  __m256d det = _mm256_add_pd(
+      _mm256_add_pd(_mm256_mul_pd(e0x, px), _mm256_mul_pd(e0y, py)),
+      _mm256_mul_pd(e0z, pz));
+  __m256d miss = _mm256_and_pd(_mm256_cmp_pd(det, neg_eps, _CMP_GT_OQ),
+                               _mm256_cmp_pd(det, eps, _CMP_LT_OQ));
+  __m256d inv_det = _mm256_div_pd(one, det);
+
+  __m256d sx = _mm256_sub_pd(_mm256_set1_pd(ray.origin.x),
+                             _mm256_load_pd(block.v0[0]));
+  __m256d sy = _mm256_sub_pd(_mm256_set1_pd(ray.origin.y),
+                             _mm256_load_pd(block.v0[1]));
+  __m256d sz = _mm256_sub_pd(_mm256_set1_pd(ray.origin.z),
+                             _mm256_load_pd(block.v0[2]));
+  __m256d bary_u = _mm256_mul_pd(
+      _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(sx, px), _mm256_mul_pd(sy, py)),
+          _mm256_mul_pd(sz, pz)),
+      inv_det);
+  miss = _mm256_or_pd(miss, _mm256_cmp_pd(bary_u, zero, _CMP_LT_OQ));
+  miss = _mm256_or_pd(miss, _mm256_cmp_pd(bary_u, one, _CMP_GT_OQ));
+
+  // q = cross(vert_to_origin, edge0)
+  __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e0z), _mm256_mul_pd(sz, e0y));
+  __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e0x), _mm256_mul_pd(sx, e0z));
+  __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e0y), _mm256_mul_pd(sy, e0x));
+  __m256d bary_v = _mm256_mul_pd(
+      _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)),
+          _mm256_mul_pd(dz, qz)),
+      inv_det);
+  miss = _mm256_or_pd(miss, _mm256_cmp_pd(bary_v, zero, _CMP_LT_OQ));
+  miss = _mm256_or_pd(
+      miss, _mm256_cmp_pd(_mm256_add_pd(bary_u, bary_v), one, _CMP_GT_OQ));
+
+  __m256d dist = _mm256_mul_pd(
+      _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(e1x, qx), _mm256_mul_pd(e1y, qy)),
+          _mm256_mul_pd(e1z, qz)),
+      inv_det);
+  __m256d hit =
+      _mm256_andnot_pd(miss, _mm256_cmp_pd(dist, eps, _CMP_GT_OQ));
+  _mm256_storeu_pd(t, _mm256_blendv_pd(_mm256_set1_pd(kInfinity), dist, hit));
+  _mm256_storeu_pd(u, bary_u);
+  _mm256_storeu_pd(v, bary_v);
+}
+
+#elif defined(__SSE2__)
+
+void TriangleSoa::IntersectBlock(const BlockRay& ray, size_t first,
+                                 double* t, double* u, double* v) const {
+  const Block& block = blocks()[first / kWidth];
+  __m128d eps = _mm_set1_pd(epsilon(ray.origin));
+  __m128d neg_eps = _mm_set1_pd(-epsilon(ray.origin));
+  __m128d zero = _mm_setzero_pd();
+  __m128d one = _mm_set1_pd(1.0);
+  __m128d inf = _mm_set1_pd(kInfinity);
+  __m128d dx = _mm_set1_pd(ray.dir.x);
+  __m128d dy = _mm_set1_pd(ray.dir.y);
+  __m128d dz = _mm_set1_pd(ray.dir.z);
+  __m128d ox = _mm_set1_pd(ray.origin.x);
+  __m128d oy = _mm_set1_pd(ray.origin.y);
+  __m128d oz = _mm_set1_pd(ray.origin.z);
+  // Two lanes at a time.
+  for (int lane = 0; lane < kWidth; lane += 2) {
+    __m128d e0x = _mm_load_pd(&block.edge0[0][lane]);
+    __m128d e0y = _mm_load_pd(&block.edge0[1][lane]);
+    __m128d e0z = _mm_load_pd(&block.edge0[2][lane]);
+    __m128d e1x = _mm_load_pd(&block.edge1[0][lane]);
+    __m128d e1y = _mm_load_pd(&block.edge1[1][lane]);
+    __m128d e1z = _mm_load_pd(&block.edge1[2][lane]);
+
+    // p = cross(dir, edge1)
+    __m128d px = _mm_sub_pd(_mm_mul_pd(dy, e1z), _mm_mul_pd(dz, e1y));
+    __m128d py = _mm_sub_pd(_mm_mul_pd(dz, e1x), _mm_mul_pd(dx, e1z));
+    __m128d pz = _mm_sub_pd(_mm_mul_pd(dx, e1y), _mm_mul_pd(dy, e1x));
+    __m128d det =
+        _mm_add_pd(_mm_add_pd(_mm_mul_pd(e0x, px), _mm_mul_pd(e0y, py)),
+                   _mm_mul_pd(e0z, pz));
+    __m128d miss =
+        _mm_and_pd(_mm_cmpgt_pd(det, neg_eps), _mm_cmplt_pd(det, eps));
+    __m128d inv_det = _mm_div_pd(one, det);
+
+    __m128d sx = _mm_sub_pd(ox, _mm_load_pd(&block.v0[0][lane]));
+    __m128d sy = _mm_sub_pd(oy, _mm_load_pd(&block.v0[1][lane]));
+    __m128d sz = _mm_sub_pd(oz, _mm_load_pd(&block.v0[2][lane]));
+    __m128d bary_u = _mm_mul_pd(
+        _mm_add_pd(_mm_add_pd(_mm_mul_pd(sx, px), _mm_mul_pd(sy, py)),
+                   _mm_mul_pd(sz, pz)),
+        inv_det);
+    miss = _mm_or_pd(miss, _mm_cmplt_pd(bary_u, zero));
+    miss = _mm_or_pd(miss, _mm_cmpgt_pd(bary_u, one));
+
+    // q = cross(vert_to_origin, edge0)
+    __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, e0z), _mm_mul_pd(sz, e0y));
+    __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, e0x), _mm_mul_pd(sx, e0z));
+    __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, e0y), _mm_mul_pd(sy, e0x));
+    __m128d bary_v = _mm_mul_pd(
+        _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)),
+                   _mm_mul_pd(dz, qz)),
+        inv_det);
+    miss = _mm_or_pd(miss, _mm_cmplt_pd(bary_v, zero));
+    miss = _mm_or_pd(miss, _mm_cmpgt_pd(_mm_add_pd(bary_u, bary_v), one));
+
+    __m128d dist = _mm_mul_pd(
+        _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, qx), _mm_mul_pd(e1y, qy)),
+                   _mm_mul_pd(e1z, qz)),
+        inv_det);
+    __m128d hit = _mm_andnot_pd(miss, _mm_cmpgt_pd(dist, eps));
+    // SSE2 has no blend.
+    _mm_storeu_pd(t + lane, _mm_or_pd(_mm_and_pd(hit, dist),
+                                      _mm_andnot_pd(hit, inf)));
+    _mm_storeu_pd(u + lane, bary_u);
+    _mm_storeu_pd(v + lane, bary_v);
+  }
+}
+
+#else
+
+void TriangleSoa::IntersectBlock(const BlockRay& ray, size_t first,
+                                 double* t, double* u, double* v) const {
+  IntersectBlockScalar(ray, first, t, u, v);
+}
+
+#endif
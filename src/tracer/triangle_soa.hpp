@@ -0,0 +1,73 @@
+#ifndef TRACER_TRIANGLE_SOA_HPP
+#define TRACER_TRIANGLE_SOA_HPP
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "learnopengl/glitter.hpp"
+
+// Triangles stored for Möller–Trumbore tests in blocks of `kWidth`, with each
+// component of vertex 0 and both edges laid out contiguously per block. The
+// kernels do the same double precision arithmetic as `IntersectTri`, so they
+// report exactly the same hits.
+class TriangleSoa {
+ public:
+  static constexpr int kWidth = 4;
+
+  // A ray prepared once for any number of blocks. `dir` must be normalized.
+  struct BlockRay {
+    DVec3 origin;
+    DVec3 dir;
+  };
+
+  // Appends a triangle and returns its slot index.
+  size_t Add(const std::array<DVec3, 3>& verts);
+  // Appends triangles that are never hit until `size()` is a multiple of
+  // `kWidth`.
+  void Pad();
+
+  // Sets `t[i]` to the distance along the ray to triangle `first + i`, or
+  // infinity if it is missed, for every `i` in [0, kWidth). `u[i]` and `v[i]`
+  // are set to the barycentric weights of the second and third vertices, and
+  // are only meaningful for hits. `first` must be a multiple of `kWidth`.
+  void IntersectBlock(const BlockRay& ray, size_t first, double* t, double* u,
+                      double* v) const;
+  // Portable version of `IntersectBlock`, used as the reference for the SIMD
+  // kernels and on targets without SSE2.
+  void IntersectBlockScalar(const BlockRay& ray, size_t first, double* t,
+                            double* u, double* v) const;
+
+  size_t size() const { return size_; }
+  // Bytes held by this object's buffers.
+  size_t MemoryUsage() const { return blocks_.capacity() * sizeof(Block); }
+
+  // The raw blocks, `data_size()` bytes, e.g. for writing to a file.
+  const void* data() const { return blocks(); }
+  size_t data_size() const { return DataSize(size_); }
+  // Bytes of data that hold `size` slots.
+  static size_t DataSize(size_t size) {
+    return (size + kWidth - 1) / kWidth * sizeof(Block);
+  }
+  // Alignment that `View` requires of its data.
+  static constexpr size_t kDataAlignment = 32;
+  // A read-only store over `size` slots laid out as `data()` lays them out,
+  // which is used in place and must outlive the store. Nothing may be added.
+  static TriangleSoa View(const void* data, size_t size);
+
+ private:
+  struct alignas(kDataAlignment) Block {
+    double v0[3][kWidth];
+    double edge0[3][kWidth];
+    double edge1[3][kWidth];
+  };
+
+  const Block* blocks() const { return view_ ? view_ : blocks_.data(); }
+
+  std::vector<Block> blocks_;
+  // Set for views instead of `blocks_`.
+  const Block* view_ = nullptr;
+  size_t size_ = 0;
+};
+
+#endif